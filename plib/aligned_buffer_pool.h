@@ -0,0 +1,98 @@
+//
+//  aligned_buffer_pool.h
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 15, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#ifndef VM_PERSISTENCE_PLIB_ALIGNED_BUFFER_POOL_H_
+#define VM_PERSISTENCE_PLIB_ALIGNED_BUFFER_POOL_H_
+
+#include <cassert>
+#include <cstdlib>
+#include <vector>
+#include <mutex>
+
+namespace plib {
+
+// Recycles aligned staging buffers for direct I/O. Buffers are kept in free
+// lists by power-of-two size, the smallest of which is the alignment.
+class AlignedBufferPool {
+ public:
+  AlignedBufferPool(size_t alignment = 4096, size_t max_free = 64);
+  ~AlignedBufferPool();
+  AlignedBufferPool(const AlignedBufferPool &) = delete;
+  AlignedBufferPool &operator=(const AlignedBufferPool &) = delete;
+
+  size_t alignment() const { return alignment_; }
+
+  // Returns a buffer of at least the size, or nullptr if out of memory.
+  char *Allocate(size_t size);
+  // Takes back a buffer of the size it was allocated with.
+  void Free(char *buf, size_t size);
+
+ private:
+  static const int kNumClasses = 48;
+
+  int SizeClass(size_t size) const;
+
+  const size_t alignment_;
+  const size_t max_free_; // per size class
+  std::vector<char *> free_[kNumClasses];
+  std::mutex mutex_;
+};
+
+// Implementation of AlignedBufferPool
+
+inline AlignedBufferPool::AlignedBufferPool(size_t alignment,
+    size_t max_free) : alignment_(alignment), max_free_(max_free) {
+  assert(alignment && !(alignment & (alignment - 1)));
+}
+
+inline AlignedBufferPool::~AlignedBufferPool() {
+  for (std::vector<char *> &list : free_) {
+    for (char *buf : list) {
+      free(buf);
+    }
+  }
+}
+
+inline int AlignedBufferPool::SizeClass(size_t size) const {
+  int c = 0;
+  while ((alignment_ << c) < size) ++c;
+  assert(c < kNumClasses);
+  return c;
+}
+
+inline char *AlignedBufferPool::Allocate(size_t size) {
+  int c = SizeClass(size);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!free_[c].empty()) {
+      char *buf = free_[c].back();
+      free_[c].pop_back();
+      return buf;
+    }
+  }
+  void *buf = nullptr;
+  if (posix_memalign(&buf, alignment_, alignment_ << c)) return nullptr;
+  return (char *)buf;
+}
+
+inline void AlignedBufferPool::Free(char *buf, size_t size) {
+  if (!buf) return;
+  int c = SizeClass(size);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_[c].size() < max_free_) {
+      free_[c].push_back(buf);
+      return;
+    }
+  }
+  free(buf);
+}
+
+} // namespace plib
+
+#endif // VM_PERSISTENCE_PLIB_ALIGNED_BUFFER_POOL_H_
@@ -12,57 +12,124 @@
 #include "file_store.h"
 
 #include <ctime>
-#include <cassert>
 #include <cstring>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <aio.h>
 #include <boost/pool/pool_alloc.hpp>
 #include "format.h"
 
 namespace plib {
 
+// Metadata records of concurrent commits are gathered in memory and
+// appended by a background writer in batches, each with one write and, if
+// commits wait to be durable, one sync. If framed, a batch is packed in
+// frames.
 template <typename DataEntry>
 class AsyncFileStore : public FileStore<DataEntry> {
  public:
-  AsyncFileStore(const char *name, int num_files) :
-      FileStore<DataEntry>(name, num_files) { }
+  AsyncFileStore(const char *name, int num_files, off_t segment_size = 0);
+  ~AsyncFileStore();
 
   void *Submit(DataEntry data[], uint32_t n);
   int Commit(void *handle, uint64_t timestamp, uint64_t meta[], uint32_t n);
+
+  // Number of metadata batches written
+  uint64_t num_meta_batches() const { return written_batch_; }
+
  private:
-  void AioWrite(aiocb *cb, File &file,
-      void *buf, size_t nbytes, int priority = 0);
-  void AioSuspend(aiocb *cb, int sec = 0);
+  using Record = typename FileStore<DataEntry>::Record;
+
+  void RunMetaWriter();
+  bool MetaPending() const {
+    return !meta_lengths_.empty() || !meta_frames_.empty();
+  }
+
+  // Returns nonzero if the write cannot be issued.
+  int AioWrite(aiocb *cb, File &file, void *buf, size_t nbytes,
+      uint64_t pos, int priority = 0);
+  // Waits for a write and returns the number of bytes written, or -1 if it
+  // failed or was not issued.
+  ssize_t AioWait(aiocb *cb);
 
   struct AsyncHandle {
+    aiocb header_cb;
     aiocb cb;
+    char header[sizeof(DataHeader)];
+    char *staged; // the whole record in direct mode
+    uint64_t pos; // of the data header
+    size_t len; // of the record
     unsigned int seq;
+    unsigned int epoch;
+    int err; // if nothing is written
   };
   boost::fast_pool_allocator<AsyncHandle> handle_pool_;
+
+  std::vector<char> meta_batch_; // records to write
+  std::vector<size_t> meta_lengths_;
+  std::vector<FrameBuilder> meta_frames_;
+  uint64_t next_batch_; // being gathered
+  std::atomic<uint64_t> written_batch_;
+  off_t meta_end_; // of the last batch written
+  int meta_error_; // sticky
+  bool stop_meta_writer_;
+  std::thread meta_writer_;
+  std::mutex meta_mutex_;
+  std::condition_variable meta_cv_; // wakes up the writer
+  std::condition_variable written_cv_; // wakes up the committers
 };
 
 template <typename DataEntry>
-inline void AsyncFileStore<DataEntry>::AioWrite(aiocb *cb, File &file,
-    void *buf, size_t nbytes, int priority) {
-  file.lock();
-  cb->aio_fildes = file.descriptor();
-  cb->aio_offset = file.offset();
+AsyncFileStore<DataEntry>::AsyncFileStore(const char *name, int num_files,
+    off_t segment_size) : FileStore<DataEntry>(name, num_files, segment_size),
+    next_batch_(1), written_batch_(0), meta_end_(0), meta_error_(0),
+    stop_meta_writer_(false) {
+  meta_writer_ = std::thread(&AsyncFileStore<DataEntry>::RunMetaWriter, this);
+}
+
+template <typename DataEntry>
+AsyncFileStore<DataEntry>::~AsyncFileStore() {
+  {
+    std::lock_guard<std::mutex> lock(meta_mutex_);
+    stop_meta_writer_ = true;
+  }
+  meta_cv_.notify_one();
+  meta_writer_.join();
+}
+
+template <typename DataEntry>
+inline int AsyncFileStore<DataEntry>::AioWrite(aiocb *cb, File &file,
+    void *buf, size_t nbytes, uint64_t pos, int priority) {
+  memset(cb, 0, sizeof(*cb)); // no completion notification
+  cb->aio_fildes = file.descriptor(pos);
+  cb->aio_offset = file.SegmentOffset(pos);
   cb->aio_buf = buf;
   cb->aio_nbytes = nbytes;
   cb->aio_reqprio = priority;
-  file.inc_offset(nbytes);
-  file.unlock();
 
-  int err = aio_write(cb);
-  assert(!err);
+  if (cb->aio_fildes < 0 || aio_write(cb)) {
+    perror("[ERROR] AsyncFileStore::AioWrite");
+    cb->aio_fildes = -1; // not issued
+    return -1;
+  }
+  return 0;
 }
 
 template <typename DataEntry>
-inline void AsyncFileStore<DataEntry>::AioSuspend(aiocb *cb, int sec) {
+inline ssize_t AsyncFileStore<DataEntry>::AioWait(aiocb *cb) {
+  if (cb->aio_fildes < 0) return -1;
   aiocb *list[1] = { cb };
-  timespec time = { sec, 0 };
-  timespec *tp = sec ? &time : nullptr;
-  int err = aio_suspend(list, 1, tp);
-  assert(!err);
+  while (aio_error(cb) == EINPROGRESS) {
+    if (aio_suspend(list, 1, nullptr) && errno != EINTR) {
+      perror("[ERROR] AsyncFileStore::AioWait aio_suspend");
+    }
+  }
+  int err = aio_error(cb);
+  ssize_t ret = aio_return(cb);
+  if (ret < 0) errno = err;
+  return ret;
 }
 
 // Implementation
@@ -75,7 +142,29 @@ void *AsyncFileStore<DataEntry>::Submit(DataEntry data[], uint32_t n) {
 
   uint32_t size = sizeof(DataEntry) * n;
   AsyncHandle *handle = handle_pool_.allocate();
-  AioWrite(&handle->cb, f, data, size);
+  handle->seq = seq;
+  handle->epoch = this->EnterCommit();
+  handle->staged = nullptr;
+  handle->err = 0;
+  if (!this->CommitFits(index, this->direct_block_size() ?
+      this->StagedLength(size) : sizeof(DataHeader) + size, n)) {
+    handle->err = EINVAL;
+    return handle;
+  }
+  if (this->direct_block_size()) {
+    off_t pos;
+    handle->staged = this->StageRawData(index, data, size, &pos, &handle->len);
+    handle->pos = pos;
+    AioWrite(&handle->cb, f, handle->staged, handle->len, pos);
+    return handle;
+  }
+  EncodeDataHeader(handle->header, kRawData, 0, size);
+  handle->len = sizeof(handle->header) + size;
+  uint64_t pos = f.Reserve(handle->len);
+  handle->pos = pos;
+  this->write_counters_.AddRecord(size, sizeof(handle->header));
+  AioWrite(&handle->header_cb, f, handle->header, sizeof(handle->header), pos);
+  AioWrite(&handle->cb, f, data, size, pos + sizeof(handle->header));
   return handle;
 }
 
@@ -83,29 +172,112 @@ template <typename DataEntry>
 int AsyncFileStore<DataEntry>::Commit(void *handle, uint64_t timestamp,
     uint64_t metadata[], uint32_t n) {
   AsyncHandle *ah = (AsyncHandle *)handle;
-  uint64_t pos = ah->cb.aio_offset;
+  uint64_t pos = ah->pos + sizeof(ah->header); // of the payload
+  unsigned int epoch = ah->epoch;
+  if (ah->err) {
+    int err = ah->err;
+    handle_pool_.deallocate(ah);
+    this->ExitCommit(epoch);
+    return err;
+  }
   uint8_t index = this->OutIndex(ah->seq);
-  AioSuspend(&ah->cb);
+  size_t nbytes = ah->len;
+  off_t data_end = ah->pos + nbytes;
+  // Both writes are waited for before the handle holding them is freed.
+  ssize_t header_count = ah->staged ? 0 : AioWait(&ah->header_cb);
+  ssize_t data_count = AioWait(&ah->cb);
+  size_t count = std::max<ssize_t>(header_count, 0) +
+      std::max<ssize_t>(data_count, 0);
+  bool written = header_count >= 0 && data_count >= 0 && count == nbytes;
+  File &f = this->out_files_[index];
+  f.CountWrites(ah->staged ? 1 : 2, count);
+  if (written) f.Complete(ah->pos, nbytes);
+  if (ah->staged) this->ReleaseStaged(ah->staged, nbytes);
   handle_pool_.deallocate(ah);
+  if (!written) {
+    perror("[ERROR] AsyncFileStore::Commit aio");
+    f.SetError(EIO); // the range stays unwritten
+    this->ExitCommit(epoch);
+    return EIO;
+  }
 
-  size_t len = MetaLength(n);
-  char meta_buf[len];
-  char *end = EncodeMeta(meta_buf, timestamp, metadata, n, index, pos);
-  assert(size_t(end - meta_buf) == len);
+  const bool framed = this->framed();
+  size_t len = framed ? FramedMetaLength(n) : MetaLength(n);
+  off_t meta_end;
+  int err;
+  {
+    std::unique_lock<std::mutex> lock(meta_mutex_);
+    bool idle = !MetaPending();
+    if (framed) {
+      this->NextFrame(&meta_frames_, kMetaFrame, 0, len).AddMeta(timestamp,
+          metadata, n, index, pos);
+    } else {
+      size_t offset = meta_batch_.size();
+      meta_batch_.resize(offset + len);
+      char *end = EncodeMeta(meta_batch_.data() + offset, timestamp, metadata,
+          n, index, pos);
+      len = end - (meta_batch_.data() + offset);
+      meta_batch_.resize(offset + len);
+      meta_lengths_.push_back(len);
+    }
+    uint64_t batch = next_batch_;
+    if (idle) meta_cv_.notify_one();
+    written_cv_.wait(lock, [this, batch]() { return written_batch_ >= batch; });
+    meta_end = meta_end_;
+    err = meta_error_;
+  }
+  if (!err) this->IndexMeta(timestamp, metadata, n, index, pos);
+  this->ExitCommit(epoch);
+  if (err) return err;
+  this->write_counters_.AddMeta(len);
+  return this->Committed(index, data_end, meta_end, nbytes + len);
+}
 
+// Writes what commits have gathered while the last batch was written.
+template <typename DataEntry>
+void AsyncFileStore<DataEntry>::RunMetaWriter() {
   File &mf = this->out_files_[0]; // metadata file
-  mf.lock();
-  size_t count = write(mf.descriptor(), meta_buf, len);
-  mf.inc_offset(count);
+  std::vector<char> batch;
+  std::vector<size_t> lengths;
+  std::vector<FrameBuilder> frames;
+  std::vector<Record> records;
+  std::vector<off_t> pos;
+  std::unique_lock<std::mutex> lock(meta_mutex_);
+  while (true) {
+    meta_cv_.wait(lock,
+        [this]() { return stop_meta_writer_ || MetaPending(); });
+    if (!MetaPending()) break; // stopped
+    batch.swap(meta_batch_);
+    lengths.swap(meta_lengths_);
+    frames.swap(meta_frames_);
+    meta_batch_.clear();
+    meta_lengths_.clear();
+    meta_frames_.clear();
+    uint64_t id = next_batch_++;
+    lock.unlock();
 
-  if ((ah->seq + 1) % this->sync_freq() == 0) {
-    for (File &f : this->out_files_) {
-      fdatasync(f.descriptor());
+    records.clear();
+    char *p = batch.data();
+    for (size_t len : lengths) {
+      records.push_back({ { { p, len } }, 1, len });
+      p += len;
     }
+    for (FrameBuilder &frame : frames) {
+      records.push_back({ { { (char *)frame.data(), frame.length() } }, 1,
+          frame.length(), &frame });
+    }
+    pos.resize(records.size());
+    int err = this->WriteRuns(0, records, pos.data()) ? EIO : 0;
+    off_t end = pos.back() + records.back().len;
+    if (!err && this->wait_durable() && mf.SyncTo(end)) err = EIO;
+    if (err) perror("[ERROR] AsyncFileStore::RunMetaWriter");
+
+    lock.lock();
+    if (err) meta_error_ = err;
+    meta_end_ = end;
+    written_batch_ = id;
+    written_cv_.notify_all();
   }
-  mf.unlock();
-  assert(count == len);
-  return 0;
 }
 
 } // namespace plib
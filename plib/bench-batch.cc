@@ -0,0 +1,87 @@
+//
+//  bench-batch.cc
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 17, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+#include "sync_file_store.h"
+
+using DataEntry = int64_t;
+
+off_t LogSize(int num_files) {
+  off_t size = 0;
+  for (int i = 0; i <= num_files; ++i) {
+    struct stat st;
+    if (!stat(("log_batch_" + std::to_string(i)).c_str(), &st)) {
+      size += st.st_size;
+    }
+  }
+  return size;
+}
+
+// Commits batches of entries from one checkpoint thread, either with
+// CommitBatch() or one by one with "-l". With "-f", batches are framed.
+int main(int argc, const char *argv[]) {
+  using namespace std::chrono;
+
+  bool one_by_one = (argc > 4 && strcmp(argv[argc - 1], "-l") == 0);
+  bool framed = (argc > 4 && strcmp(argv[argc - 1], "-f") == 0);
+  if (one_by_one || framed) --argc;
+  if (argc < 5) {
+    printf("Usage: %s BLOCK_SIZE BATCH_SIZE #FILES #RUNS [-l | -f]\n",
+        argv[0]);
+    return 1;
+  }
+
+  int num_entries = atoi(argv[1]) / sizeof(DataEntry);
+  int batch_size = atoi(argv[2]);
+  int num_files = atoi(argv[3]);
+  int num_runs = atoi(argv[4]);
+
+  plib::SyncFileStore<DataEntry> store("log_batch_", num_files);
+  store.set_framed(framed);
+  off_t size = LogSize(num_files);
+  std::vector<DataEntry> mem(num_entries * batch_size);
+  std::vector<uint64_t> meta(num_entries * batch_size);
+  for (size_t i = 0; i < meta.size(); ++i) {
+    meta[i] = (uint64_t)(mem.data() + i);
+  }
+  std::vector<plib::CommitEntry<DataEntry>> entries(batch_size);
+
+  uint64_t timestamp = 0;
+  high_resolution_clock::time_point t1 = high_resolution_clock::now();
+  for (int r = 0; r < num_runs; ++r) {
+    for (int i = 0; i < batch_size; ++i) {
+      entries[i] = { mem.data() + num_entries * i,
+          meta.data() + num_entries * i, (uint32_t)num_entries, ++timestamp };
+    }
+    int err = one_by_one ?
+        store.plib::VersionedPersistence<DataEntry>::CommitBatch(
+            entries.data(), batch_size) :
+        store.CommitBatch(entries.data(), batch_size);
+    assert(!err);
+  }
+  high_resolution_clock::time_point t2 = high_resolution_clock::now();
+  int64_t latency = duration_cast<nanoseconds>(t2 - t1).count() / num_runs;
+  size = LogSize(num_files) - size;
+  // latency per batch (ns), per entry (ns), log bytes per entry
+  printf("%ld\t%ld\t%f\n", latency, latency / batch_size,
+      (double)size / num_runs / batch_size);
+  // payload, header, padding and metadata bytes, write calls, average
+  // write size and write amplification
+  plib::WriteStats ws = store.write_stats();
+  fprintf(stderr, "%lu\t%lu\t%lu\t%lu\t%lu\t%f\t%f\n", ws.payload_bytes,
+      ws.header_bytes, ws.padding_bytes, ws.metadata_bytes, ws.write_calls,
+      ws.average_write_size(), ws.amplification());
+}
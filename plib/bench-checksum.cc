@@ -0,0 +1,138 @@
+//
+//  bench-checksum.cc
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 18, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <zlib.h>
+
+#include "checksum.h"
+#include "format.h"
+
+uint32_t ZlibCRC32(uint32_t crc, const void *data, size_t nbytes) {
+  return crc32(crc, (const unsigned char *)data, nbytes);
+}
+
+// Returns throughput in GB/s of running the checksum over the block.
+template <typename Checksum>
+double Measure(Checksum checksum, size_t size, int num_runs) {
+  using namespace std::chrono;
+
+  uint32_t crc = 0;
+  high_resolution_clock::time_point t1 = high_resolution_clock::now();
+  for (int i = 0; i < num_runs; ++i) {
+    crc = checksum(crc);
+  }
+  high_resolution_clock::time_point t2 = high_resolution_clock::now();
+  volatile uint32_t sink = crc;
+  (void)sink;
+  double ns = duration_cast<nanoseconds>(t2 - t1).count();
+  return (double)size * num_runs / ns;
+}
+
+int main(int argc, const char *argv[]) {
+  if (argc < 3) {
+    printf("Usage: %s BLOCK_SIZE #RUNS\n", argv[0]);
+    return 1;
+  }
+
+  size_t block_size = atoi(argv[1]);
+  int num_runs = atoi(argv[2]);
+
+  std::vector<char> buf(block_size + 1);
+  for (char &c : buf) c = rand();
+  std::vector<char> dst(block_size + sizeof(plib::DataHeader));
+
+  struct Kernel {
+    const char *name;
+    plib::CRC32CFunction function;
+  };
+  std::vector<Kernel> kernels = { { "zlib", ZlibCRC32 },
+      { "portable", plib::CRC32CPortable } };
+  const char *selected;
+  plib::CRC32CFunction best = plib::SelectCRC32C(&selected);
+#if defined(__x86_64__)
+  if (best != plib::CRC32CPortable) {
+    kernels.push_back({ "sse4.2", plib::CRC32CSSE42 });
+  }
+  if (best == plib::CRC32CPCLMUL) {
+    kernels.push_back({ "pclmul", plib::CRC32CPCLMUL });
+  }
+#endif
+
+  // All CRC32C kernels agree, on aligned and unaligned data.
+  for (size_t i = 2; i < kernels.size(); ++i) {
+    for (int offset = 0; offset < 2; ++offset) {
+      uint32_t expected = plib::CRC32CPortable(0, buf.data() + offset,
+          block_size);
+      uint32_t crc = kernels[i].function(0, buf.data() + offset, block_size);
+      assert(crc == expected);
+      (void)crc;
+      (void)expected;
+    }
+  }
+
+  // All copy kernels, with and without streaming stores, write the same
+  // bytes and checksum as the portable one, at unaligned destinations and
+  // odd lengths, and nothing around them.
+  std::vector<plib::CRC32CCopyFunction> copies;
+#if defined(__x86_64__)
+  if (best != plib::CRC32CPortable) copies.push_back(plib::CRC32CCopySSE42);
+  if (best == plib::CRC32CPCLMUL) copies.push_back(plib::CRC32CCopyPCLMUL);
+#endif
+  const size_t kGuard = 64;
+  std::vector<char> expected(block_size + 2 * kGuard);
+  std::vector<char> copied(block_size + 2 * kGuard);
+  const size_t lengths[] = { 1, 7, 63, 65, 4095, block_size - 1, block_size };
+  for (plib::CRC32CCopyFunction copy : copies) {
+    for (int streaming = 0; streaming < 2; ++streaming) {
+      for (size_t offset : { 0, 1, 3, 7, 13 }) {
+        for (size_t len : lengths) {
+          if (!len || len > block_size) continue;
+          memset(expected.data(), 0x5a, expected.size());
+          memset(copied.data(), 0x5a, copied.size());
+          uint32_t expected_crc = plib::CRC32CCopyPortable(1, expected.data() +
+              kGuard + offset, buf.data() + 1, len, false);
+          uint32_t crc = copy(1, copied.data() + kGuard + offset,
+              buf.data() + 1, len, streaming);
+          assert(crc == expected_crc && copied == expected);
+          (void)crc;
+          (void)expected_crc;
+        }
+      }
+    }
+  }
+
+  // Copying into a record buffer, separately and fused.
+  char *src = buf.data();
+  char *payload = dst.data() + sizeof(plib::DataHeader);
+  uint32_t crc = plib::CRC32CCopy(0, payload, src, block_size);
+  assert(crc == plib::CRC32C(0, src, block_size) &&
+      memcmp(payload, src, block_size) == 0);
+  (void)crc;
+
+  // kernel, GB/s
+  for (const Kernel &k : kernels) {
+    printf("%s%s\t%f\n", k.name, k.function == best ? "*" : "",
+        Measure([&](uint32_t crc) { return k.function(crc, src, block_size); },
+        block_size, num_runs));
+  }
+  printf("memcpy+crc\t%f\n", Measure([&](uint32_t crc) {
+    memcpy(payload, src, block_size);
+    return plib::CRC32C(crc, payload, block_size);
+  }, block_size, num_runs));
+  printf("copy\t%f\n", Measure([&](uint32_t crc) {
+    return plib::CRC32CCopy(crc, payload, src, block_size);
+  }, block_size, num_runs));
+  printf("copy-nt\t%f\n", Measure([&](uint32_t crc) {
+    return plib::CRC32CCopy(crc, payload, src, block_size, true);
+  }, block_size, num_runs));
+}
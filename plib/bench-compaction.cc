@@ -0,0 +1,78 @@
+//
+//  bench-compaction.cc
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 12, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+#include "sync_file_store.h"
+#include "file_compactor.h"
+
+using DataEntry = int64_t;
+
+plib::SyncFileStore<DataEntry> *persist = nullptr;
+std::atomic<uint64_t> timestamp(0);
+std::atomic<int64_t> sum_latency(0);
+
+void DoPersist(int num_entries, int num_runs) {
+  using namespace std::chrono;
+
+  DataEntry mem[num_entries];
+  uint64_t meta[num_entries];
+  for (int i = 0; i < num_entries; ++i) {
+    meta[i] = (uint64_t)(mem + i);
+  }
+  high_resolution_clock::time_point t1 = high_resolution_clock::now();
+  for (int i = 0; i < num_runs; ++i) {
+    void *handle = persist->Submit(mem, num_entries);
+    int err = persist->Commit(handle, ++timestamp, meta, num_entries);
+    assert(!err);
+  }
+  high_resolution_clock::time_point t2 = high_resolution_clock::now();
+  sum_latency += duration_cast<nanoseconds>(t2 - t1).count() / num_runs;
+}
+
+int main(int argc, const char *argv[]) {
+  if (argc < 6) {
+    printf("Usage: %s BLOCK_SIZE #THREADS #RUNS SEGMENT_KB RETENTION "
+        "[RATE_MB]\n", argv[0]);
+    return 1;
+  }
+
+  int block_size = atoi(argv[1]);
+  int num_threads = atoi(argv[2]);
+  int num_runs = atoi(argv[3]);
+  off_t segment_size = (off_t)atoi(argv[4]) << 10;
+  uint64_t retention = atoll(argv[5]);
+  uint64_t rate = (uint64_t)(argc > 6 ? atoi(argv[6]) : 0) << 20;
+
+  plib::SyncFileStore<DataEntry> store("log_compact_", num_threads,
+      segment_size);
+  persist = &store;
+  plib::FileCompactor<DataEntry> compactor(store, retention);
+  compactor.set_rate(rate);
+  compactor.Start(10);
+
+  std::thread threads[num_threads];
+  for (std::thread &t : threads) {
+    t = std::thread(DoPersist, block_size / sizeof(DataEntry), num_runs);
+  }
+  for (std::thread &t : threads) {
+    t.join();
+  }
+  compactor.Stop();
+
+  plib::FileCompactor<DataEntry>::Stats stats = compactor.stats();
+  // latency (ns), reclaimed, rewritten, dropped segments, pruned versions
+  printf("%lu\t%lu\t%lu\t%lu\t%lu\n", sum_latency / num_threads,
+      stats.reclaimed_bytes, stats.rewritten_bytes, stats.dropped_segments,
+      stats.pruned_versions);
+}
@@ -0,0 +1,51 @@
+//
+//  bench-compress.cc
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 21, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench_stage.h"
+#include "compression_stage.h"
+#include "sync_file_store.h"
+
+struct DataEntry {
+  char bytes[4096];
+};
+
+int main(int argc, const char *argv[]) {
+  if (argc < 4) {
+    printf("Usage: %s #PAGES #VALUES #RUNS [#WORKERS]\n", argv[0]);
+    return 1;
+  }
+
+  int num_pages = atoi(argv[1]);
+  int num_values = atoi(argv[2]); // of bytes, from 1 to 256
+  int num_runs = atoi(argv[3]);
+  int num_workers = argc > 4 ? atoi(argv[4]) :
+      std::thread::hardware_concurrency();
+
+  plib::SyncFileStore<DataEntry> compressed("log_compressed_", 1);
+  plib::CompressionStage<DataEntry> stage(compressed, num_workers);
+
+  // The pages are refilled with bytes of so many distinct values, whose
+  // entropy decides how well they compress. The last versions are inflated.
+  auto fill = [num_values](std::vector<DataEntry> &pages) {
+    for (DataEntry &page : pages) {
+      for (char &c : page.bytes) c = rand() % num_values;
+    }
+  };
+  auto name = [&stage, num_pages, num_runs]() {
+    return "compressed(" + std::to_string(stage.num_compressed()) + "/" +
+        std::to_string(num_pages * num_runs) + ")";
+  };
+  return plib::CompareStage(stage, compressed, "log_compressed_", num_pages,
+      num_runs, fill, name);
+}
@@ -0,0 +1,63 @@
+//
+//  bench-dedup.cc
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 22, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "bench_stage.h"
+#include "dedup_stage.h"
+#include "sync_file_store.h"
+
+struct DataEntry {
+  char bytes[4096];
+};
+
+int main(int argc, const char *argv[]) {
+  if (argc < 4) {
+    printf("Usage: %s #PAGES DUP_PERCENT #RUNS [#CLONES]\n", argv[0]);
+    return 1;
+  }
+
+  int num_pages = atoi(argv[1]);
+  int dup_percent = atoi(argv[2]);
+  int num_runs = atoi(argv[3]);
+  int num_clones = argc > 4 ? atoi(argv[4]) : 16;
+
+  std::vector<DataEntry> clones(num_clones);
+  for (DataEntry &page : clones) {
+    for (char &c : page.bytes) c = rand();
+  }
+
+  plib::SyncFileStore<DataEntry> dedup("log_dedup_", 1);
+  plib::DedupStage<DataEntry> stage(dedup);
+
+  // Before each commit, so many percent of the pages are refilled as zero
+  // pages or clones of a few shared pages, half and half, and the rest as
+  // unique ones. The last versions follow references.
+  auto refill = [&clones, dup_percent](std::vector<DataEntry> &pages) {
+    for (DataEntry &page : pages) {
+      int dice = rand() % 200;
+      if (dice < dup_percent) {
+        memset(page.bytes, 0, sizeof(page.bytes));
+      } else if (dice < dup_percent * 2) {
+        page = clones[rand() % clones.size()];
+      } else {
+        for (char &c : page.bytes) c = rand();
+      }
+    }
+  };
+  auto name = [&stage, num_pages, num_runs]() {
+    return "dedup(" + std::to_string(stage.num_shared()) + "/" +
+        std::to_string(num_pages * num_runs) + ")";
+  };
+  return plib::CompareStage(stage, dedup, "log_dedup_", num_pages, num_runs,
+      refill, name);
+}
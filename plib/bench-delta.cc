@@ -0,0 +1,51 @@
+//
+//  bench-delta.cc
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 20, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "bench_stage.h"
+#include "delta_stage.h"
+#include "page_delta.h"
+#include "sync_file_store.h"
+
+struct DataEntry {
+  char bytes[4096];
+};
+
+int main(int argc, const char *argv[]) {
+  if (argc < 4) {
+    printf("Usage: %s #PAGES DIRTY_LINES #RUNS [MAX_CHAIN]\n", argv[0]);
+    return 1;
+  }
+
+  int num_pages = atoi(argv[1]);
+  int dirty_lines = atoi(argv[2]);
+  int num_runs = atoi(argv[3]);
+
+  const char *kernel;
+  plib::SelectLineDiff(&kernel);
+  plib::SyncFileStore<DataEntry> delta("log_delta_", 1);
+  plib::DeltaStage<DataEntry> stage(delta);
+  if (argc > 4) stage.set_max_chain(atoi(argv[4]));
+
+  // So many lines of each page are dirtied before each commit. The last
+  // versions are rebuilt from deltas.
+  auto dirty = [dirty_lines](std::vector<DataEntry> &pages) {
+    const int num_lines = sizeof(DataEntry) / plib::kLineSize;
+    for (DataEntry &page : pages) {
+      for (int i = 0; i < dirty_lines; ++i) {
+        page.bytes[plib::kLineSize * (rand() % num_lines)] = rand();
+      }
+    }
+  };
+  return plib::CompareStage(stage, delta, "log_delta_", num_pages, num_runs,
+      dirty, [kernel]() { return std::string("delta(") + kernel + ")"; });
+}
@@ -0,0 +1,91 @@
+//
+//  bench-durable.cc
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 14, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#include "sync_file_store.h"
+#include "async_file_store.h"
+#include "uring_file_store.h"
+#include "mmap_store.h"
+
+using DataEntry = int64_t;
+
+plib::FileStore<DataEntry> *persist = nullptr;
+std::atomic<int64_t> sum_latency(0);
+
+void DoPersist(int num_entries, int num_runs) {
+  using namespace std::chrono;
+
+  DataEntry mem[num_entries];
+  uint64_t meta[num_entries];
+  for (int i = 0; i < num_entries; ++i) {
+    meta[i] = (uint64_t)(mem + i);
+  }
+  high_resolution_clock::time_point t1 = high_resolution_clock::now();
+  for (int i = 0; i < num_runs; ++i) {
+    void *handle = persist->Submit(mem, num_entries);
+    int err = persist->Commit(handle, i, meta, num_entries);
+    assert(!err);
+  }
+  high_resolution_clock::time_point t2 = high_resolution_clock::now();
+  sum_latency += duration_cast<nanoseconds>(t2 - t1).count() / num_runs;
+}
+
+// Every commit waits until its records are durable.
+int main(int argc, const char *argv[]) {
+  bool direct = (argc > 5 && strcmp(argv[argc - 1], "-d") == 0);
+  if (direct) --argc;
+  if (argc < 5) {
+    printf("Usage: %s METHOD BLOCK_SIZE #THREADS #RUNS [-d]\n", argv[0]);
+    return 1;
+  }
+
+  const char *method = argv[1];
+  int block_size = atoi(argv[2]);
+  int num_threads = atoi(argv[3]);
+  int num_runs = atoi(argv[4]);
+
+  if (strcmp(method, "sync") == 0) {
+    static plib::SyncFileStore<DataEntry> sync("log_sync_", num_threads);
+    persist = &sync;
+  } else if (strcmp(method, "async") == 0) {
+    static plib::AsyncFileStore<DataEntry> async("log_async_", num_threads);
+    persist = &async;
+  } else if (strcmp(method, "uring") == 0) {
+    static plib::UringFileStore<DataEntry> uring("log_uring_", num_threads);
+    persist = &uring;
+  } else if (strcmp(method, "mmap") == 0) {
+    static plib::MmapStore<DataEntry> mmap("log_mmap_", num_threads);
+    persist = &mmap;
+  } else {
+    fprintf(stderr, "Error: unknown persistence method %s!\n", method);
+    return 1;
+  }
+  if (direct && persist->EnableDirectIO()) return 1;
+  persist->set_wait_durable(true);
+
+  std::thread threads[num_threads];
+  for (std::thread &t : threads) {
+    t = std::thread(DoPersist, block_size / sizeof(DataEntry), num_runs);
+  }
+  for (std::thread &t : threads) {
+    t.join();
+  }
+  uint64_t num_flushes = 0;
+  for (int i = 0; i <= num_threads; ++i) {
+    num_flushes += persist->num_flushes(i);
+  }
+  // latency (ns), flushes per commit
+  printf("%lu\t%f\n", sum_latency / num_threads,
+      (double)num_flushes / num_threads / num_runs);
+}
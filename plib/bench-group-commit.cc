@@ -122,6 +122,12 @@ int main(int argc, const char *argv[]) {
   printf("%f\t%lu\n", thr, latency);
 
   if (ckpt_len) printf("%f\n", ckpt_bytes * 1000 / nsec); // MB/s
+  // payload, header, padding and metadata bytes, write calls, average
+  // write size and write amplification
+  plib::WriteStats ws = committer.write_stats();
+  fprintf(stderr, "%lu\t%lu\t%lu\t%lu\t%lu\t%f\t%f\n", ws.payload_bytes,
+      ws.header_bytes, ws.padding_bytes, ws.metadata_bytes, ws.write_calls,
+      ws.average_write_size(), ws.amplification());
 
   if (writer) delete writer;
 }
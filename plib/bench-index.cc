@@ -0,0 +1,85 @@
+//
+//  bench-index.cc
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 25, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "sync_file_store.h"
+
+using namespace std::chrono;
+
+struct DataEntry {
+  char bytes[64];
+};
+
+typedef plib::SyncFileStore<DataEntry> Store;
+
+// Returns the average latency (us) of checking out random versions.
+double TimeLookups(Store &store, int num_commits, int num_addrs,
+    int num_lookups) {
+  srand(2);
+  high_resolution_clock::time_point t1 = high_resolution_clock::now();
+  for (int i = 0; i < num_lookups; ++i) {
+    uint64_t addr = rand() % num_addrs;
+    void **pages = store.CheckoutPages(rand() % num_commits + 1, &addr, 1);
+    store.DestroyPages(pages, 1);
+  }
+  high_resolution_clock::time_point t2 = high_resolution_clock::now();
+  return duration_cast<duration<double>>(t2 - t1).count() * 1e6 /
+      num_lookups;
+}
+
+int main(int argc, const char *argv[]) {
+  if (argc < 3) {
+    printf("Usage: %s NAME_PREFIX #COMMITS [#PAGES] [#ADDRS] [#LOOKUPS]\n",
+        argv[0]);
+    return 1;
+  }
+
+  const char *prefix = argv[1];
+  int num_commits = atoi(argv[2]);
+  int num_pages = argc > 3 ? atoi(argv[3]) : 64;
+  int num_addrs = argc > 4 ? atoi(argv[4]) : 1 << 20;
+  int num_lookups = argc > 5 ? atoi(argv[5]) : 100000;
+
+  {
+    Store store(prefix, 1);
+    std::vector<DataEntry> pages(num_pages);
+    std::vector<uint64_t> addrs(num_pages);
+    srand(1);
+    for (int t = 1; t <= num_commits; ++t) {
+      for (uint64_t &addr : addrs) {
+        addr = rand() % num_addrs;
+      }
+      void *handle = store.Submit(pages.data(), num_pages);
+      int err = store.Commit(handle, t, addrs.data(), num_pages);
+      assert(!err);
+      (void)err;
+    }
+  }
+
+  // Opens the store by scanning the metadata file, and then with the runs.
+  double open_sec[2], lookup_us[2];
+  size_t num_runs = 0;
+  for (int i = 0; i < 2; ++i) {
+    high_resolution_clock::time_point t1 = high_resolution_clock::now();
+    Store store(prefix, 1);
+    high_resolution_clock::time_point t2 = high_resolution_clock::now();
+    open_sec[i] = duration_cast<duration<double>>(t2 - t1).count();
+    lookup_us[i] = TimeLookups(store, num_commits, num_addrs, num_lookups);
+    num_runs = store.index_runs().size();
+    if (!i && store.PersistIndex()) return 1;
+  }
+  // #versions, open sec (scan), open sec (runs), lookup us (scan),
+  // lookup us (runs), #runs
+  printf("%lu\t%f\t%f\t%f\t%f\t%lu\n", (uint64_t)num_commits * num_pages,
+      open_sec[0], open_sec[1], lookup_us[0], lookup_us[1], num_runs);
+}
@@ -0,0 +1,86 @@
+//
+//  bench-inline.cc
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 23, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "sync_file_store.h"
+
+struct DataEntry {
+  char bytes[256];
+};
+
+// Returns the latency per commit (ns) of so many entries.
+int64_t Run(plib::SyncFileStore<DataEntry> &store,
+    std::vector<DataEntry> &entries, std::vector<uint64_t> &addrs,
+    uint32_t n, int num_runs, uint64_t *timestamp) {
+  using namespace std::chrono;
+  high_resolution_clock::time_point t1 = high_resolution_clock::now();
+  for (int r = 0; r < num_runs; ++r) {
+    void *handle = store.Submit(entries.data(), n);
+    int err = store.Commit(handle, ++*timestamp, addrs.data(), n);
+    assert(!err);
+    (void)err;
+  }
+  high_resolution_clock::time_point t2 = high_resolution_clock::now();
+  return duration_cast<nanoseconds>(t2 - t1).count() / num_runs;
+}
+
+int main(int argc, const char *argv[]) {
+  if (argc < 2) {
+    printf("Usage: %s #RUNS [DURABLE] [ONLINE]\n", argv[0]);
+    return 1;
+  }
+  int num_runs = atoi(argv[1]);
+  bool durable = argc > 2 && atoi(argv[2]);
+  bool online = argc > 3 && atoi(argv[3]);
+
+  const uint32_t max_n = plib::InlineTuner::kMaxThreshold / sizeof(DataEntry);
+  std::vector<DataEntry> entries(max_n);
+  std::vector<uint64_t> addrs(max_n);
+  for (uint32_t i = 0; i < max_n; ++i) {
+    for (char &c : entries[i].bytes) c = rand();
+    addrs[i] = sizeof(DataEntry) * i;
+  }
+
+  plib::SyncFileStore<DataEntry> tuned("log_tuned_", 1);
+  plib::SyncFileStore<DataEntry> inlined("log_inlined_", 1);
+  plib::SyncFileStore<DataEntry> raw("log_raw_", 1);
+  for (plib::SyncFileStore<DataEntry> *s : { &tuned, &inlined, &raw }) {
+    s->set_wait_durable(durable);
+  }
+  // Checkouts are not needed.
+  tuned.inline_tuner().set_max_threshold(plib::InlineTuner::kMaxThreshold);
+  inlined.inline_tuner().set_threshold(plib::InlineTuner::kMaxThreshold);
+  raw.inline_tuner().set_threshold(0);
+
+  // Calibrates at the first commit.
+  uint64_t timestamp = 0;
+  Run(tuned, entries, addrs, 1, 1, &timestamp);
+  plib::InlineTuner &tuner = tuned.inline_tuner();
+  printf("# checksum %f ns/B, record write %f ns, threshold %lu\n",
+      tuner.checksum_cost(), tuner.write_cost(), tuner.threshold());
+
+  tuner.set_online(online);
+
+  // data size, inlined, raw with metadata, and tuned latency (ns)
+  uint32_t crossover = 0;
+  for (uint32_t n = 1; n < max_n; n *= 2) {
+    int64_t inline_ns = Run(inlined, entries, addrs, n, num_runs, &timestamp);
+    int64_t raw_ns = Run(raw, entries, addrs, n, num_runs, &timestamp);
+    int64_t tuned_ns = Run(tuned, entries, addrs, n, num_runs, &timestamp);
+    printf("%lu\t%ld\t%ld\t%ld\n", sizeof(DataEntry) * n, inline_ns, raw_ns,
+        tuned_ns);
+    if (!crossover && inline_ns > raw_ns) crossover = sizeof(DataEntry) * n;
+  }
+  printf("# measured crossover %u, final threshold %lu\n", crossover,
+      tuner.threshold());
+}
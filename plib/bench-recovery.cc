@@ -0,0 +1,41 @@
+//
+//  bench-recovery.cc
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 8, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "log_recovery.h"
+
+int main(int argc, const char *argv[]) {
+  bool truncate = (argc > 3 && strcmp(argv[argc - 1], "-t") == 0);
+  if (truncate) --argc;
+  if (argc < 3) {
+    printf("Usage: %s NAME_PREFIX #FILES [READ_SIZE_MB] [SEGMENT_MB] [-t]\n",
+        argv[0]);
+    return 1;
+  }
+
+  const char *prefix = argv[1];
+  int num_files = atoi(argv[2]);
+  size_t read_size = (argc > 3 ? atoi(argv[3]) : 16) << 20;
+  off_t segment_size = (off_t)(argc > 4 ? atoi(argv[4]) : 0) << 20;
+
+  plib::LogRecovery recovery(prefix, num_files, read_size, segment_size);
+  size_t num_records = recovery.Run();
+  if (truncate && recovery.Truncate()) return 1;
+
+  uint64_t payload = 0;
+  recovery.Replay([&payload](const plib::RecoveredRecord &r) {
+    payload += r.length;
+  });
+  // #records, last timestamp, #orphans, payload bytes, sec, GB/s
+  printf("%lu\t%lu\t%lu\t%lu\t%f\t%f\n", num_records,
+      recovery.last_timestamp(), recovery.num_orphans(), payload,
+      recovery.seconds(), recovery.throughput());
+}
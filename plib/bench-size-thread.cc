@@ -10,11 +10,15 @@
 #include <cassert>
 #include <chrono>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <thread>
+#include <vector>
 
 #include "sync_file_store.h"
 #include "async_file_store.h"
+#include "uring_file_store.h"
+#include "mmap_store.h"
 #include "mem_store.h"
 #include "nvme_store.h"
 #include "tcp_store.h"
@@ -23,28 +27,38 @@
 using DataEntry = int64_t;
 
 plib::VersionedPersistence<DataEntry> *persist = nullptr;
+plib::FileStore<DataEntry> *file_store = nullptr; // if persist is one
 std::atomic<int64_t> sum_latency(0);
 
 void DoPersist(int num_entries, int num_runs) {
   using namespace std::chrono;
 
-  DataEntry mem[num_entries];
+  DataEntry *mem = nullptr; // page-aligned for splicing
+  posix_memalign((void **)&mem, 4096, sizeof(DataEntry) * num_entries);
+  assert(mem);
+  std::vector<uint64_t> meta(num_entries);
+  for (int i = 0; i < num_entries; ++i) {
+    meta[i] = (uint64_t)(mem + i);
+  }
   high_resolution_clock::time_point t1 = high_resolution_clock::now();
   for (int i = 0; i < num_runs; ++i) {
     void *handle = persist->Submit(mem, num_entries);
-    int err = persist->Commit(handle, 0, nullptr, num_entries);
+    int err = persist->Commit(handle, i, meta.data(), num_entries);
     assert(!err);
   }
   high_resolution_clock::time_point t2 = high_resolution_clock::now();
   sum_latency += duration_cast<nanoseconds>(t2 - t1).count() / num_runs;
+  free(mem);
 }
 
 int main(int argc, const char *argv[]) {
   using namespace std::chrono;
 
+  bool direct = (argc > 5 && strcmp(argv[argc - 1], "-d") == 0);
+  if (direct) --argc;
   if (argc < 5) {
-    printf("Usage: %s METHOD BLOCK_SIZE #THREADS #RUNS [#LANES GROUP_SIZE]\n",
-           argv[0]);
+    printf("Usage: %s METHOD BLOCK_SIZE #THREADS #RUNS [#LANES GROUP_SIZE] "
+           "[-d]\n", argv[0]);
     return 1;
   }
 
@@ -55,10 +69,20 @@ int main(int argc, const char *argv[]) {
 
   if (strcmp(method, "sync") == 0) {
     static plib::SyncFileStore<DataEntry> sync("log_sync_", num_threads);
-    persist = &sync;
+    persist = file_store = &sync;
+  } else if (strcmp(method, "splice") == 0) {
+    static plib::SyncFileStore<DataEntry> splice("log_splice_", num_threads);
+    splice.set_splice_threshold(4096);
+    persist = file_store = &splice;
   } else if (strcmp(method, "async") == 0) {
     static plib::AsyncFileStore<DataEntry> async("log_async_", num_threads);
-    persist = &async;
+    persist = file_store = &async;
+  } else if (strcmp(method, "uring") == 0) {
+    static plib::UringFileStore<DataEntry> uring("log_uring_", num_threads);
+    persist = file_store = &uring;
+  } else if (strcmp(method, "mmap") == 0) {
+    static plib::MmapStore<DataEntry> mmap("log_mmap_", num_threads);
+    persist = file_store = &mmap;
   } else if (strcmp(method, "mem") == 0) {
     // TODO hard coded parameter
     static plib::MemStore<DataEntry> mem(1000);
@@ -82,6 +106,13 @@ int main(int argc, const char *argv[]) {
   } */ else {
     fprintf(stderr, "Warning: unknown persistence method %s!\n", method);
   }
+  if (direct) {
+    if (!file_store) {
+      fprintf(stderr, "Error: %s does not support direct I/O!\n", method);
+      return 1;
+    }
+    if (file_store->EnableDirectIO()) return 1;
+  }
 
   std::thread threads[num_threads];
   for (std::thread &t : threads) {
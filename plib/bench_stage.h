@@ -0,0 +1,106 @@
+//
+//  bench_stage.h
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 26, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#ifndef VM_PERSISTENCE_PLIB_BENCH_STAGE_H_
+#define VM_PERSISTENCE_PLIB_BENCH_STAGE_H_
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+#include "sync_file_store.h"
+#include "versioned_persistence.h"
+
+namespace plib {
+
+// Harness of benchmarks that compare a stage, which transforms pages on their
+// way to its store, with a store of whole pages. A workload refills the pages
+// before each commit.
+
+// Bytes of the metadata and data files of a store with one data file
+inline off_t LogSize(const std::string &prefix) {
+  off_t size = 0;
+  for (int i = 0; i <= 1; ++i) {
+    struct stat st;
+    if (!stat((prefix + std::to_string(i)).c_str(), &st)) size += st.st_size;
+  }
+  return size;
+}
+
+// Commits the pages so many times, refilled before each commit, and returns
+// the latency per commit (ns).
+template <typename DataEntry, class Refill>
+int64_t TimeCommits(VersionedPersistence<DataEntry> &persist,
+    std::vector<DataEntry> &pages, std::vector<uint64_t> &addrs,
+    int num_runs, Refill refill) {
+  using namespace std::chrono;
+  srand(1);
+  int64_t ns = 0;
+  for (int r = 0; r < num_runs; ++r) {
+    refill(pages);
+    high_resolution_clock::time_point t1 = high_resolution_clock::now();
+    void *handle = persist.Submit(pages.data(), pages.size());
+    int err = persist.Commit(handle, r + 1, addrs.data(), pages.size());
+    high_resolution_clock::time_point t2 = high_resolution_clock::now();
+    if (err) return -1;
+    ns += duration_cast<nanoseconds>(t2 - t1).count();
+  }
+  return ns / num_runs;
+}
+
+// Runs the workload on random pages, first on a store of whole pages and
+// then through the stage over the store under the prefix, and prints a line
+// for each: the name, latency per commit (ns) and log bytes per commit.
+// The name of the stage is taken after its run, so as to report its
+// counters. Returns nonzero on failure, or if the last versions checked out
+// of the store differ from the pages.
+template <typename DataEntry, class Refill, class Name>
+int CompareStage(VersionedPersistence<DataEntry> &stage,
+    SyncFileStore<DataEntry> &store, const std::string &prefix,
+    int num_pages, int num_runs, Refill refill, Name name) {
+  std::vector<DataEntry> pages(num_pages);
+  std::vector<uint64_t> addrs(num_pages);
+  for (int i = 0; i < num_pages; ++i) {
+    char *bytes = (char *)&pages[i];
+    for (size_t j = 0; j < sizeof(DataEntry); ++j) bytes[j] = rand();
+    addrs[i] = sizeof(DataEntry) * i;
+  }
+  std::vector<DataEntry> initial(pages);
+
+  SyncFileStore<DataEntry> whole("log_whole_", 1);
+  off_t size = LogSize("log_whole_");
+  int64_t ns = TimeCommits(whole, pages, addrs, num_runs, refill);
+  if (ns < 0) return -1;
+  printf("whole\t%ld\t%f\n", ns,
+      (double)(LogSize("log_whole_") - size) / num_runs);
+  pages = initial;
+  size = LogSize(prefix);
+  ns = TimeCommits(stage, pages, addrs, num_runs, refill);
+  if (ns < 0) return -1;
+  printf("%s\t%ld\t%f\n", name().c_str(), ns,
+      (double)(LogSize(prefix) - size) / num_runs);
+
+  void **checkout = store.CheckoutPages(num_runs, addrs.data(), num_pages);
+  int err = 0;
+  for (int i = 0; i < num_pages; ++i) {
+    if (!checkout[i] || memcmp(checkout[i], &pages[i], sizeof(DataEntry))) {
+      err = -1;
+    }
+  }
+  store.DestroyPages(checkout, num_pages);
+  if (err) fprintf(stderr, "[ERROR] CompareStage: pages differ\n");
+  return err;
+}
+
+} // namespace plib
+
+#endif // VM_PERSISTENCE_PLIB_BENCH_STAGE_H_
@@ -20,9 +20,16 @@
 
 namespace plib {
 
-// The small data buffer, keeping track of waiting threads.
+// The small data buffer, keeping track of waiting threads. Its tag, state
+// and dirty size are packed into one atomic word that threads advance with
+// CAS, so that fillers of disjoint offsets do not serialize. The notifier
+// is used only by threads that have to wait, and to wake them up.
 class Buffer {
+#ifdef SPINNING_NOTIFIER
+  using Notifier = SpinningNotifier;
+#else
   using Notifier = SleepingNotifier;
+#endif
  public:
   Buffer(int buffer_size, int array_size, int index);
   ~Buffer();
@@ -55,14 +62,41 @@ class Buffer {
     kReserving,
   };
 
+  // The word holds, from high to low bits, the round of the tag, i.e., the
+  // number of gaps it is after the first tag, the state and the dirty size.
+  static const int kDirtyBits = 24;
+  static const int kRoundShift = kDirtyBits + 2;
+  static const uint64_t kDirtyMask = (uint64_t(1) << kDirtyBits) - 1;
+
+  static uint64_t Pack(uint64_t round, State state, int dirty) {
+    return (round << kRoundShift) | ((uint64_t)state << kDirtyBits) | dirty;
+  }
+  static uint64_t RoundOf(uint64_t word) { return word >> kRoundShift; }
+  static State StateOf(uint64_t word) {
+    return (State)((word >> kDirtyBits) & 3);
+  }
+  static int DirtyOf(uint64_t word) { return word & kDirtyMask; }
+  uint64_t TagOf(uint64_t word) const { return base_ + RoundOf(word) * gap_; }
+
+  // Takes the buffer to flush on a timeout if it is still filling, or full.
+  // Returns the number of bytes to flush, or zero.
+  int Reserve(uint64_t thread_tag);
+
+  // Waits on the notifier until the condition releases the caller.
+  template<class Condition>
+  void Wait(Condition condition);
+  template<class Condition, class Timeout>
+  void WaitFor(Condition condition, Timeout timeout);
+  // Wakes up waiters, if any, after the word is changed.
+  void NotifyAll();
+
   const int buffer_size_;
   const int gap_; // Difference between successive tags on this buffer.
+  const uint64_t base_; // The first tag
   int8_t *data_;
 
-  State state_;
-  uint64_t tag_;
-  int dirty_size_;
-
+  std::atomic<uint64_t> word_;
+  std::atomic_int num_waiters_;
   Notifier notifier_;
 };
 
@@ -70,7 +104,9 @@ class Buffer {
 
 inline Buffer::Buffer(int buffer_size, int array_size, int index) :
     buffer_size_(buffer_size), gap_(buffer_size * array_size),
-    state_(kFilling), tag_(buffer_size * index), dirty_size_(0) {
+    base_((uint64_t)buffer_size * index), word_(Pack(0, kFilling, 0)),
+    num_waiters_(0) {
+  assert((uint64_t)buffer_size <= kDirtyMask);
   data_ = new int8_t[buffer_size];
 }
 
@@ -83,152 +119,169 @@ inline int8_t *Buffer::data(size_t offset) const {
   return data_ + offset;
 }
 
+// A waiter counts itself before it checks the word, and a thread that
+// changes the word checks for waiters after, so either the waiter sees the
+// change or it is notified.
+template<class Condition>
+inline void Buffer::Wait(Condition condition) {
+  ++num_waiters_;
+  notifier_.Wait(condition, condition);
+  --num_waiters_;
+}
+
+template<class Condition, class Timeout>
+inline void Buffer::WaitFor(Condition condition, Timeout timeout) {
+  ++num_waiters_;
+  notifier_.WaitFor(TIME_OUT, condition, condition, timeout);
+  --num_waiters_;
+}
+
+inline void Buffer::NotifyAll() {
+  if (num_waiters_) notifier_.NotifyAll();
+}
+
 inline void Buffer::Tag(uint64_t thread_tag) {
   auto lambda = [thread_tag, this]() {
-    return (tag_ == thread_tag) ? Notifier::kRelease : Notifier::kWait;
+    return (TagOf(word_) == thread_tag) ? Notifier::kRelease : Notifier::kWait;
   };
-  notifier_.Wait(lambda, lambda);
+  if (lambda() == Notifier::kWait) Wait(lambda);
 }
 
 inline bool Buffer::TryTag(uint64_t thread_tag) {
-  auto lambda = [thread_tag, this]()->bool {
-    return (tag_ == thread_tag);
-  };
-  return notifier_.TakeAction(lambda);
+  return TagOf(word_) == thread_tag;
 }
 
-inline int Buffer::Fill(uint64_t thread_tag, int len) {
-  int flush_size = 0;
-
-  auto fill = [thread_tag, len, &flush_size, this]() {
-    assert(tag_ == thread_tag);
-    dirty_size_ += len;
-    if (dirty_size_ < buffer_size_) {
-      assert(state_ == kFilling || state_ == kReserving);
+inline int Buffer::Reserve(uint64_t thread_tag) {
+  uint64_t word = word_;
+  while (thread_tag >= TagOf(word)) {
+    State state = StateOf(word);
+    if (state != kFilling && state != kFull) break;
+    // A full buffer is taken as by a wakeup that raced with the timeout.
+    State next = (state == kFull) ? kFlushing : kReserving;
+    if (word_.compare_exchange_weak(word,
+        Pack(RoundOf(word), next, DirtyOf(word)))) {
 #ifdef DEBUG_PLIB
-      fprintf(stderr, "%p\t%d => %d (Fill)\t%d\n",
-        this, state_, state_, dirty_size_);
+      fprintf(stderr, "%p\t%d => %d (Reserve)\tTimeout!\t%d\n",
+          this, state, next, DirtyOf(word));
 #endif
-      return Notifier::kWait;
+      return DirtyOf(word);
+    }
+  }
+  return 0;
+}
+
+// The filler that makes the buffer full takes it to flush without waiting.
+inline int Buffer::Fill(uint64_t thread_tag, int len) {
+  uint64_t word = word_;
+  uint64_t next;
+  do {
+    assert(TagOf(word) == thread_tag);
+    int dirty = DirtyOf(word) + len;
+    State state = StateOf(word);
+    if (dirty < buffer_size_) {
+      assert(state == kFilling || state == kReserving);
     } else {
-      assert(dirty_size_ == buffer_size_);
+      assert(dirty == buffer_size_);
+      state = kFlushing;
+    }
+    next = Pack(RoundOf(word), state, dirty);
+  } while (!word_.compare_exchange_weak(word, next));
 #ifdef DEBUG_PLIB
-      fprintf(stderr, "%p\t%d => %d (Fill)\t%d\n",
-          this, state_, kFlushing, dirty_size_);
+  fprintf(stderr, "%p\t%d => %d (Fill)\t%d\n",
+      this, StateOf(word), StateOf(next), DirtyOf(next));
 #endif
-      state_ = kFlushing;
-      flush_size = dirty_size_;
-      return Notifier::kRelease;
-    }
-  };
+  if (StateOf(next) == kFlushing) return DirtyOf(next);
 
-  auto wakeup = [thread_tag, len, &flush_size, this]() {
-    if (thread_tag < tag_) return Notifier::kRelease;
-    if (state_ == kFilling || state_ == kFlushing) {
-      return Notifier::kWait;
-    } else if (state_ == kFull) {
+  int flush_size = 0;
+  auto wakeup = [thread_tag, &flush_size, this]() {
+    uint64_t word = word_;
+    while (true) {
+      if (thread_tag < TagOf(word)) return Notifier::kRelease;
+      State state = StateOf(word);
+      if (state == kFilling || state == kFlushing) {
+        return Notifier::kWait;
+      } else if (state == kReserving) {
+        return Notifier::kRelease;
+      } else if (word_.compare_exchange_weak(word, // state == kFull
+          Pack(RoundOf(word), kFlushing, DirtyOf(word)))) {
 #ifdef DEBUG_PLIB
-      fprintf(stderr, "%p\t%d => %d (Fill)\t%d\n",
-          this, state_, kFlushing, dirty_size_);
+        fprintf(stderr, "%p\t%d => %d (Fill)\t%d\n",
+            this, kFull, kFlushing, DirtyOf(word));
 #endif
-      state_ = kFlushing;
-      flush_size = dirty_size_;
-      return Notifier::kRelease;
-    } else { // state_ == kReserving
-      return Notifier::kRelease;
+        flush_size = DirtyOf(word);
+        return Notifier::kRelease;
+      }
     }
   };
 
-  auto timeout = [thread_tag, len, &flush_size, this]() {
-    if (thread_tag < tag_) return;
-    assert(state_ != kFull);
-    if (state_ == kFilling) {
-#ifdef DEBUG_PLIB
-      fprintf(stderr, "%p\t%d => %d (Fill)\tTimeout!\t%d\n",
-          this, state_, kReserving, dirty_size_);
-#endif
-      state_ = kReserving;
-      flush_size = dirty_size_;
-    }
+  auto timeout = [thread_tag, &flush_size, this]() {
+    flush_size = Reserve(thread_tag);
   };
 
-  notifier_.WaitFor(TIME_OUT, fill, wakeup, timeout);
+  WaitFor(wakeup, timeout);
   return flush_size;
 }
 
 inline void Buffer::Pad(uint64_t thread_tag, int len) {
-  auto pad = [thread_tag, len, this]()->bool {
-    dirty_size_ += len;
-    assert(tag_ == thread_tag && state_ == kFilling);
-    if (dirty_size_ == buffer_size_) {
+  uint64_t word = word_;
+  uint64_t next;
+  do {
+    assert(TagOf(word) == thread_tag && StateOf(word) == kFilling);
+    int dirty = DirtyOf(word) + len;
+    assert(dirty <= buffer_size_);
+    next = Pack(RoundOf(word), dirty == buffer_size_ ? kFull : kFilling,
+        dirty);
+  } while (!word_.compare_exchange_weak(word, next));
 #ifdef DEBUG_PLIB
-      fprintf(stderr, "%p\t%d => %d (Pad)\t%d\n",
-          this, state_, kFull, dirty_size_);
+  fprintf(stderr, "%p\t%d => %d (Pad)\t%d\n",
+      this, StateOf(word), StateOf(next), DirtyOf(next));
 #endif
-      state_ = kFull;
-      return true; // full
-    } else {
-      assert(dirty_size_ < buffer_size_);
-      return false;
-    }
-  };
-  if (notifier_.TakeAction(pad)) {
-    notifier_.NotifyAll();
+  if (StateOf(next) == kFull) {
+    NotifyAll();
   }
 }
 
 inline int Buffer::Join(uint64_t thread_tag) {
   auto wakeup = [thread_tag, this]() {
-    return (tag_ == thread_tag) ? Notifier::kWait : Notifier::kRelease;
+    return (TagOf(word_) == thread_tag) ? Notifier::kWait : Notifier::kRelease;
   };
+  if (wakeup() == Notifier::kRelease) return 0;
 
   int flush_size = 0;
   auto timeout = [thread_tag, &flush_size, this]() {
-    if (thread_tag < tag_) return;
-    assert(state_ != kFull);;
-    if (state_ == kFilling) {
-#ifdef DEBUG_PLIB
-      fprintf(stderr, "%p\t%d => %d (Join)\tTimeout!\n",
-          this, state_, kReserving);
-#endif
-      state_ = kReserving;
-      flush_size = dirty_size_;
-    }
+    flush_size = Reserve(thread_tag);
   };
 
-  notifier_.WaitFor(TIME_OUT, wakeup, wakeup, timeout);
+  WaitFor(wakeup, timeout);
   return flush_size;
 }
 
+// The skipper holds the whole buffer, so no one else changes the word.
 inline void Buffer::Skip(uint64_t thread_tag) {
   auto lambda = [thread_tag, this] {
-    if (tag_ == thread_tag) {
-      assert(!dirty_size_ );
-      tag_ += gap_;
-      return Notifier::kRelease;
-    } else {
-      assert(thread_tag > tag_);
-      return Notifier::kWait;
-    }
+    uint64_t tag = TagOf(word_);
+    assert(thread_tag >= tag);
+    return (tag == thread_tag) ? Notifier::kRelease : Notifier::kWait;
   };
-  notifier_.Wait(lambda, lambda);
-  notifier_.NotifyAll();
+  if (lambda() == Notifier::kWait) Wait(lambda);
+  uint64_t word = word_;
+  assert(!DirtyOf(word));
+  word_ = Pack(RoundOf(word) + 1, StateOf(word), 0);
+  NotifyAll();
 }
 
+// No one else changes the word of a full buffer until it is released.
 inline void Buffer::Release(uint64_t thread_tag) {
-  auto lambda = [thread_tag, this]() {
-    assert(thread_tag == tag_);
-    if (dirty_size_ == buffer_size_) {
+  uint64_t word = word_;
+  assert(thread_tag == TagOf(word));
+  if (DirtyOf(word) == buffer_size_) {
 #ifdef DEBUG_PLIB
-      fprintf(stderr, "%p\t%d => %d (Release)\n", this, state_, kFilling);
+    fprintf(stderr, "%p\t%d => %d (Release)\n", this, StateOf(word),
+        kFilling);
 #endif
-      state_ = kFilling;
-      tag_ += gap_;
-      dirty_size_ = 0;
-    }
-  };
-  notifier_.TakeAction(lambda);
-  notifier_.NotifyAll();
+    word_ = Pack(RoundOf(word) + 1, kFilling, 0);
+  }
+  NotifyAll();
 }
 
 } // namespace plib
@@ -0,0 +1,350 @@
+//
+//  checksum.h
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 18, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#ifndef VM_PERSISTENCE_PLIB_CHECKSUM_H_
+#define VM_PERSISTENCE_PLIB_CHECKSUM_H_
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+namespace plib {
+
+// CRC32C (Castagnoli), with the same interface as zlib crc32():
+// a zero initial value yields the standard checksum, and a previous result
+// continues it over more data.
+typedef uint32_t (*CRC32CFunction)(uint32_t crc, const void *data,
+    size_t nbytes);
+
+// Copies data and continues a CRC32C over it in a single pass. Streaming
+// stores bypass the cache, for a destination that will not be read soon.
+typedef uint32_t (*CRC32CCopyFunction)(uint32_t crc, void *dst,
+    const void *src, size_t nbytes, bool streaming);
+
+namespace crc32c {
+
+static const uint32_t kPoly = 0x82f63b78; // reflected
+
+struct Tables {
+  uint32_t t[8][256];
+
+  Tables() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k) {
+        c = (c & 1) ? (c >> 1) ^ kPoly : c >> 1;
+      }
+      t[0][i] = c;
+    }
+    for (int k = 1; k < 8; ++k) {
+      for (int i = 0; i < 256; ++i) {
+        t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+      }
+    }
+  }
+};
+
+inline const Tables &tables() {
+  static const Tables tables;
+  return tables;
+}
+
+// Reflected x^n mod P, where 0x80000000 stands for 1.
+inline uint32_t PowerModP(size_t n) {
+  uint32_t p = 0x80000000u;
+  while (n--) {
+    p = (p & 1) ? (p >> 1) ^ kPoly : p >> 1;
+  }
+  return p;
+}
+
+} // namespace crc32c
+
+// Slicing-by-8 over tables
+inline uint32_t CRC32CPortable(uint32_t crc, const void *data,
+    size_t nbytes) {
+  const uint32_t (*t)[256] = crc32c::tables().t;
+  const unsigned char *p = (const unsigned char *)data;
+  uint32_t c = ~crc;
+  for (; nbytes && ((uintptr_t)p & 7); --nbytes) {
+    c = (c >> 8) ^ t[0][(c ^ *p++) & 0xff];
+  }
+  for (; nbytes >= 8; nbytes -= 8, p += 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+    lo ^= c;
+    c = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+        t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+        t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+        t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+  }
+  while (nbytes--) {
+    c = (c >> 8) ^ t[0][(c ^ *p++) & 0xff];
+  }
+  return ~c;
+}
+
+// Slicing-by-8 that stores each word after loading it. Streaming is
+// not supported.
+inline uint32_t CRC32CCopyPortable(uint32_t crc, void *dst, const void *src,
+    size_t nbytes, bool streaming) {
+  const uint32_t (*t)[256] = crc32c::tables().t;
+  unsigned char *d = (unsigned char *)dst;
+  const unsigned char *p = (const unsigned char *)src;
+  uint32_t c = ~crc;
+  for (; nbytes && ((uintptr_t)p & 7); --nbytes) {
+    c = (c >> 8) ^ t[0][(c ^ (*d++ = *p++)) & 0xff];
+  }
+  for (; nbytes >= 8; nbytes -= 8, p += 8, d += 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+    memcpy(d, &lo, 4);
+    memcpy(d + 4, &hi, 4);
+    lo ^= c;
+    c = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+        t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+        t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+        t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+  }
+  while (nbytes--) {
+    c = (c >> 8) ^ t[0][(c ^ (*d++ = *p++)) & 0xff];
+  }
+  return ~c;
+}
+
+#if defined(__x86_64__)
+
+namespace crc32c {
+
+__attribute__((target("sse4.2")))
+inline uint64_t Update(uint64_t c, const unsigned char *p, size_t nbytes) {
+  for (; nbytes && ((uintptr_t)p & 7); --nbytes) {
+    c = _mm_crc32_u8(c, *p++);
+  }
+  for (; nbytes >= 8; nbytes -= 8, p += 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    c = _mm_crc32_u64(c, word);
+  }
+  while (nbytes--) {
+    c = _mm_crc32_u8(c, *p++);
+  }
+  return c;
+}
+
+// Copies 16 bytes and feeds them to the CRC. The CRC loads the words
+// again, which is cheaper than extracting them from the vector.
+template <bool kStreaming>
+__attribute__((target("sse4.2")))
+inline uint64_t CopyChunk(uint64_t c, unsigned char *d,
+    const unsigned char *p) {
+  __m128i v = _mm_loadu_si128((const __m128i *)p);
+  if (kStreaming) {
+    _mm_stream_si128((__m128i *)d, v);
+  } else {
+    _mm_storeu_si128((__m128i *)d, v);
+  }
+  uint64_t lo, hi;
+  memcpy(&lo, p, 8);
+  memcpy(&hi, p + 8, 8);
+  return _mm_crc32_u64(_mm_crc32_u64(c, lo), hi);
+}
+
+// Aligns the destination rather than the source, for streaming stores.
+template <bool kStreaming>
+__attribute__((target("sse4.2")))
+inline uint64_t CopyUpdate(uint64_t c, unsigned char *d,
+    const unsigned char *p, size_t nbytes) {
+  for (; nbytes && ((uintptr_t)d & 15); --nbytes) {
+    c = _mm_crc32_u8(c, *d++ = *p++);
+  }
+  for (; nbytes >= 16; nbytes -= 16, p += 16, d += 16) {
+    c = CopyChunk<kStreaming>(c, d, p);
+  }
+  while (nbytes--) {
+    c = _mm_crc32_u8(c, *d++ = *p++);
+  }
+  return c;
+}
+
+static const size_t kLaneSize = 1024; // bytes of each of the three chains
+
+// Multipliers that shift a CRC by one and two lanes. The product of two
+// reflected values carries an extra factor of x, and crc32 of a zero-
+// extended word multiplies by x^32, hence x^(8L - 33).
+struct Shifts {
+  uint64_t one, two;
+  Shifts() : one(PowerModP(8 * kLaneSize - 33)),
+      two(PowerModP(16 * kLaneSize - 33)) {}
+};
+
+inline const Shifts &shifts() {
+  static const Shifts shifts;
+  return shifts;
+}
+
+} // namespace crc32c
+
+// One chain of SSE4.2 crc32 instructions
+__attribute__((target("sse4.2")))
+inline uint32_t CRC32CSSE42(uint32_t crc, const void *data, size_t nbytes) {
+  return ~crc32c::Update(~crc, (const unsigned char *)data, nbytes);
+}
+
+// Three interleaved chains that hide the latency of crc32, merged by
+// carry-less multiplication with PCLMULQDQ
+__attribute__((target("sse4.2,pclmul")))
+inline uint32_t CRC32CPCLMUL(uint32_t crc, const void *data,
+    size_t nbytes) {
+  using namespace crc32c;
+  const unsigned char *p = (const unsigned char *)data;
+  uint64_t c = ~crc;
+  size_t head = (8 - ((uintptr_t)p & 7)) & 7;
+  if (nbytes < 3 * kLaneSize + head) {
+    return ~Update(c, p, nbytes);
+  }
+  c = Update(c, p, head);
+  p += head;
+  nbytes -= head;
+
+  const __m128i k = _mm_set_epi64x(shifts().two, shifts().one);
+  for (; nbytes >= 3 * kLaneSize; nbytes -= 3 * kLaneSize) {
+    uint64_t a = c, b = 0;
+    c = 0;
+    const unsigned char *end = p + kLaneSize;
+    for (; p < end; p += 8) {
+      uint64_t wa, wb, wc;
+      memcpy(&wa, p, 8);
+      memcpy(&wb, p + kLaneSize, 8);
+      memcpy(&wc, p + 2 * kLaneSize, 8);
+      a = _mm_crc32_u64(a, wa);
+      b = _mm_crc32_u64(b, wb);
+      c = _mm_crc32_u64(c, wc);
+    }
+    p += 2 * kLaneSize;
+    // a * x^(16L) + b * x^(8L) + c
+    __m128i shifted = _mm_xor_si128(
+        _mm_clmulepi64_si128(_mm_cvtsi64_si128(a), k, 0x10),
+        _mm_clmulepi64_si128(_mm_cvtsi64_si128(b), k, 0x00));
+    c ^= _mm_crc32_u64(0, _mm_cvtsi128_si64(shifted));
+  }
+  return ~Update(c, p, nbytes);
+}
+
+namespace crc32c {
+
+template <bool kStreaming>
+__attribute__((target("sse4.2,pclmul")))
+inline uint64_t CopyPCLMUL(uint64_t c, unsigned char *d,
+    const unsigned char *p, size_t nbytes) {
+  size_t head = (16 - ((uintptr_t)d & 15)) & 15;
+  if (nbytes < 3 * kLaneSize + head) {
+    return CopyUpdate<kStreaming>(c, d, p, nbytes);
+  }
+  c = CopyUpdate<kStreaming>(c, d, p, head);
+  p += head;
+  d += head;
+  nbytes -= head;
+
+  const __m128i k = _mm_set_epi64x(shifts().two, shifts().one);
+  for (; nbytes >= 3 * kLaneSize; nbytes -= 3 * kLaneSize) {
+    uint64_t a = c, b = 0;
+    c = 0;
+    const unsigned char *end = p + kLaneSize;
+    for (; p < end; p += 16, d += 16) {
+      a = CopyChunk<kStreaming>(a, d, p);
+      b = CopyChunk<kStreaming>(b, d + kLaneSize, p + kLaneSize);
+      c = CopyChunk<kStreaming>(c, d + 2 * kLaneSize, p + 2 * kLaneSize);
+    }
+    p += 2 * kLaneSize;
+    d += 2 * kLaneSize;
+    __m128i shifted = _mm_xor_si128(
+        _mm_clmulepi64_si128(_mm_cvtsi64_si128(a), k, 0x10),
+        _mm_clmulepi64_si128(_mm_cvtsi64_si128(b), k, 0x00));
+    c ^= _mm_crc32_u64(0, _mm_cvtsi128_si64(shifted));
+  }
+  return CopyUpdate<kStreaming>(c, d, p, nbytes);
+}
+
+} // namespace crc32c
+
+__attribute__((target("sse4.2")))
+inline uint32_t CRC32CCopySSE42(uint32_t crc, void *dst, const void *src,
+    size_t nbytes, bool streaming) {
+  using namespace crc32c;
+  unsigned char *d = (unsigned char *)dst;
+  const unsigned char *p = (const unsigned char *)src;
+  if (!streaming) return ~CopyUpdate<false>(~crc, d, p, nbytes);
+  uint64_t c = CopyUpdate<true>(~crc, d, p, nbytes);
+  _mm_sfence();
+  return ~c;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+inline uint32_t CRC32CCopyPCLMUL(uint32_t crc, void *dst, const void *src,
+    size_t nbytes, bool streaming) {
+  using namespace crc32c;
+  unsigned char *d = (unsigned char *)dst;
+  const unsigned char *p = (const unsigned char *)src;
+  if (!streaming) return ~CopyPCLMUL<false>(~crc, d, p, nbytes);
+  uint64_t c = CopyPCLMUL<true>(~crc, d, p, nbytes);
+  _mm_sfence();
+  return ~c;
+}
+
+#endif // __x86_64__
+
+// The fastest kernel the CPU supports, chosen by CPUID.
+inline CRC32CFunction SelectCRC32C(const char **name = nullptr) {
+  CRC32CFunction kernel = CRC32CPortable;
+  const char *kernel_name = "portable";
+#if defined(__x86_64__)
+  unsigned int eax, ebx, ecx, edx;
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2)) {
+    kernel = CRC32CSSE42;
+    kernel_name = "sse4.2";
+    if (ecx & bit_PCLMUL) {
+      kernel = CRC32CPCLMUL;
+      kernel_name = "pclmul";
+    }
+  }
+#endif
+  if (name) *name = kernel_name;
+  return kernel;
+}
+
+inline CRC32CCopyFunction SelectCRC32CCopy() {
+  CRC32CFunction kernel = SelectCRC32C();
+#if defined(__x86_64__)
+  if (kernel == CRC32CPCLMUL) return CRC32CCopyPCLMUL;
+  if (kernel == CRC32CSSE42) return CRC32CCopySSE42;
+#endif
+  return CRC32CCopyPortable;
+}
+
+inline uint32_t CRC32C(uint32_t crc, const void *data, size_t nbytes) {
+  static const CRC32CFunction kernel = SelectCRC32C();
+  return kernel(crc, data, nbytes);
+}
+
+inline uint32_t CRC32CCopy(uint32_t crc, void *dst, const void *src,
+    size_t nbytes, bool streaming = false) {
+  static const CRC32CCopyFunction kernel = SelectCRC32CCopy();
+  return kernel(crc, dst, src, nbytes, streaming);
+}
+
+} // namespace plib
+
+#endif // VM_PERSISTENCE_PLIB_CHECKSUM_H_
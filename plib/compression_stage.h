@@ -0,0 +1,278 @@
+//
+//  compression_stage.h
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 21, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#ifndef VM_PERSISTENCE_PLIB_COMPRESSION_STAGE_H_
+#define VM_PERSISTENCE_PLIB_COMPRESSION_STAGE_H_
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+
+#include "file_store.h"
+#include "format.h"
+#include "versioned_persistence.h"
+
+namespace plib {
+
+// Persists pages through a file store, compressed by zlib where it pays.
+// The entropy of bytes sampled from each page predicts its compression
+// ratio, and only a page predicted to shrink enough is compressed, and
+// kept compressed only if it did. Pages are compressed by worker threads
+// from submit on, in tasks of consecutive pages, so that the caller can
+// work until it commits. Checkouts from the store inflate the pages.
+template <typename DataEntry>
+class CompressionStage : public VersionedPersistence<DataEntry> {
+ public:
+  // With no workers, pages are compressed at submit.
+  explicit CompressionStage(FileStore<DataEntry> &store,
+      int num_workers = std::thread::hardware_concurrency());
+  ~CompressionStage();
+
+  // The data is read until the commit.
+  void *Submit(DataEntry data[], uint32_t n);
+  int Commit(void *handle, uint64_t timestamp, uint64_t meta[], uint32_t n);
+
+  void **CheckoutPages(uint64_t timestamp, uint64_t addr[], int n) {
+    return store_.CheckoutPages(timestamp, addr, n);
+  }
+  void DestroyPages(void *pages[], int n) { store_.DestroyPages(pages, n); }
+
+  // The largest ratio of compressed to whole size worth storing.
+  // Called before any submit.
+  double max_ratio() const { return max_ratio_; }
+  void set_max_ratio(double ratio) { max_ratio_ = ratio; }
+
+  // Bytes of pages committed, and of payloads written for them
+  uint64_t page_bytes() const { return page_bytes_; }
+  uint64_t written_bytes() const { return written_bytes_; }
+  uint64_t num_compressed() const { return num_compressed_; }
+
+  static const uint32_t kPagesPerTask = 16;
+  static const int kNumSamples = 256; // bytes per page
+  static const int kLevel = 1;
+
+ private:
+  struct Job;
+
+  struct Task {
+    Job *job;
+    uint32_t first;
+    uint32_t n;
+    std::vector<char> entries;
+    std::vector<uint32_t> offsets; // in the entries, flagged
+  };
+
+  struct Job {
+    const char *data;
+    std::vector<Task> tasks;
+    uint32_t num_left;
+    std::mutex mutex;
+    std::condition_variable done;
+  };
+
+  // Predicts the compressed size of a page over its whole size, from the
+  // order-0 entropy of sampled bytes.
+  static double PredictRatio(const char *page);
+  void Compress(z_stream *stream, Task *task);
+  void RunWorker();
+
+  FileStore<DataEntry> &store_;
+  double max_ratio_;
+
+  std::vector<std::thread> workers_;
+  std::deque<Task *> tasks_;
+  std::mutex task_mutex_;
+  std::condition_variable task_cv_;
+  bool stop_;
+
+  std::atomic<uint64_t> page_bytes_;
+  std::atomic<uint64_t> written_bytes_;
+  std::atomic<uint64_t> num_compressed_;
+};
+
+// Implementation of CompressionStage
+
+template <typename DataEntry>
+CompressionStage<DataEntry>::CompressionStage(FileStore<DataEntry> &store,
+    int num_workers) : store_(store), max_ratio_(0.75), stop_(false),
+    page_bytes_(0), written_bytes_(0), num_compressed_(0) {
+  for (int i = 0; i < num_workers; ++i) {
+    workers_.emplace_back(&CompressionStage<DataEntry>::RunWorker, this);
+  }
+}
+
+template <typename DataEntry>
+CompressionStage<DataEntry>::~CompressionStage() {
+  {
+    std::lock_guard<std::mutex> lock(task_mutex_);
+    stop_ = true;
+  }
+  task_cv_.notify_all();
+  for (std::thread &t : workers_) {
+    t.join();
+  }
+}
+
+template <typename DataEntry>
+double CompressionStage<DataEntry>::PredictRatio(const char *page) {
+  const size_t stride = std::max<size_t>(sizeof(DataEntry) / kNumSamples, 1);
+  uint32_t counts[256] = { 0 };
+  int num_samples = 0;
+  for (size_t i = 0; i < sizeof(DataEntry); i += stride) {
+    ++counts[(uint8_t)page[i]];
+    ++num_samples;
+  }
+  double entropy = 0;
+  int num_values = 0;
+  for (uint32_t c : counts) {
+    if (!c) continue;
+    double p = (double)c / num_samples;
+    entropy -= p * std::log2(p);
+    ++num_values;
+  }
+  // Corrects the underestimate from few samples (Miller-Madow).
+  entropy += (num_values - 1) / (2 * num_samples * std::log(2.0));
+  return entropy / 8;
+}
+
+template <typename DataEntry>
+void CompressionStage<DataEntry>::Compress(z_stream *stream, Task *task) {
+  const size_t size = sizeof(DataEntry);
+  const size_t max_len = max_ratio_ * size;
+  task->entries.resize((sizeof(uint32_t) + deflateBound(stream, size)) *
+      task->n);
+  char *end = task->entries.data();
+  uint32_t num_compressed = 0;
+  for (uint32_t i = 0; i < task->n; ++i) {
+    const char *page = task->job->data + size * (task->first + i);
+    uint32_t offset = end - task->entries.data();
+    bool compressed = false;
+    if (PredictRatio(page) <= max_ratio_) {
+      deflateReset(stream);
+      stream->next_in = (Bytef *)page;
+      stream->avail_in = size;
+      stream->next_out = (Bytef *)end + sizeof(uint32_t);
+      stream->avail_out = deflateBound(stream, size);
+      int ret = deflate(stream, Z_FINISH);
+      assert(ret == Z_STREAM_END);
+      (void)ret;
+      uint32_t len = stream->total_out;
+      if (sizeof(uint32_t) + len <= max_len) {
+        end = Serialize(end, len) + len;
+        compressed = true;
+        ++num_compressed;
+      }
+    }
+    if (!compressed) {
+      memcpy(end, page, size);
+      end += size;
+    }
+    task->offsets.push_back(compressed ? offset | kDeltaCompressed : offset);
+  }
+  task->entries.resize(end - task->entries.data());
+  num_compressed_ += num_compressed;
+}
+
+template <typename DataEntry>
+void CompressionStage<DataEntry>::RunWorker() {
+  z_stream stream = {};
+  int ret = deflateInit(&stream, kLevel);
+  assert(ret == Z_OK);
+  (void)ret;
+  std::unique_lock<std::mutex> lock(task_mutex_);
+  while (true) {
+    task_cv_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+    if (tasks_.empty()) break; // stopped
+    Task *task = tasks_.front();
+    tasks_.pop_front();
+    lock.unlock();
+    Compress(&stream, task);
+    Job *job = task->job;
+    {
+      std::lock_guard<std::mutex> job_lock(job->mutex);
+      if (!--job->num_left) job->done.notify_one();
+    }
+    lock.lock();
+  }
+  deflateEnd(&stream);
+}
+
+template <typename DataEntry>
+void *CompressionStage<DataEntry>::Submit(DataEntry data[], uint32_t n) {
+  Job *job = new Job;
+  job->data = (const char *)data;
+  for (uint32_t first = 0; first < n; first += kPagesPerTask) {
+    uint32_t num = n - first < kPagesPerTask ? n - first : kPagesPerTask;
+    job->tasks.push_back({ job, first, num });
+  }
+  job->num_left = job->tasks.size();
+  if (workers_.empty()) {
+    z_stream stream = {};
+    deflateInit(&stream, kLevel);
+    for (Task &task : job->tasks) {
+      Compress(&stream, &task);
+    }
+    deflateEnd(&stream);
+    job->num_left = 0;
+    return job;
+  }
+  {
+    std::lock_guard<std::mutex> lock(task_mutex_);
+    for (Task &task : job->tasks) {
+      tasks_.push_back(&task);
+    }
+  }
+  task_cv_.notify_all();
+  return job;
+}
+
+template <typename DataEntry>
+int CompressionStage<DataEntry>::Commit(void *handle, uint64_t timestamp,
+    uint64_t meta[], uint32_t n) {
+  std::unique_ptr<Job> job((Job *)handle);
+  {
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->done.wait(lock, [&job]() { return !job->num_left; });
+  }
+  size_t len = DeltaTableLength(n);
+  for (const Task &task : job->tasks) {
+    len += task.entries.size();
+  }
+  std::unique_ptr<char[]> payload(new char[len]);
+  char *table = payload.get();
+  char *end = table + DeltaTableLength(n);
+  for (const Task &task : job->tasks) {
+    uint32_t base = end - payload.get();
+    for (uint32_t offset : task.offsets) {
+      table = Serialize(table, base + offset);
+    }
+    memcpy(end, task.entries.data(), task.entries.size());
+    end += task.entries.size();
+  }
+  Serialize(table, (uint32_t)len);
+
+  int err = store_.CommitDelta(timestamp, payload.get(), len, meta, n);
+  if (err) return err;
+  page_bytes_ += sizeof(DataEntry) * n;
+  written_bytes_ += len;
+  return 0;
+}
+
+} // namespace plib
+
+#endif // VM_PERSISTENCE_PLIB_COMPRESSION_STAGE_H_
@@ -0,0 +1,274 @@
+//
+//  dedup_stage.h
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 22, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#ifndef VM_PERSISTENCE_PLIB_DEDUP_STAGE_H_
+#define VM_PERSISTENCE_PLIB_DEDUP_STAGE_H_
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "aligned_buffer_pool.h"
+#include "file_store.h"
+#include "format.h"
+#include "versioned_persistence.h"
+
+namespace plib {
+
+struct Fingerprint {
+  uint64_t low;
+  uint64_t high;
+
+  bool operator==(const Fingerprint &other) const {
+    return low == other.low && high == other.high;
+  }
+};
+
+struct FingerprintHash {
+  size_t operator()(const Fingerprint &fp) const { return fp.low; }
+};
+
+namespace dedup {
+
+inline uint64_t Rotate(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t Mix(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdull;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ull;
+  k ^= k >> 33;
+  return k;
+}
+
+} // namespace dedup
+
+// MurmurHash3 (x64, 128-bit) with a zero seed
+inline Fingerprint FingerprintData(const void *data, size_t len) {
+  using namespace dedup;
+  const uint64_t c1 = 0x87c37b91114253d5ull;
+  const uint64_t c2 = 0x4cf5ad432745937full;
+  const unsigned char *p = (const unsigned char *)data;
+  const size_t num_blocks = len / 16;
+  uint64_t h1 = 0, h2 = 0;
+  for (size_t i = 0; i < num_blocks; ++i) {
+    uint64_t k1, k2;
+    memcpy(&k1, p + 16 * i, sizeof(k1));
+    memcpy(&k2, p + 16 * i + 8, sizeof(k2));
+    h1 ^= Rotate(k1 * c1, 31) * c2;
+    h1 = (Rotate(h1, 27) + h2) * 5 + 0x52dce729;
+    h2 ^= Rotate(k2 * c2, 33) * c1;
+    h2 = (Rotate(h2, 31) + h1) * 5 + 0x38495ab5;
+  }
+  const unsigned char *tail = p + 16 * num_blocks;
+  uint64_t k1 = 0, k2 = 0;
+  switch (len & 15) {
+    case 15: k2 ^= (uint64_t)tail[14] << 48; // fall through
+    case 14: k2 ^= (uint64_t)tail[13] << 40; // fall through
+    case 13: k2 ^= (uint64_t)tail[12] << 32; // fall through
+    case 12: k2 ^= (uint64_t)tail[11] << 24; // fall through
+    case 11: k2 ^= (uint64_t)tail[10] << 16; // fall through
+    case 10: k2 ^= (uint64_t)tail[9] << 8; // fall through
+    case 9: k2 ^= (uint64_t)tail[8];
+      h2 ^= Rotate(k2 * c2, 33) * c1; // fall through
+    case 8: k1 ^= (uint64_t)tail[7] << 56; // fall through
+    case 7: k1 ^= (uint64_t)tail[6] << 48; // fall through
+    case 6: k1 ^= (uint64_t)tail[5] << 40; // fall through
+    case 5: k1 ^= (uint64_t)tail[4] << 32; // fall through
+    case 4: k1 ^= (uint64_t)tail[3] << 24; // fall through
+    case 3: k1 ^= (uint64_t)tail[2] << 16; // fall through
+    case 2: k1 ^= (uint64_t)tail[1] << 8; // fall through
+    case 1: k1 ^= (uint64_t)tail[0];
+      h1 ^= Rotate(k1 * c1, 31) * c2;
+  }
+  h1 ^= len;
+  h2 ^= len;
+  h1 += h2;
+  h2 += h1;
+  h1 = Mix(h1);
+  h2 = Mix(h2);
+  h1 += h2;
+  h2 += h1;
+  return { h1, h2 };
+}
+
+// Persists pages through a file store, each page whose contents are
+// already stored, under any address and timestamp, as a reference to that
+// version. A page is known by its 128-bit fingerprint, and the first
+// version of each fingerprint stays its owner until it is no longer
+// indexed. Fingerprints can be made to collide, so a page is shared only
+// if its bytes equal those of the version found. Referenced versions are
+// counted by the store and kept by compaction. Checkouts from the store
+// follow the references.
+template <typename DataEntry>
+class DedupStage : public VersionedPersistence<DataEntry> {
+ public:
+  explicit DedupStage(FileStore<DataEntry> &store);
+
+  // Pages are fingerprinted and written at commit, when their addresses
+  // are known.
+  void *Submit(DataEntry data[], uint32_t n) { return data; }
+  int Commit(void *handle, uint64_t timestamp, uint64_t meta[], uint32_t n);
+
+  void **CheckoutPages(uint64_t timestamp, uint64_t addr[], int n) {
+    return store_.CheckoutPages(timestamp, addr, n);
+  }
+  void DestroyPages(void *pages[], int n) { store_.DestroyPages(pages, n); }
+
+  // The most fingerprints remembered, beyond which arbitrary ones are
+  // forgotten.
+  size_t max_owners() const { return max_owners_; }
+  void set_max_owners(size_t max) { max_owners_ = max; }
+
+  // Bytes of pages committed, and of payloads written for them
+  uint64_t page_bytes() const { return page_bytes_; }
+  uint64_t written_bytes() const { return written_bytes_; }
+  uint64_t num_shared() const { return num_shared_; }
+  // Pages whose fingerprint matched a version of different bytes
+  uint64_t num_collisions() const { return num_collisions_; }
+
+  static const int kNumShards = 64;
+
+ private:
+  struct Owner {
+    uint64_t addr;
+    uint64_t timestamp;
+  };
+
+  struct Shard {
+    std::unordered_map<Fingerprint, Owner, FingerprintHash> owners;
+    std::mutex mutex;
+  };
+
+  Shard &shard(const Fingerprint &fp) {
+    return shards_[fp.high % kNumShards];
+  }
+  // Whether the page equals the version of the owner in the store
+  bool Matches(const char *page, const Owner &owner);
+
+  FileStore<DataEntry> &store_;
+  AlignedBufferPool pool_; // of payloads, faulted in once
+  std::atomic<size_t> max_owners_;
+  Shard shards_[kNumShards];
+  std::atomic<uint64_t> page_bytes_;
+  std::atomic<uint64_t> written_bytes_;
+  std::atomic<uint64_t> num_shared_;
+  std::atomic<uint64_t> num_collisions_;
+};
+
+// Implementation of DedupStage
+
+template <typename DataEntry>
+DedupStage<DataEntry>::DedupStage(FileStore<DataEntry> &store) :
+    store_(store), pool_(64), max_owners_(1 << 20), page_bytes_(0),
+    written_bytes_(0), num_shared_(0), num_collisions_(0) {
+}
+
+template <typename DataEntry>
+bool DedupStage<DataEntry>::Matches(const char *page, const Owner &owner) {
+  uint64_t addr = owner.addr;
+  void **stored = store_.CheckoutPages(owner.timestamp, &addr, 1);
+  bool same = stored[0] && !memcmp(stored[0], page, sizeof(DataEntry));
+  store_.DestroyPages(stored, 1);
+  return same;
+}
+
+// Each reference holds its target until the commit is indexed, when the
+// store counts it instead. Duplicates within the commit refer to the first
+// of them, and others to owners, once their bytes are compared. An owner is
+// read back outside the lock of its shard.
+template <typename DataEntry>
+int DedupStage<DataEntry>::Commit(void *handle, uint64_t timestamp,
+    uint64_t meta[], uint32_t n) {
+  const size_t size = sizeof(DataEntry);
+  const size_t max_len = DeltaTableLength(n) + size * n;
+  char *payload = pool_.Allocate(max_len);
+  if (!payload) return ENOMEM;
+  std::unordered_map<Fingerprint, uint32_t, FingerprintHash> firsts;
+  std::vector<Fingerprint> owned; // of the pages written whole
+  std::vector<Owner> held;
+  const size_t max_shard = max_owners_ / kNumShards + 1;
+
+  char *end = payload + DeltaTableLength(n);
+  for (uint32_t i = 0; i < n; ++i) {
+    const char *page = (const char *)handle + size * i;
+    uint32_t offset = end - payload;
+    Fingerprint fp = FingerprintData(page, size);
+    Owner target;
+    bool shared = false;
+    auto first = firsts.find(fp);
+    if (first != firsts.end()) {
+      target = { meta[first->second], timestamp };
+      if (memcmp(page, (const char *)handle + size * first->second, size)) {
+        ++num_collisions_;
+      } else {
+        shared = store_.ReferencePage(target.addr, target.timestamp, false);
+      }
+    } else {
+      Shard &s = shard(fp);
+      std::unique_lock<std::mutex> lock(s.mutex);
+      auto it = s.owners.find(fp);
+      if (it != s.owners.end()) {
+        target = it->second;
+        if (!store_.ReferencePage(target.addr, target.timestamp)) {
+          s.owners.erase(it); // pruned
+        } else {
+          lock.unlock();
+          // Compares the very version referenced, which is kept meanwhile.
+          shared = Matches(page, target);
+          if (!shared) {
+            store_.ReleasePage(target.addr, target.timestamp);
+            ++num_collisions_;
+          }
+        }
+      }
+    }
+    if (shared) {
+      held.push_back(target);
+      end = Serialize(Serialize(end, target.addr), target.timestamp);
+      Serialize(payload + sizeof(uint32_t) * i, offset | kDeltaShared);
+      continue;
+    }
+    if (first == firsts.end()) {
+      firsts[fp] = i;
+      owned.push_back(fp);
+    }
+    memcpy(end, page, size);
+    end += size;
+    Serialize(payload + sizeof(uint32_t) * i, offset);
+  }
+  uint32_t len = end - payload;
+  Serialize(payload + sizeof(uint32_t) * n, len);
+
+  int err = store_.CommitDelta(timestamp, payload, len, meta, n);
+  pool_.Free(payload, max_len);
+  for (const Owner &target : held) {
+    store_.ReleasePage(target.addr, target.timestamp);
+  }
+  if (err) return err;
+  for (const Fingerprint &fp : owned) {
+    Shard &s = shard(fp);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (s.owners.size() >= max_shard) s.owners.erase(s.owners.begin());
+    s.owners.emplace(fp, Owner{ meta[firsts[fp]], timestamp });
+  }
+  page_bytes_ += size * n;
+  written_bytes_ += len;
+  num_shared_ += held.size();
+  return 0;
+}
+
+} // namespace plib
+
+#endif // VM_PERSISTENCE_PLIB_DEDUP_STAGE_H_
@@ -0,0 +1,207 @@
+//
+//  delta_codec.h
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 19, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#ifndef VM_PERSISTENCE_PLIB_DELTA_CODEC_H_
+#define VM_PERSISTENCE_PLIB_DELTA_CODEC_H_
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <tmmintrin.h>
+#endif
+
+namespace plib {
+
+// Packs 64-bit words, such as the page addresses of a commit, as deltas
+// from their predecessors. The deltas are divided by their largest common
+// power of two, zigzag-encoded to 32 bits, and stored in the Stream VByte
+// layout: two bits of length per value in control bytes, followed by the
+// value bytes. Words keep their order, which is that of the pages.
+//
+//   uint8_t shift; uint64_t first; uint8_t control[(n + 2) / 4]; values
+//
+// The layout lets a decoder unpack four values at once with a shuffle.
+
+typedef void (*DeltaDecoder)(const char *mem, size_t len, uint32_t n,
+    uint64_t words[]);
+
+namespace delta {
+
+inline uint64_t ZigZag(uint64_t delta, int shift) {
+  int64_t v = (int64_t)delta >> shift;
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+inline uint64_t UnZigZag(uint32_t value, int shift) {
+  uint64_t v = (value >> 1) ^ -(uint64_t)(value & 1);
+  return v << shift;
+}
+
+inline int ByteLength(uint32_t value) {
+  return value < (1u << 8) ? 1 : value < (1u << 16) ? 2 :
+      value < (1u << 24) ? 3 : 4;
+}
+
+inline size_t ControlLength(uint32_t n) {
+  return n ? (n + 2) / 4 : 0; // for n - 1 values
+}
+
+} // namespace delta
+
+// Returns the packed length of the words and sets the shift, or returns
+// zero if they cannot be packed.
+inline size_t DeltaLength(const uint64_t words[], uint32_t n, int *shift) {
+  using namespace delta;
+  if (!n) return 0;
+  uint64_t bits = 0;
+  for (uint32_t i = 1; i < n; ++i) {
+    bits |= words[i] - words[i - 1];
+  }
+  int s = bits ? __builtin_ctzll(bits) : 0;
+  size_t len = sizeof(uint8_t) + sizeof(uint64_t) + ControlLength(n);
+  for (uint32_t i = 1; i < n; ++i) {
+    uint64_t value = ZigZag(words[i] - words[i - 1], s);
+    if (value > UINT32_MAX) return 0;
+    len += ByteLength(value);
+  }
+  *shift = s;
+  return len;
+}
+
+inline char *DeltaEncode(char *mem, const uint64_t words[], uint32_t n,
+    int shift) {
+  using namespace delta;
+  *mem++ = shift;
+  memcpy(mem, &words[0], sizeof(uint64_t));
+  mem += sizeof(uint64_t);
+  uint8_t *control = (uint8_t *)mem;
+  memset(control, 0, ControlLength(n));
+  mem += ControlLength(n);
+  for (uint32_t i = 1; i < n; ++i) {
+    uint32_t value = ZigZag(words[i] - words[i - 1], shift);
+    int len = ByteLength(value);
+    control[(i - 1) / 4] |= (len - 1) << ((i - 1) % 4 * 2);
+    memcpy(mem, &value, len); // little endian
+    mem += len;
+  }
+  return mem;
+}
+
+inline void DeltaDecodePortable(const char *mem, size_t len, uint32_t n,
+    uint64_t words[]) {
+  using namespace delta;
+  if (!n) return;
+  int shift = *mem++;
+  memcpy(&words[0], mem, sizeof(uint64_t));
+  const uint8_t *control = (const uint8_t *)mem + sizeof(uint64_t);
+  const char *p = (const char *)control + ControlLength(n);
+  for (uint32_t i = 1; i < n; ++i) {
+    int bytes = ((control[(i - 1) / 4] >> ((i - 1) % 4 * 2)) & 3) + 1;
+    uint32_t value = 0;
+    memcpy(&value, p, bytes);
+    p += bytes;
+    words[i] = words[i - 1] + UnZigZag(value, shift);
+  }
+}
+
+#if defined(__x86_64__)
+
+namespace delta {
+
+// Shuffles that spread the bytes of four values to 32-bit lanes, and the
+// number of bytes consumed, per control byte.
+struct Shuffles {
+  uint8_t masks[256][16];
+  uint8_t lengths[256];
+
+  Shuffles() {
+    for (int c = 0; c < 256; ++c) {
+      int offset = 0;
+      for (int k = 0; k < 4; ++k) {
+        int len = ((c >> (2 * k)) & 3) + 1;
+        for (int b = 0; b < 4; ++b) {
+          masks[c][4 * k + b] = b < len ? offset + b : 0x80;
+        }
+        offset += len;
+      }
+      lengths[c] = offset;
+    }
+  }
+};
+
+inline const Shuffles &shuffles() {
+  static const Shuffles shuffles;
+  return shuffles;
+}
+
+} // namespace delta
+
+// Unpacks and zigzag-decodes four values per step with SSSE3, as long as
+// 16 bytes can be loaded, and adds up the deltas.
+__attribute__((target("ssse3")))
+inline void DeltaDecodeSSSE3(const char *mem, size_t len, uint32_t n,
+    uint64_t words[]) {
+  using namespace delta;
+  if (!n) return;
+  const char *end = mem + len;
+  int shift = *mem++;
+  memcpy(&words[0], mem, sizeof(uint64_t));
+  const uint8_t *control = (const uint8_t *)mem + sizeof(uint64_t);
+  const char *p = (const char *)control + ControlLength(n);
+  const Shuffles &s = shuffles();
+  const __m128i one = _mm_set1_epi32(1);
+  uint64_t word = words[0];
+  uint32_t i = 1;
+  for (; i + 4 <= n && p + 16 <= end; i += 4) {
+    uint8_t c = control[(i - 1) / 4];
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    v = _mm_shuffle_epi8(v, _mm_loadu_si128((const __m128i *)s.masks[c]));
+    p += s.lengths[c];
+    // (v >> 1) ^ -(v & 1)
+    v = _mm_xor_si128(_mm_srli_epi32(v, 1),
+        _mm_sub_epi32(_mm_setzero_si128(), _mm_and_si128(v, one)));
+    int32_t deltas[4];
+    _mm_storeu_si128((__m128i *)deltas, v);
+    for (int k = 0; k < 4; ++k) {
+      word += (uint64_t)(int64_t)deltas[k] << shift;
+      words[i + k] = word;
+    }
+  }
+  for (; i < n; ++i) {
+    int bytes = ((control[(i - 1) / 4] >> ((i - 1) % 4 * 2)) & 3) + 1;
+    uint32_t value = 0;
+    memcpy(&value, p, bytes);
+    p += bytes;
+    words[i] = words[i - 1] + UnZigZag(value, shift);
+  }
+}
+
+#endif // __x86_64__
+
+// The fastest decoder the CPU supports, chosen by CPUID.
+inline DeltaDecoder SelectDeltaDecoder() {
+#if defined(__x86_64__)
+  unsigned int eax, ebx, ecx, edx;
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSSE3)) {
+    return DeltaDecodeSSSE3;
+  }
+#endif
+  return DeltaDecodePortable;
+}
+
+inline void DeltaDecode(const char *mem, size_t len, uint32_t n,
+    uint64_t words[]) {
+  static const DeltaDecoder decoder = SelectDeltaDecoder();
+  decoder(mem, len, n, words);
+}
+
+} // namespace plib
+
+#endif // VM_PERSISTENCE_PLIB_DELTA_CODEC_H_
@@ -0,0 +1,162 @@
+//
+//  delta_stage.h
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 20, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#ifndef VM_PERSISTENCE_PLIB_DELTA_STAGE_H_
+#define VM_PERSISTENCE_PLIB_DELTA_STAGE_H_
+
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "file_store.h"
+#include "format.h"
+#include "page_delta.h"
+#include "versioned_persistence.h"
+
+namespace plib {
+
+// Persists pages through a file store as deltas against their previous
+// versions. A copy of the last version committed of each page is kept in
+// memory, and only the 64-byte lines that differ from it are written,
+// unless too many do or the deltas since the last whole version are too
+// many. Checkouts from the store rebuild whole pages.
+// Commits of a page are expected in timestamp order. An older one is
+// written whole.
+template <typename DataEntry>
+class DeltaStage : public VersionedPersistence<DataEntry> {
+ public:
+  explicit DeltaStage(FileStore<DataEntry> &store);
+
+  // Pages are compared and written at commit, when their addresses are
+  // known.
+  void *Submit(DataEntry data[], uint32_t n) { return data; }
+  int Commit(void *handle, uint64_t timestamp, uint64_t meta[], uint32_t n);
+
+  void **CheckoutPages(uint64_t timestamp, uint64_t addr[], int n) {
+    return store_.CheckoutPages(timestamp, addr, n);
+  }
+  void DestroyPages(void *pages[], int n) { store_.DestroyPages(pages, n); }
+
+  // A page is written whole after so many deltas in a row,
+  unsigned int max_chain() const { return max_chain_; }
+  void set_max_chain(unsigned int chain) { max_chain_ = chain; }
+  // or if more than this fraction of its lines changed.
+  double max_delta_ratio() const { return max_delta_ratio_; }
+  void set_max_delta_ratio(double ratio) { max_delta_ratio_ = ratio; }
+
+  // Bytes of pages committed, and of payloads written for them
+  uint64_t page_bytes() const { return page_bytes_; }
+  uint64_t written_bytes() const { return written_bytes_; }
+
+  static const int kNumShards = 64;
+
+ private:
+  struct Shadow {
+    uint64_t timestamp;
+    unsigned int chain; // deltas since the last whole version
+    DataEntry page;
+  };
+
+  struct Shard {
+    std::unordered_map<uint64_t, Shadow> shadows;
+    std::mutex mutex;
+  };
+
+  Shard &shard(uint64_t addr) {
+    return shards_[std::hash<uint64_t>()(addr) % kNumShards];
+  }
+
+  FileStore<DataEntry> &store_;
+  std::atomic_uint max_chain_;
+  std::atomic<double> max_delta_ratio_;
+  Shard shards_[kNumShards];
+  std::atomic<uint64_t> page_bytes_;
+  std::atomic<uint64_t> written_bytes_;
+};
+
+// Implementation of DeltaStage
+
+template <typename DataEntry>
+DeltaStage<DataEntry>::DeltaStage(FileStore<DataEntry> &store) :
+    store_(store), max_chain_(16), max_delta_ratio_(0.5), page_bytes_(0),
+    written_bytes_(0) {
+}
+
+template <typename DataEntry>
+int DeltaStage<DataEntry>::Commit(void *handle, uint64_t timestamp,
+    uint64_t meta[], uint32_t n) {
+  const size_t size = sizeof(DataEntry);
+  const size_t max_entry = sizeof(uint64_t) * (1 + MaskWords(size)) + size;
+  std::unique_ptr<char[]> payload(
+      new char[DeltaTableLength(n) + max_entry * n]);
+  std::vector<uint64_t> mask(MaskWords(size));
+  const unsigned int max_chain = max_chain_;
+  const size_t max_lines = max_delta_ratio_ * NumLines(size);
+
+  // Shadows are published only once the commit is durable, so that no
+  // other commit is based on a version that may never be written.
+  std::vector<unsigned int> chains(n); // of the new versions
+  char *end = payload.get() + DeltaTableLength(n);
+  for (uint32_t i = 0; i < n; ++i) {
+    const char *page = (const char *)handle + size * i;
+    uint32_t offset = end - payload.get();
+    bool based = false;
+    {
+      Shard &s = shard(meta[i]);
+      std::lock_guard<std::mutex> lock(s.mutex);
+      auto it = s.shadows.find(meta[i]);
+      if (it != s.shadows.end() && it->second.timestamp < timestamp) {
+        const Shadow &shadow = it->second;
+        if (shadow.chain < max_chain && LineDiff(page,
+            (const char *)&shadow.page, size, mask.data()) <= max_lines) {
+          end = EncodePageDelta(end, shadow.timestamp, page, size,
+              mask.data());
+          chains[i] = shadow.chain + 1;
+          based = true;
+        }
+      } // else new, or out of order and written whole
+    }
+    if (!based) {
+      memcpy(end, page, size);
+      end += size;
+      chains[i] = 0;
+    }
+    Serialize(payload.get() + sizeof(uint32_t) * i,
+        based ? offset | kDeltaBased : offset);
+  }
+  uint32_t len = end - payload.get();
+  Serialize(payload.get() + sizeof(uint32_t) * n, len);
+
+  int err = store_.CommitDelta(timestamp, payload.get(), len, meta, n);
+  if (err) return err; // the shadows stay at durable versions
+
+  for (uint32_t i = 0; i < n; ++i) {
+    Shard &s = shard(meta[i]);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.shadows.find(meta[i]);
+    if (it != s.shadows.end() && it->second.timestamp >= timestamp) {
+      continue; // moved on to a later version
+    }
+    Shadow &shadow = s.shadows[meta[i]];
+    shadow.timestamp = timestamp;
+    shadow.chain = chains[i];
+    memcpy(&shadow.page, (const char *)handle + size * i, size);
+  }
+  page_bytes_ += size * n;
+  written_bytes_ += len;
+  return 0;
+}
+
+} // namespace plib
+
+#endif // VM_PERSISTENCE_PLIB_DELTA_STAGE_H_
@@ -0,0 +1,956 @@
+//
+//  file.h
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 10, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#ifndef VM_PERSISTENCE_PLIB_FILE_H_
+#define VM_PERSISTENCE_PLIB_FILE_H_
+
+#include <cassert>
+#include <cctype>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "aligned_buffer_pool.h"
+#include "write_stats.h"
+
+namespace plib {
+
+// An append-only log file. Space is reserved at the end and written by
+// position, so concurrent appends proceed without a lock.
+//
+// With a non-zero segment size, the log is split into files of that size
+// named NAME.000000, NAME.000001, etc., each preallocated when first used.
+// Records never cross segments: a reservation that does not fit in the
+// current segment starts the next one, and the filler marks the unused tail.
+//
+// In direct mode, the file bypasses the page cache with O_DIRECT. Writes are
+// staged in aligned buffers and widened to whole blocks. A block shared by
+// neighboring records is kept in memory until all of its bytes are written,
+// and each write merges its bytes into the cached copy, so that small
+// records can still be appended at any position.
+//
+// A segmented file can also be accessed through shared mappings of its
+// segments, which are flushed by ranged msync instead of fdatasync.
+class File {
+ public:
+  // Writes a marker for an unused segment tail into the memory.
+  // Returns the number of bytes to write, which may be zero.
+  typedef size_t (*Filler)(char *mem, size_t len);
+
+  File();
+  ~File();
+  File(const File &) = delete;
+  File &operator=(const File &) = delete;
+
+  // Opens the file, or the segments of it that exist.
+  int Open(const std::string &name, off_t segment_size = 0,
+      Filler filler = nullptr, bool create = true);
+  void Close();
+
+  const std::string &name() const { return name_; }
+  off_t segment_size() const { return segment_size_; }
+  std::string SegmentName(int64_t segment) const;
+  // Descriptor of the segment containing the position, which is created
+  // if missing. Returns -1 for dropped or absent segments.
+  int descriptor(off_t pos = 0);
+  off_t SegmentOffset(off_t pos) const {
+    return segment_size_ ? pos % segment_size_ : pos;
+  }
+  off_t SegmentBegin(off_t pos) const { return pos - SegmentOffset(pos); }
+  off_t SegmentEnd(off_t pos) const {
+    return segment_size_ ? SegmentBegin(pos) + segment_size_ :
+        std::numeric_limits<off_t>::max();
+  }
+  // End of the bytes on disk in the segment containing the position, which
+  // bounds lengths read from the file. Returns -1 if the segment is absent.
+  off_t StoredEnd(off_t pos) const;
+  // The oldest position still on disk
+  off_t begin() const { return first_segment_ * segment_size_; }
+  // Beginning of the newest segment on disk
+  off_t last_segment_begin() const { return last_segment_ * segment_size_; }
+
+  off_t offset() const { return offset_; }
+  // Sets the end of the log after opening.
+  void set_offset(off_t offset);
+  // All bytes before this offset have been written.
+  off_t written_offset() const { return written_; }
+  // All bytes before this offset have been written and synced.
+  off_t durable_offset() const { return durable_; }
+
+  // Pre-creates the next segment in the background when one is first used.
+  void set_precreate(bool precreate) { precreate_ = precreate; }
+
+  // Switches to direct mode with the block size, or back with zero.
+  // The segment size should be a multiple of the block size. Called before
+  // any concurrent use.
+  int SetDirect(size_t block_size, AlignedBufferPool *pool);
+  size_t block_size() const { return block_size_; }
+
+  // Maps segments on demand from now on. Only for segmented files.
+  // Segments that cannot be preallocated fail to open from then on.
+  int EnableMapping();
+  bool mapped() const { return mapped_; }
+  // Address of the position in the mapping of its segment, which is mapped
+  // if needed. Returns nullptr for dropped or absent segments.
+  char *Map(off_t pos);
+
+  // Reserves space at the end of the file and returns its position.
+  // An alignment other than one starts the space at such a multiple,
+  // and the gap before it is padded by the filler.
+  // Returns -1 with EINVAL for more bytes than a segment holds.
+  off_t Reserve(size_t nbytes, size_t alignment = 1);
+  // Writes to a reserved position. Returns the number of bytes written.
+  ssize_t Write(const void *buf, size_t nbytes, off_t pos);
+  // Gathers and writes to a reserved position.
+  ssize_t WriteV(const iovec iov[], int iovcnt, off_t pos);
+  // Moves the bytes to a reserved position within a segment through the
+  // pipe, which references the pages of the buffer instead of copying them.
+  // The pipe is drained, and the buffer can be reused, on return.
+  // Returns the number of bytes written.
+  ssize_t Splice(const void *buf, size_t nbytes, off_t pos,
+      const int pipe_fds[2]);
+  // Reserves and writes. Returns the position, or -1 on failure.
+  off_t Append(const void *buf, size_t nbytes);
+  // Marks a reserved range as written, e.g., after an asynchronous write.
+  void Complete(off_t pos, size_t nbytes);
+  // Records that a reserved range could not be written, so that the written
+  // offset stops before it. Syncs fail from then on with the first error.
+  void SetError(int err);
+  int error() const { return error_; }
+  // Flushes data written so far and advances the durable offset.
+  int Sync() { return SyncTo(written_); }
+  // Makes all bytes before the offset durable. Concurrent callers share
+  // flushes: one issues fdatasync for all data written so far while the
+  // others wait and piggyback on it or on the next one.
+  // Returns nonzero on failure, the write error if one was recorded.
+  int SyncTo(off_t offset);
+  // Number of flushes issued
+  uint64_t num_flushes() const { return num_flushes_; }
+  // Records that all bytes before the offset have been synced.
+  void MarkDurable(off_t offset);
+
+  // Write calls issued on the file and the bytes they carry, whole blocks
+  // in direct mode, and the padding of gaps. Writes to mappings are not
+  // counted.
+  WriteStats write_stats() const { return counters_.stats(); }
+  // Counts writes issued on a descriptor of the file by others, e.g.,
+  // asynchronous ones.
+  void CountWrites(uint64_t calls, uint64_t nbytes) {
+    counters_.AddWrites(calls, nbytes);
+  }
+
+  // Returns the number of bytes read, which is short at the end.
+  ssize_t Read(void *buf, size_t nbytes, off_t pos);
+  ssize_t ReadV(const iovec iov[], int iovcnt, off_t pos);
+
+  // Deletes the segments that end before the position. The caller makes
+  // sure no one reads them any more.
+  int DropSegments(off_t pos);
+  // Discards everything from the position on.
+  int Truncate(off_t pos);
+
+ private:
+  // Descriptor and mapping of a segment
+  struct Slot {
+    std::atomic_int fd;
+    std::atomic<char *> map;
+    Slot() : fd(-1), map(nullptr) {}
+  };
+  // Chunks of slots by index, which never move once allocated
+  struct SlotTable {
+    explicit SlotTable(int64_t size);
+    int64_t size;
+    std::unique_ptr<std::atomic<Slot *>[]> chunks;
+  };
+  static const int64_t kChunkSlots = 1024;
+
+  int64_t SegmentIndex(off_t pos) const {
+    return segment_size_ ? pos / segment_size_ : 0;
+  }
+  // Slot of the segment, or nullptr if its chunk is not allocated
+  Slot *FindSlot(int64_t segment) const;
+  // Allocates the chunk of the slot if needed, and the table if full.
+  // Called with the segment mutex held.
+  Slot *AddSlot(int64_t segment);
+  template <class Op>
+  void ForEachSlot(Op op);
+  int OpenSegment(int64_t segment);
+  // Called with the segment mutex held, or without concurrent users.
+  void CloseSegment(int64_t segment);
+  off_t Align(off_t pos, size_t alignment) const;
+  void Pad(off_t pos, size_t len);
+  // Writes without marking the range as written.
+  ssize_t WriteAt(const iovec iov[], int iovcnt, off_t pos);
+  ssize_t DirectWrite(int fd, const iovec iov[], int iovcnt, off_t pos);
+  ssize_t DirectRead(int fd, const iovec iov[], int iovcnt, off_t pos);
+  // Fills in a block of the file before a direct write to part of it.
+  int LoadBlock(int fd, off_t block, char *mem);
+  int Flush(off_t from, off_t to);
+  void DrainPending();
+  // Descriptor of an open segment, without creating it
+  int OpenDescriptor(off_t pos) const {
+    Slot *slot = FindSlot(SegmentIndex(pos));
+    return slot ? slot->fd.load() : -1;
+  }
+  template <class Op>
+  ssize_t Transfer(const iovec iov[], int iovcnt, off_t pos, bool create,
+      Op op);
+
+  std::string name_;
+  off_t segment_size_;
+  Filler filler_;
+  bool create_;
+  bool precreate_;
+
+  // Slots are allocated by chunk as segments are first used, through a
+  // table that doubles when full. Replaced tables are kept until closing,
+  // so that readers need no lock.
+  std::atomic<SlotTable *> slots_;
+  std::vector<std::unique_ptr<SlotTable>> tables_;
+  std::atomic<int64_t> first_segment_;
+  std::atomic<int64_t> last_segment_;
+  std::mutex segment_mutex_;
+  std::future<void> next_segment_;
+  std::mutex next_mutex_;
+
+  std::atomic<off_t> offset_;
+  std::atomic<off_t> written_;
+  std::atomic<off_t> durable_;
+  std::atomic_int error_; // first failed write, which is never written
+
+  // Ranges completed ahead of the written offset
+  std::map<off_t, off_t> pending_;
+  std::atomic_int num_pending_;
+  std::mutex mutex_;
+
+  bool flushing_;
+  std::atomic_int num_waiting_; // for the written offset
+  std::atomic<uint64_t> num_flushes_;
+  std::mutex flush_mutex_;
+  std::condition_variable flush_cv_;
+
+  size_t block_size_; // zero unless in direct mode
+  AlignedBufferPool *pool_;
+  // Blocks partially written, by position
+  std::map<off_t, std::vector<char>> partial_blocks_;
+  off_t direct_base_; // blocks before it may hold bytes on disk
+  std::mutex direct_mutex_;
+
+  bool mapped_;
+
+  WriteCounters counters_;
+};
+
+// Implementation of File
+
+inline File::File() : segment_size_(0), filler_(nullptr), create_(false),
+    precreate_(false), slots_(nullptr), first_segment_(0), last_segment_(-1),
+    offset_(0), written_(0), durable_(0), error_(0), num_pending_(0),
+    flushing_(false), num_waiting_(0), num_flushes_(0), block_size_(0),
+    pool_(nullptr), direct_base_(0), mapped_(false) {
+}
+
+inline File::~File() {
+  Close();
+}
+
+inline std::string File::SegmentName(int64_t segment) const {
+  if (!segment_size_) return name_;
+  char suffix[16];
+  snprintf(suffix, sizeof(suffix), ".%06" PRId64, segment);
+  return name_ + suffix;
+}
+
+inline int File::Open(const std::string &name, off_t segment_size,
+    Filler filler, bool create) {
+  name_ = name;
+  segment_size_ = segment_size;
+  filler_ = filler;
+  create_ = create;
+
+  if (!segment_size_) {
+    int fd = OpenSegment(0);
+    if (fd < 0) return -1;
+    first_segment_ = last_segment_ = 0;
+    set_offset(lseek(fd, 0, SEEK_END));
+    return 0;
+  }
+
+  // Finds existing segments.
+  size_t slash = name_.rfind('/');
+  std::string dir = (slash == std::string::npos) ? "." :
+      name_.substr(0, slash + 1);
+  std::string base = name_.substr(slash == std::string::npos ? 0 : slash + 1);
+  DIR *dp = opendir(dir.c_str());
+  if (!dp) return -1;
+  int64_t first = -1, last = -1;
+  while (dirent *entry = readdir(dp)) {
+    std::string file(entry->d_name);
+    if (file.size() < base.size() + 7 || file.compare(0, base.size(), base) ||
+        file[base.size()] != '.' || !isdigit(file[base.size() + 1])) continue;
+    char *end;
+    int64_t segment = strtoll(file.c_str() + base.size() + 1, &end, 10);
+    if (*end) continue;
+    if (first < 0 || segment < first) first = segment;
+    if (segment > last) last = segment;
+  }
+  closedir(dp);
+
+  if (first < 0) {
+    first_segment_ = 0;
+    last_segment_ = -1;
+    set_offset(0);
+    return 0;
+  }
+  for (int64_t s = first; s <= last; ++s) {
+    OpenSegment(s);
+  }
+  first_segment_ = first;
+  last_segment_ = last;
+  set_offset((last + 1) * segment_size_); // to be refined by the owner
+  return 0;
+}
+
+inline void File::Close() {
+  if (next_segment_.valid()) next_segment_.wait();
+  SlotTable *table = slots_;
+  if (!table) return;
+  int fd = OpenDescriptor(0);
+  if (block_size_ && !segment_size_ && fd >= 0) {
+    // Cuts the tail of the last block written in direct mode.
+    if (ftruncate(fd, written_)) perror("[ERROR] File::Close");
+  }
+  ForEachSlot([this](int64_t segment, Slot &) { CloseSegment(segment); });
+  for (int64_t i = 0; i < table->size; ++i) {
+    delete[] table->chunks[i].load();
+  }
+  slots_ = nullptr;
+  tables_.clear();
+  mapped_ = false;
+}
+
+inline File::SlotTable::SlotTable(int64_t size) : size(size),
+    chunks(new std::atomic<Slot *>[size]) {
+  for (int64_t i = 0; i < size; ++i) {
+    chunks[i] = nullptr;
+  }
+}
+
+inline File::Slot *File::FindSlot(int64_t segment) const {
+  SlotTable *table = slots_;
+  int64_t chunk = segment / kChunkSlots;
+  if (!table || chunk >= table->size) return nullptr;
+  Slot *slots = table->chunks[chunk];
+  return slots ? slots + segment % kChunkSlots : nullptr;
+}
+
+inline File::Slot *File::AddSlot(int64_t segment) {
+  Slot *slot = FindSlot(segment);
+  if (slot) return slot;
+  int64_t chunk = segment / kChunkSlots;
+  SlotTable *table = slots_;
+  if (!table || chunk >= table->size) {
+    int64_t size = table ? table->size : 1;
+    while (size <= chunk) size *= 2;
+    SlotTable *grown = new SlotTable(size);
+    for (int64_t i = 0; table && i < table->size; ++i) {
+      grown->chunks[i] = table->chunks[i].load();
+    }
+    tables_.emplace_back(grown);
+    slots_ = table = grown;
+  }
+  Slot *slots = new Slot[kChunkSlots];
+  table->chunks[chunk] = slots;
+  return slots + segment % kChunkSlots;
+}
+
+// Applies the operation to the allocated slots with their segments.
+template <class Op>
+inline void File::ForEachSlot(Op op) {
+  SlotTable *table = slots_;
+  for (int64_t i = 0; table && i < table->size; ++i) {
+    Slot *slots = table->chunks[i];
+    for (int64_t j = 0; slots && j < kChunkSlots; ++j) {
+      op(i * kChunkSlots + j, slots[j]);
+    }
+  }
+}
+
+inline void File::CloseSegment(int64_t segment) {
+  Slot *slot = FindSlot(segment);
+  if (!slot) return;
+  if (slot->map) {
+    munmap(slot->map, segment_size_);
+    slot->map = nullptr;
+  }
+  if (slot->fd >= 0) close(slot->fd);
+  slot->fd = -1;
+}
+
+inline int File::EnableMapping() {
+  if (!segment_size_) {
+    errno = EINVAL;
+    return -1;
+  }
+  mapped_ = true;
+  return 0;
+}
+
+inline char *File::Map(off_t pos) {
+  Slot *slot = FindSlot(SegmentIndex(pos));
+  char *mem = slot ? slot->map.load() : nullptr;
+  if (!mem) {
+    int fd = descriptor(pos); // creates and preallocates the segment
+    if (fd < 0) return nullptr;
+    std::lock_guard<std::mutex> lock(segment_mutex_);
+    slot = FindSlot(SegmentIndex(pos));
+    mem = slot->map;
+    if (!mem) {
+      void *addr = mmap(nullptr, segment_size_, PROT_READ | PROT_WRITE,
+          MAP_SHARED, fd, 0);
+      if (addr == MAP_FAILED) {
+        perror("[ERROR] File::Map mmap");
+        return nullptr;
+      }
+      slot->map = mem = (char *)addr;
+    }
+  }
+  return mem + SegmentOffset(pos);
+}
+
+inline off_t File::StoredEnd(off_t pos) const {
+  int fd = OpenDescriptor(pos);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st)) return -1;
+  return std::min<off_t>(SegmentBegin(pos) + st.st_size, SegmentEnd(pos));
+}
+
+inline void File::set_offset(off_t offset) {
+  offset_ = offset;
+  written_ = offset;
+  durable_ = offset;
+  std::lock_guard<std::mutex> lock(direct_mutex_);
+  partial_blocks_.clear();
+  direct_base_ = offset;
+}
+
+inline int File::SetDirect(size_t block_size, AlignedBufferPool *pool) {
+  assert(!block_size || (pool && pool->alignment() % block_size == 0));
+  if (segment_size_ % std::max<size_t>(block_size, 1)) {
+    errno = EINVAL;
+    return -1;
+  }
+  std::lock_guard<std::mutex> lock(segment_mutex_);
+  int err = 0;
+  ForEachSlot([block_size, &err](int64_t, Slot &slot) {
+    int fd = slot.fd;
+    if (fd < 0 || err) return;
+    int flags = fcntl(fd, F_GETFL);
+    flags = block_size ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags)) err = -1;
+  });
+  if (err) {
+    perror("[ERROR] File::SetDirect fcntl");
+    return -1;
+  }
+  block_size_ = block_size;
+  pool_ = pool;
+  std::lock_guard<std::mutex> direct_lock(direct_mutex_);
+  partial_blocks_.clear();
+  direct_base_ = offset_;
+  return 0;
+}
+
+inline int File::OpenSegment(int64_t segment) {
+  std::lock_guard<std::mutex> lock(segment_mutex_);
+  Slot *slot = AddSlot(segment);
+  if (slot->fd >= 0) return slot->fd;
+
+  mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP;
+  int flags = O_RDWR | (create_ ? O_CREAT : 0) | (block_size_ ? O_DIRECT : 0);
+  int fd = open(SegmentName(segment).c_str(), flags, mode);
+  if (fd < 0) {
+    if (create_) perror("[ERROR] File::OpenSegment open");
+    return -1;
+  }
+  if (segment_size_ && create_) {
+    // Allocates blocks and sets the size once, so that appends do not
+    // change file metadata. A mapping cannot be stored to beyond the size.
+    int err = posix_fallocate(fd, 0, segment_size_);
+    if (err && mapped_) {
+      fprintf(stderr, "[ERROR] File::OpenSegment fallocate: %s\n",
+          strerror(err));
+      close(fd);
+      errno = err;
+      return -1;
+    }
+    if (err) fprintf(stderr, "[WARNING] File::OpenSegment fallocate: %s\n",
+        strerror(err));
+  }
+  slot->fd = fd;
+  return fd;
+}
+
+inline int File::descriptor(off_t pos) {
+  int64_t segment = SegmentIndex(pos);
+  int fd = OpenDescriptor(pos);
+  if (fd < 0) {
+    if (segment < first_segment_) return -1; // dropped
+    fd = OpenSegment(segment);
+    if (fd < 0) return -1;
+  }
+
+  int64_t last = last_segment_;
+  while (segment > last) { // first use of the segment
+    if (!last_segment_.compare_exchange_weak(last, segment)) continue;
+    if (precreate_ && create_) {
+      std::lock_guard<std::mutex> lock(next_mutex_);
+      if (next_segment_.valid()) next_segment_.wait();
+      next_segment_ = std::async(std::launch::async,
+          [this, segment]() { OpenSegment(segment + 1); });
+    }
+    break;
+  }
+  return fd;
+}
+
+inline off_t File::Reserve(size_t nbytes, size_t alignment) {
+  if (!segment_size_ && alignment == 1) return offset_.fetch_add(nbytes);
+
+  if (segment_size_ && (off_t)nbytes > segment_size_) {
+    errno = EINVAL; // would cross segments
+    return -1;
+  }
+  off_t pos = offset_;
+  off_t begin;
+  do {
+    begin = Align(pos, alignment);
+    if (begin + (off_t)nbytes > SegmentEnd(pos)) begin = SegmentEnd(pos);
+  } while (!offset_.compare_exchange_weak(pos, begin + nbytes));
+  if (begin != pos) Pad(pos, begin - pos);
+  return begin;
+}
+
+// Rounds up the position, leaving a gap large enough for the filler.
+inline off_t File::Align(off_t pos, size_t alignment) const {
+  if (alignment == 1) return pos;
+  off_t begin = (pos + alignment - 1) / alignment * alignment;
+  char marker[64];
+  while (begin != pos && filler_ && !filler_(marker, begin - pos)) {
+    begin += alignment;
+  }
+  return begin;
+}
+
+inline void File::Pad(off_t pos, size_t len) {
+  char marker[64];
+  size_t count = filler_ ? filler_(marker, len) : 0;
+  assert(count <= sizeof(marker));
+  if (count) {
+    iovec iov = { marker, count };
+    ssize_t ret = WriteAt(&iov, 1, pos);
+    if (ret != (ssize_t)count) {
+      perror("[ERROR] File::Pad write");
+      SetError(EIO);
+      return;
+    }
+  }
+  counters_.AddPadding(len);
+  Complete(pos, len);
+}
+
+// Splits the vectors by segments and applies the operation to each piece.
+template <class Op>
+inline ssize_t File::Transfer(const iovec iov[], int iovcnt, off_t pos,
+    bool create, Op op) {
+  std::vector<iovec> vec(iov, iov + iovcnt);
+  size_t i = 0;
+  ssize_t total = 0;
+  while (i < vec.size()) {
+    if (!vec[i].iov_len) {
+      ++i;
+      continue;
+    }
+    int fd = create ? descriptor(pos) : OpenDescriptor(pos);
+    if (fd < 0) return total ? total : -1;
+
+    iovec piece[IOV_MAX];
+    int n = 0;
+    size_t room = SegmentEnd(pos) - pos;
+    size_t len = 0;
+    for (size_t j = i; j < vec.size() && len < room && n < IOV_MAX; ++j) {
+      piece[n] = vec[j];
+      piece[n].iov_len = std::min(piece[n].iov_len, room - len);
+      len += piece[n++].iov_len;
+    }
+
+    ssize_t ret = op(fd, piece, n, pos);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      return ret;
+    }
+    if (ret == 0) break; // end of file
+    total += ret;
+    pos += ret;
+    while (ret) { // consumes the vectors
+      size_t step = std::min<size_t>(ret, vec[i].iov_len);
+      vec[i].iov_base = (char *)vec[i].iov_base + step;
+      vec[i].iov_len -= step;
+      ret -= step;
+      if (!vec[i].iov_len) ++i;
+    }
+  }
+  return total;
+}
+
+inline ssize_t File::Write(const void *buf, size_t nbytes, off_t pos) {
+  iovec iov = { (void *)buf, nbytes };
+  return WriteV(&iov, 1, pos);
+}
+
+inline ssize_t File::WriteV(const iovec iov[], int iovcnt, off_t pos) {
+  size_t nbytes = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    nbytes += iov[i].iov_len;
+  }
+  ssize_t count = WriteAt(iov, iovcnt, pos);
+  if (count != (ssize_t)nbytes) {
+    perror("[ERROR] File::WriteV pwritev");
+    SetError(EIO);
+    return count;
+  }
+  Complete(pos, nbytes);
+  return count;
+}
+
+inline ssize_t File::Splice(const void *buf, size_t nbytes, off_t pos,
+    const int pipe_fds[2]) {
+  assert(pos + (off_t)nbytes <= SegmentEnd(pos));
+  int fd = descriptor(pos);
+  if (fd < 0) return -1;
+  loff_t off = SegmentOffset(pos);
+  const char *p = (const char *)buf;
+  size_t left = nbytes;
+  while (left) {
+    iovec iov = { (void *)p, left };
+    ssize_t in = vmsplice(pipe_fds[1], &iov, 1, 0);
+    if (in < 0) {
+      if (errno == EINTR) continue;
+      perror("[ERROR] File::Splice vmsplice");
+      SetError(EIO);
+      return -1;
+    }
+    p += in;
+    left -= in;
+    while (in) {
+      ssize_t out = splice(pipe_fds[0], nullptr, fd, &off, in, SPLICE_F_MOVE);
+      if (out <= 0) {
+        if (out < 0 && errno == EINTR) continue;
+        perror("[ERROR] File::Splice splice");
+        SetError(EIO);
+        return -1;
+      }
+      counters_.AddWrites(1, out);
+      in -= out;
+    }
+  }
+  Complete(pos, nbytes);
+  return nbytes;
+}
+
+inline off_t File::Append(const void *buf, size_t nbytes) {
+  off_t pos = Reserve(nbytes);
+  if (pos < 0 || Write(buf, nbytes, pos) != (ssize_t)nbytes) return -1;
+  return pos;
+}
+
+inline ssize_t File::Read(void *buf, size_t nbytes, off_t pos) {
+  iovec iov = { buf, nbytes };
+  return ReadV(&iov, 1, pos);
+}
+
+inline ssize_t File::ReadV(const iovec iov[], int iovcnt, off_t pos) {
+  return Transfer(iov, iovcnt, pos, false,
+      [this](int fd, const iovec *v, int n, off_t pos) {
+    if (block_size_) return DirectRead(fd, v, n, pos);
+    return preadv(fd, v, n, SegmentOffset(pos));
+  });
+}
+
+inline ssize_t File::WriteAt(const iovec iov[], int iovcnt, off_t pos) {
+  return Transfer(iov, iovcnt, pos, true,
+      [this](int fd, const iovec *v, int n, off_t pos) {
+    if (block_size_) return DirectWrite(fd, v, n, pos);
+    ssize_t ret = pwritev(fd, v, n, SegmentOffset(pos));
+    counters_.AddWrites(1, ret > 0 ? ret : 0);
+    return ret;
+  });
+}
+
+// Writes the whole blocks covering the range. Direct writes are serialized,
+// so that those sharing a block land in the order of their merges.
+inline ssize_t File::DirectWrite(int fd, const iovec iov[], int iovcnt,
+    off_t pos) {
+  size_t len = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    len += iov[i].iov_len;
+  }
+  const off_t block = block_size_;
+  off_t begin = pos / block * block;
+  off_t end = (pos + len + block - 1) / block * block;
+  size_t size = end - begin;
+  char *buf = pool_->Allocate(size);
+  if (!buf) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  std::lock_guard<std::mutex> lock(direct_mutex_);
+  // Forgets blocks that no write touches any more.
+  off_t written = written_;
+  while (!partial_blocks_.empty() &&
+      partial_blocks_.begin()->first + block <= written) {
+    partial_blocks_.erase(partial_blocks_.begin());
+  }
+  bool head = begin < pos;
+  bool tail = end > pos + (off_t)len;
+  int err = 0;
+  if (head) err = LoadBlock(fd, begin, buf);
+  if (tail && !err && (!head || end - block > begin)) {
+    err = LoadBlock(fd, end - block, buf + size - block);
+  }
+  if (err) {
+    pool_->Free(buf, size);
+    return -1;
+  }
+  char *p = buf + (pos - begin);
+  for (int i = 0; i < iovcnt; ++i) {
+    memcpy(p, iov[i].iov_base, iov[i].iov_len);
+    p += iov[i].iov_len;
+  }
+  if (head) partial_blocks_[begin].assign(buf, buf + block);
+  if (tail) partial_blocks_[end - block].assign(buf + size - block, buf + size);
+
+  ssize_t ret = pwrite(fd, buf, size, SegmentOffset(begin));
+  pool_->Free(buf, size);
+  counters_.AddWrites(1, ret > 0 ? ret : 0);
+  if (ret < 0) return ret;
+  if (ret != (ssize_t)size) {
+    errno = EIO;
+    return -1;
+  }
+  return len;
+}
+
+inline int File::LoadBlock(int fd, off_t block, char *mem) {
+  auto it = partial_blocks_.find(block);
+  if (it != partial_blocks_.end()) {
+    memcpy(mem, it->second.data(), block_size_);
+  } else if (block < direct_base_) { // written before direct mode
+    ssize_t ret = pread(fd, mem, block_size_, SegmentOffset(block));
+    if (ret < 0) return -1;
+    memset(mem + ret, 0, block_size_ - ret);
+  } else {
+    memset(mem, 0, block_size_);
+  }
+  return 0;
+}
+
+// Reads the whole blocks covering the range and copies the bytes out.
+inline ssize_t File::DirectRead(int fd, const iovec iov[], int iovcnt,
+    off_t pos) {
+  size_t len = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    len += iov[i].iov_len;
+  }
+  const off_t block = block_size_;
+  off_t begin = pos / block * block;
+  off_t end = (pos + len + block - 1) / block * block;
+  size_t size = end - begin;
+  char *buf = pool_->Allocate(size);
+  if (!buf) {
+    errno = ENOMEM;
+    return -1;
+  }
+  ssize_t ret = pread(fd, buf, size, SegmentOffset(begin));
+  if (ret < 0) {
+    pool_->Free(buf, size);
+    return ret;
+  }
+  size_t count = std::min<ssize_t>(std::max<ssize_t>(ret - (pos - begin), 0),
+      len);
+  const char *p = buf + (pos - begin);
+  size_t left = count;
+  for (int i = 0; i < iovcnt && left; ++i) {
+    size_t step = std::min(left, iov[i].iov_len);
+    memcpy(iov[i].iov_base, p, step);
+    p += step;
+    left -= step;
+  }
+  pool_->Free(buf, size);
+  return count;
+}
+
+// Wakes syncs waiting for the written offset, if any. A waiter counts itself
+// before checking the offset, so either it sees the advance or it is woken.
+inline void File::Complete(off_t pos, size_t nbytes) {
+  off_t expected = pos;
+  if (!written_.compare_exchange_strong(expected, pos + nbytes)) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_[pos] = pos + nbytes;
+    ++num_pending_;
+  }
+  if (num_pending_) DrainPending();
+  if (num_waiting_) {
+    std::lock_guard<std::mutex> lock(flush_mutex_);
+    flush_cv_.notify_all();
+  }
+}
+
+inline void File::SetError(int err) {
+  int none = 0;
+  error_.compare_exchange_strong(none, err);
+  std::lock_guard<std::mutex> lock(flush_mutex_);
+  flush_cv_.notify_all();
+}
+
+// Advances the written offset over pending ranges that have become contiguous.
+inline void File::DrainPending() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  while (!pending_.empty()) {
+    auto it = pending_.begin();
+    off_t head = it->first;
+    if (!written_.compare_exchange_strong(head, it->second)) break;
+    pending_.erase(it);
+    --num_pending_;
+  }
+}
+
+inline int File::SyncTo(off_t offset) {
+  if (durable_ >= offset) return 0;
+  std::unique_lock<std::mutex> lock(flush_mutex_);
+  // Waits for writes in flight before the offset.
+  ++num_waiting_;
+  while (written_ < offset && !error_) {
+    flush_cv_.wait(lock);
+  }
+  --num_waiting_;
+  if (error_) {
+    errno = error_;
+    return error_;
+  }
+  while (durable_ < offset) {
+    if (flushing_) { // follower
+      flush_cv_.wait(lock);
+      continue;
+    }
+    flushing_ = true; // leader
+    off_t from = durable_;
+    off_t to = written_;
+    lock.unlock();
+    int err = Flush(from, to);
+    lock.lock();
+    flushing_ = false;
+    flush_cv_.notify_all();
+    if (err) return err;
+  }
+  return 0;
+}
+
+// Flushes only segments with unsynced data.
+inline int File::Flush(off_t from, off_t to) {
+  ++num_flushes_;
+  for (int64_t s = SegmentIndex(from); s <= SegmentIndex(to - 1); ++s) {
+    Slot *slot = FindSlot(s);
+    if (!slot) continue;
+    char *mem = slot->map;
+    if (mem) { // only the dirty range, from its page
+      static const off_t page = sysconf(_SC_PAGESIZE);
+      off_t begin = std::max(from, s * segment_size_) - s * segment_size_;
+      off_t end = std::min(to, (s + 1) * segment_size_) - s * segment_size_;
+      begin = begin / page * page;
+      if (msync(mem + begin, end - begin, MS_SYNC)) return -1;
+      continue;
+    }
+    int fd = slot->fd;
+    if (fd >= 0 && fdatasync(fd)) return -1;
+  }
+  MarkDurable(to);
+  return 0;
+}
+
+inline void File::MarkDurable(off_t offset) {
+  off_t durable = durable_;
+  while (durable < offset &&
+      !durable_.compare_exchange_weak(durable, offset));
+}
+
+inline int File::DropSegments(off_t pos) {
+  if (!segment_size_) return 0;
+  std::lock_guard<std::mutex> lock(segment_mutex_);
+  int count = 0;
+  int64_t end = std::min(SegmentIndex(pos), SegmentIndex(written_));
+  for (int64_t s = first_segment_; s < end; ++s) {
+    CloseSegment(s);
+    if (unlink(SegmentName(s).c_str()) == 0) ++count;
+  }
+  if (end > first_segment_) first_segment_ = end;
+  return count;
+}
+
+inline int File::Truncate(off_t pos) {
+  if (!segment_size_) {
+    int err = ftruncate(descriptor(0), pos);
+    if (!err) set_offset(pos);
+    return err;
+  }
+  int64_t segment = SegmentIndex(pos);
+  for (int64_t s = segment + 1; s <= last_segment_; ++s) {
+    std::lock_guard<std::mutex> lock(segment_mutex_);
+    CloseSegment(s);
+    unlink(SegmentName(s).c_str());
+  }
+  if (last_segment_ > segment) last_segment_ = segment;
+  set_offset(pos);
+  if (descriptor(pos) >= 0) {
+    // Zeroes the stale tail, which keeps its blocks.
+    std::vector<char> zeros(1 << 20);
+    for (off_t off = pos; off < SegmentEnd(pos); off += zeros.size()) {
+      iovec iov = { zeros.data(),
+          (size_t)std::min<off_t>(zeros.size(), SegmentEnd(pos) - off) };
+      if (WriteAt(&iov, 1, off) != (ssize_t)iov.iov_len) return -1;
+    }
+  }
+  partial_blocks_.clear();
+  return 0;
+}
+
+} // namespace plib
+
+#endif // VM_PERSISTENCE_PLIB_FILE_H_
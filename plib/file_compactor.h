@@ -0,0 +1,452 @@
+//
+//  file_compactor.h
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 12, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#ifndef VM_PERSISTENCE_PLIB_FILE_COMPACTOR_H_
+#define VM_PERSISTENCE_PLIB_FILE_COMPACTOR_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "file_store.h"
+#include "format.h"
+#include "log_scanner.h"
+#include "version_index.h"
+
+namespace plib {
+
+// Reclaims the oldest segments of a file store while it is in use.
+// Kept are the versions visible at or after the newest timestamp minus the
+// retention window, and those visible at pinned timestamps. Live pages in
+// the oldest data segment are copied to the end of the same data file with
+// new metadata, and live metadata in the oldest metadata segment is copied
+// to the end of the metadata file, before the segments are dropped.
+// Live deltas and compressed pages are copied as whole pages, and live
+// references to shared versions as references.
+// The store must use segments.
+template <typename DataEntry>
+class FileCompactor {
+ public:
+  struct Stats {
+    uint64_t reclaimed_bytes; // of dropped segments
+    uint64_t rewritten_bytes; // of live data and metadata copied
+    uint64_t dropped_segments;
+    uint64_t pruned_versions;
+  };
+
+  FileCompactor(FileStore<DataEntry> &store, uint64_t retention);
+  ~FileCompactor() { Stop(); }
+
+  void Pin(uint64_t timestamp);
+  void Unpin(uint64_t timestamp);
+
+  uint64_t retention() const { return retention_; }
+  void set_retention(uint64_t retention) { retention_ = retention; }
+  // Limits rewritten bytes per second. Zero means no limit.
+  void set_rate(uint64_t rate) { rate_ = rate; }
+  // A segment is compacted only if at most this fraction of it is live.
+  void set_max_live_ratio(double ratio) { max_live_ratio_ = ratio; }
+
+  // Makes one pass over all files. Returns the number of bytes reclaimed.
+  uint64_t Compact();
+  // Compacts in a background thread every interval.
+  void Start(int interval_ms = 1000);
+  void Stop();
+
+  Stats stats() const;
+
+ private:
+  // Returns the number of bytes reclaimed.
+  uint64_t CompactData(uint8_t index, off_t limit, uint64_t horizon,
+      const std::vector<uint64_t> &pins);
+  uint64_t CompactMeta(off_t limit);
+  uint64_t Drop(File &file, off_t end);
+  void Throttle(size_t nbytes);
+
+  FileStore<DataEntry> &store_;
+  std::atomic<uint64_t> retention_;
+  std::atomic<uint64_t> rate_;
+  std::atomic<double> max_live_ratio_;
+
+  std::vector<uint64_t> pins_; // sorted
+  std::mutex pin_mutex_;
+  std::mutex compact_mutex_;
+
+  // Versions only die when pruned, so a segment found too live is not
+  // checked again until the next prune.
+  uint64_t pruned_horizon_;
+  std::vector<uint64_t> pruned_pins_;
+  uint64_t num_prunes_;
+  std::vector<std::pair<off_t, uint64_t>> too_live_; // per file
+
+  std::chrono::steady_clock::time_point throttle_begin_;
+  uint64_t throttle_bytes_;
+
+  std::atomic<uint64_t> reclaimed_bytes_;
+  std::atomic<uint64_t> rewritten_bytes_;
+  std::atomic<uint64_t> dropped_segments_;
+  std::atomic<uint64_t> pruned_versions_;
+
+  std::thread thread_;
+  std::condition_variable stop_cv_;
+  std::mutex stop_mutex_;
+  bool stop_;
+};
+
+// Implementation of FileCompactor
+
+template <typename DataEntry>
+FileCompactor<DataEntry>::FileCompactor(FileStore<DataEntry> &store,
+    uint64_t retention) : store_(store), retention_(retention), rate_(0),
+    max_live_ratio_(0.5), pruned_horizon_(0), num_prunes_(0),
+    too_live_(store.out_files_.size(), { -1, 0 }),
+    throttle_bytes_(0), reclaimed_bytes_(0),
+    rewritten_bytes_(0), dropped_segments_(0), pruned_versions_(0),
+    stop_(false) {
+}
+
+template <typename DataEntry>
+void FileCompactor<DataEntry>::Pin(uint64_t timestamp) {
+  std::lock_guard<std::mutex> lock(pin_mutex_);
+  pins_.insert(std::upper_bound(pins_.begin(), pins_.end(), timestamp),
+      timestamp);
+}
+
+template <typename DataEntry>
+void FileCompactor<DataEntry>::Unpin(uint64_t timestamp) {
+  std::lock_guard<std::mutex> lock(pin_mutex_);
+  auto it = std::lower_bound(pins_.begin(), pins_.end(), timestamp);
+  if (it != pins_.end() && *it == timestamp) pins_.erase(it);
+}
+
+template <typename DataEntry>
+uint64_t FileCompactor<DataEntry>::Compact() {
+  std::lock_guard<std::mutex> lock(compact_mutex_);
+  std::vector<File> &files = store_.out_files_;
+  if (!files[0].segment_size()) return 0;
+  store_.LoadRuns(); // to prune and relocate all versions
+
+  std::vector<uint64_t> pins;
+  {
+    std::lock_guard<std::mutex> lock(pin_mutex_);
+    pins = pins_;
+  }
+  uint64_t last = store_.last_timestamp();
+  uint64_t horizon = last > retention_ ? last - retention_ : 0;
+
+  // Everything reserved before these offsets is indexed after the drain.
+  std::vector<off_t> limits;
+  for (File &f : files) {
+    limits.push_back(f.offset());
+  }
+  store_.DrainCommits();
+
+  throttle_begin_ = std::chrono::steady_clock::now();
+  throttle_bytes_ = 0;
+  if (!num_prunes_ || horizon != pruned_horizon_ || pins != pruned_pins_) {
+    pruned_versions_ += store_.index_.Prune(horizon, pins);
+    pruned_horizon_ = horizon;
+    pruned_pins_ = pins;
+    ++num_prunes_;
+  }
+  uint64_t reclaimed = 0;
+  for (size_t i = 1; i < files.size(); ++i) {
+    reclaimed += CompactData(i, limits[i], horizon, pins);
+  }
+  if (reclaimed) too_live_[0] = { -1, 0 }; // metadata of dropped data died
+  reclaimed += CompactMeta(limits[0]);
+  return reclaimed;
+}
+
+template <typename DataEntry>
+uint64_t FileCompactor<DataEntry>::CompactData(uint8_t index, off_t limit,
+    uint64_t horizon, const std::vector<uint64_t> &pins) {
+  using Location = VersionIndex::Location;
+  struct Move {
+    uint64_t timestamp;
+    uint64_t old_pos;
+    uint64_t new_pos;
+    size_t first; // in the locations
+    uint32_t n;
+    uint64_t flags; // of the old entries
+  };
+
+  File &f = store_.out_files_[index];
+  File &mf = store_.out_files_[0];
+  const off_t segment_size = f.segment_size();
+  const size_t max_pages =
+      (segment_size - sizeof(DataHeader)) / sizeof(DataEntry);
+  uint64_t reclaimed = 0;
+  while (true) {
+    off_t begin = f.begin();
+    off_t end = f.SegmentEnd(begin);
+    if (end > limit || end > f.written_offset()) break;
+    if (too_live_[index] == std::make_pair(begin, num_prunes_)) break;
+
+    std::vector<Location> live;
+    store_.index_.Collect(index, begin, end, &live);
+    if (live.size() * sizeof(DataEntry) > max_live_ratio_ * segment_size) {
+      too_live_[index] = { begin, num_prunes_ };
+      break;
+    }
+    std::sort(live.begin(), live.end(),
+        [](const Location &a, const Location &b) {
+      return a.timestamp < b.timestamp ||
+          (a.timestamp == b.timestamp && a.pos < b.pos);
+    });
+    std::vector<uint64_t> addrs(live.size());
+    for (size_t i = 0; i < live.size(); ++i) {
+      addrs[i] = live[i].addr;
+    }
+
+    // Copies pages of the same version in runs.
+    std::vector<Move> moves;
+    std::vector<char> buffer;
+    for (size_t i = 0; i < live.size();) {
+      size_t j = i + 1;
+      while (j < live.size() && j - i < max_pages &&
+          live[j].timestamp == live[i].timestamp &&
+          live[j].flags == live[i].flags && (live[i].flags ||
+          live[j].pos == live[j - 1].pos + sizeof(DataEntry))) {
+        ++j;
+      }
+      size_t len = sizeof(DataEntry) * (j - i);
+      if (live[i].flags == kSharedPosition) {
+        len = DeltaTableLength(j - i) + kSharedEntryLength * (j - i);
+      }
+      buffer.resize(sizeof(DataHeader) + len);
+      EncodeDataHeader(buffer.data(), kRawData, 0, len);
+      char *pages = buffer.data() + sizeof(DataHeader);
+      bool ok = true;
+      if (live[i].flags == kSharedPosition) {
+        char *entry = pages + DeltaTableLength(j - i);
+        for (size_t k = i; k < j && ok; ++k) {
+          Serialize(pages + sizeof(uint32_t) * (k - i),
+              (uint32_t)(entry - pages) | kDeltaShared);
+          ok = f.Read(entry, kSharedEntryLength, live[k].pos) ==
+              (ssize_t)kSharedEntryLength;
+          entry += kSharedEntryLength;
+        }
+        Serialize(pages + sizeof(uint32_t) * (j - i), (uint32_t)len);
+      } else if (live[i].flags) {
+        for (size_t k = i; k < j && ok; ++k) {
+          char *page = pages + sizeof(DataEntry) * (k - i);
+          ok = store_.RebuildPage(live[k].addr, index,
+              live[k].pos | live[k].flags, page);
+        }
+      } else {
+        ok = f.Read(pages, len, live[i].pos) == (ssize_t)len;
+      }
+      if (!ok) {
+        perror("[ERROR] FileCompactor::CompactData read");
+        return reclaimed;
+      }
+      uint64_t pos = f.Append(buffer.data(), buffer.size());
+      moves.push_back({ live[i].timestamp, live[i].pos,
+          pos + sizeof(DataHeader), i, (uint32_t)(j - i), live[i].flags });
+      Throttle(buffer.size());
+      i = j;
+    }
+    // CRC32 data carries no page addresses and is kept as a whole.
+    LogScanner scanner(f, begin);
+    DataHeader header;
+    uint32_t type;
+    while ((type = scanner.NextData(&header)) && scanner.pos() < end) {
+      if (!IsCRC32Data(type) || (header.timestamp < horizon &&
+          !std::binary_search(pins.begin(), pins.end(), header.timestamp))) {
+        continue;
+      }
+      size_t len = scanner.end() - scanner.pos();
+      if (scanner.framed()) { // rewritten on its own
+        len = CRC32DataLength(header.length);
+        buffer.resize(len);
+        CRC32DataEncode(buffer.data(), header.timestamp,
+            scanner.record() + sizeof(DataHeader), header.length);
+        f.Append(buffer.data(), len);
+      } else {
+        f.Append(scanner.record(), len);
+      }
+      Throttle(len);
+    }
+
+    // New data is durable before any metadata refers to it.
+    if (f.Sync()) {
+      perror("[ERROR] FileCompactor::CompactData sync");
+      return reclaimed;
+    }
+    for (const Move &m : moves) {
+      const bool shared = m.flags == kSharedPosition;
+      buffer.resize(MetaLength(m.n));
+      size_t len = EncodeMeta(buffer.data(), m.timestamp, &addrs[m.first],
+          m.n, index, m.new_pos, shared ? kMetaDelta : 0) - buffer.data();
+      mf.Append(buffer.data(), len);
+      if (m.flags) {
+        uint64_t pos = m.new_pos;
+        size_t entry_len = sizeof(DataEntry);
+        if (shared) {
+          pos = (pos + DeltaTableLength(m.n)) | kSharedPosition;
+          entry_len = kSharedEntryLength;
+        }
+        for (uint32_t k = 0; k < m.n; ++k) {
+          store_.index_.Relocate(&addrs[m.first + k], 1, m.timestamp, index,
+              live[m.first + k].pos | live[m.first + k].flags,
+              pos + entry_len * k, sizeof(DataEntry));
+        }
+      } else {
+        store_.index_.Relocate(&addrs[m.first], m.n, m.timestamp, index,
+            m.old_pos, m.new_pos, sizeof(DataEntry));
+      }
+      Throttle(len);
+    }
+    if (mf.Sync()) {
+      perror("[ERROR] FileCompactor::CompactData sync");
+      return reclaimed;
+    }
+    uint64_t bytes = Drop(f, end);
+    if (!bytes) break; // still in use
+    reclaimed += bytes;
+  }
+  return reclaimed;
+}
+
+template <typename DataEntry>
+uint64_t FileCompactor<DataEntry>::CompactMeta(off_t limit) {
+  std::vector<File> &files = store_.out_files_;
+  File &mf = files[0];
+  uint64_t reclaimed = 0;
+  while (true) {
+    off_t begin = mf.begin();
+    off_t end = mf.SegmentEnd(begin);
+    if (end > limit || end > mf.written_offset()) break;
+    if (too_live_[0] == std::make_pair(begin, num_prunes_)) break;
+
+    // Keeps the runs of pages still indexed at their positions.
+    std::vector<char> live;
+    LogScanner scanner(mf, begin);
+    int64_t n;
+    while ((n = scanner.NextMeta()) >= 0 && scanner.pos() < end) {
+      uint64_t timestamp, pos;
+      uint32_t num;
+      DecodeMetaHeader(scanner.record(), &timestamp, &pos, &num);
+      const uint64_t *words = scanner.words();
+      uint8_t index = ParseIndexedPosition(&pos);
+      if (!index || index >= files.size() ||
+          pos < (uint64_t)files[index].begin()) continue;
+      if (MetaFlags(scanner.record()) & kMetaDelta) { // kept as a whole
+        live.insert(live.end(), scanner.record(),
+            scanner.record() + MetaRecordLength(scanner.record()));
+        continue;
+      }
+
+      std::vector<uint64_t> addrs(words, words + n);
+      std::unique_ptr<bool[]> present(new bool[n]);
+      store_.index_.Contains(addrs.data(), n, timestamp, index, pos,
+          sizeof(DataEntry), present.get());
+      for (int64_t i = 0; i < n;) {
+        if (!present[i]) {
+          ++i;
+          continue;
+        }
+        int64_t j = i + 1;
+        while (j < n && present[j]) ++j;
+        size_t offset = live.size();
+        live.resize(offset + MetaLength(j - i));
+        char *end = EncodeMeta(live.data() + offset, timestamp, &addrs[i],
+            j - i, index, pos + sizeof(DataEntry) * i);
+        live.resize(end - live.data());
+        i = j;
+      }
+    }
+    if (live.size() > max_live_ratio_ * mf.segment_size()) {
+      too_live_[0] = { begin, num_prunes_ };
+      break;
+    }
+
+    for (size_t offset = 0; offset < live.size();) {
+      size_t len = MetaRecordLength(live.data() + offset);
+      mf.Append(live.data() + offset, len);
+      Throttle(len);
+      offset += len;
+    }
+    if (mf.Sync()) {
+      perror("[ERROR] FileCompactor::CompactMeta sync");
+      return reclaimed;
+    }
+    uint64_t bytes = Drop(mf, end);
+    if (!bytes) break; // still in use
+    reclaimed += bytes;
+  }
+  return reclaimed;
+}
+
+template <typename DataEntry>
+uint64_t FileCompactor<DataEntry>::Drop(File &file, off_t end) {
+  int count = store_.DropSegments(file, end);
+  uint64_t bytes = (uint64_t)count * file.segment_size();
+  dropped_segments_ += count;
+  reclaimed_bytes_ += bytes;
+  return bytes;
+}
+
+template <typename DataEntry>
+void FileCompactor<DataEntry>::Throttle(size_t nbytes) {
+  using namespace std::chrono;
+  rewritten_bytes_ += nbytes;
+  if (!rate_) return;
+  throttle_bytes_ += nbytes;
+  steady_clock::time_point due = throttle_begin_ +
+      microseconds(throttle_bytes_ * 1000000 / rate_);
+  std::this_thread::sleep_until(due);
+}
+
+template <typename DataEntry>
+void FileCompactor<DataEntry>::Start(int interval_ms) {
+  Stop();
+  stop_ = false;
+  thread_ = std::thread([this, interval_ms]() {
+    std::unique_lock<std::mutex> lock(stop_mutex_);
+    while (!stop_) {
+      lock.unlock();
+      Compact();
+      lock.lock();
+      stop_cv_.wait_for(lock, std::chrono::milliseconds(interval_ms),
+          [this]() { return stop_; });
+    }
+  });
+}
+
+template <typename DataEntry>
+void FileCompactor<DataEntry>::Stop() {
+  if (!thread_.joinable()) return;
+  {
+    std::lock_guard<std::mutex> lock(stop_mutex_);
+    stop_ = true;
+  }
+  stop_cv_.notify_all();
+  thread_.join();
+}
+
+template <typename DataEntry>
+typename FileCompactor<DataEntry>::Stats
+FileCompactor<DataEntry>::stats() const {
+  return { reclaimed_bytes_, rewritten_bytes_, dropped_segments_,
+      pruned_versions_ };
+}
+
+} // namespace plib
+
+#endif // VM_PERSISTENCE_PLIB_FILE_COMPACTOR_H_
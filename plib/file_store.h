@@ -10,104 +10,976 @@
 #define VM_PERSISTENCE_PLIB_FILE_STORE_H_
 
 #include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <memory>
 #include <mutex>
+#include <shared_mutex>
+#include <thread>
 
-#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "file.h"
+#include "format.h"
+#include "log_scanner.h"
+#include "page_delta.h"
+#include "version_index.h"
+#include "version_run.h"
 #include "versioned_persistence.h"
+#include "write_stats.h"
 
 namespace plib {
 
-class File {
- public:
-  File(int fd = -1) { set_descriptor(fd); }
-  File(const File &other) {
-    descriptor_ = other.descriptor_;
-    offset_ = other.offset_;
-  }
-
-  int descriptor() const { return descriptor_; }
-  void set_descriptor(int fd) {
-    descriptor_ = fd;
-    offset_ = fd >= 0 ? lseek(fd, 0, SEEK_CUR) : -1;
-  }
-
-  off_t offset() const { return offset_; }
-  void inc_offset(off_t nbytes) { offset_ += nbytes; }
-
-  void lock() { mutex_.lock(); }
-  void unlock() { mutex_.unlock(); }
+template <typename DataEntry> class FileCompactor;
 
- private:
-  int descriptor_;
-  off_t offset_;
-  std::mutex mutex_;
+// Triggers of a sync, each disabled by zero
+struct SyncPolicy {
+  unsigned int commits; // every so many commits
+  uint64_t micros; // every so many microseconds
+  uint64_t bytes; // every so many bytes written
 };
 
 template <typename DataEntry>
 class FileStore : public VersionedPersistence<DataEntry> {
  public:
-  FileStore(const char *name_prefix, int num_files);
+  // Appends to existing files. After a crash, their torn tails should be
+  // cut by LogRecovery::Truncate() first.
+  // A non-zero segment size splits each file into preallocated segments.
+  FileStore(const char *name_prefix, int num_files, off_t segment_size = 0);
   ~FileStore();
 
   void **CheckoutPages(uint64_t timestamp, uint64_t addr[], int n);
   void DestroyPages(void *pages[], int n);
 
-  unsigned int sync_freq() const { return sync_freq_; }
-  void set_sync_freq(unsigned int freq) { sync_freq_ = freq; }
+  // Writes a payload of delta pages (see format.h) with its metadata, and
+  // indexes the pages. The payload is built by DeltaStage,
+  // CompressionStage or DedupStage.
+  int CommitDelta(uint64_t timestamp, const char *payload, uint32_t len,
+      const uint64_t meta[], uint32_t n);
+  // Keeps a version from being pruned until released, for a commit that
+  // refers to it. Fails if the version is not indexed, unless it is in the
+  // same commit.
+  bool ReferencePage(uint64_t addr, uint64_t timestamp, bool indexed = true);
+  void ReleasePage(uint64_t addr, uint64_t timestamp) {
+    index_.Release(addr, timestamp);
+  }
+
+  // Syncs are run by a background thread according to the policy.
+  SyncPolicy sync_policy() const { return sync_policy_; }
+  void set_sync_policy(const SyncPolicy &policy);
+  unsigned int sync_freq() const { return sync_policy_.commits; }
+  void set_sync_freq(unsigned int freq);
+  // Makes each commit return only after its records are durable.
+  bool wait_durable() const { return wait_durable_; }
+  void set_wait_durable(bool wait) { wait_durable_ = wait; }
+  // Makes all bytes of the file before the offset durable, sharing
+  // flushes with concurrent callers.
+  int WaitDurable(uint8_t index, off_t offset);
+  // Number of flushes issued on the file
+  uint64_t num_flushes(uint8_t index) const {
+    return out_files_[index].num_flushes();
+  }
+  // The newest timestamp indexed
+  uint64_t last_timestamp() const { return last_timestamp_; }
+  // Packs the records of each batch into frames of format version 2.
+  bool framed() const { return framed_; }
+  void set_framed(bool framed) { framed_ = framed; }
+
+  // Writes and reads all files with O_DIRECT in blocks of the size, which
+  // divides the segment size. Called before any commit.
+  int EnableDirectIO(size_t block_size = 4096);
+  size_t direct_block_size() const { return out_files_[0].block_size(); }
+
+  // Bytes of the records laid out by commits, by kind, and the writes on
+  // all files, including those of compaction. The payload of a delta
+  // commit is counted as written.
+  WriteStats write_stats() const;
+
+  // Persists the versions of the metadata records written after the last
+  // run of the on-disk index (see version_run.h) as a new run, once all
+  // files are synced. A reopened store maps the runs and only replays the
+  // records after them. Returns zero on success.
+  int PersistIndex();
+  // Persists the index in the background whenever so many bytes of
+  // metadata have been written after the last run. Zero disables.
+  uint64_t index_run_bytes() const { return index_run_bytes_; }
+  void set_index_run_bytes(uint64_t bytes) { index_run_bytes_ = bytes; }
+  const VersionRuns &index_runs() const { return runs_; }
 
  protected:
   std::vector<File> out_files_; // index 0 is reserved for metadata (versions)
+  // Counted by commits as they lay out their records
+  WriteCounters write_counters_;
 
   unsigned int seq_num() { return seq_num_++; }
   uint8_t OutIndex(unsigned int seq) {
     return seq % (out_files_.size() - 1) + 1;
   }
+
+  // Makes the pages of a committed metadata record visible to checkouts.
+  // Called after both the data and the metadata record are written.
+  void IndexMeta(uint64_t timestamp, const uint64_t meta[], uint32_t n,
+      uint8_t index, uint64_t pos);
+  // Indexes the pages of a delta payload at the position. Only the table
+  // is read, unless there are shared entries.
+  void IndexDelta(uint64_t timestamp, const uint64_t meta[], uint32_t n,
+      uint8_t index, uint64_t pos, const char *payload);
+  // Finds the position of the version of the address at the timestamp.
+  // The position of an entry other than a whole page is marked (see
+  // format.h).
+  bool FindPage(uint64_t addr, uint64_t timestamp, uint8_t *index,
+      uint64_t *pos, uint64_t *version = nullptr);
+  // Reads a page stored other than whole at the marked position: follows a
+  // reference to the version shared, and inflates a compressed page, or
+  // applies a delta, and those it is based on, to the version of the page
+  // they start from. Returns false on failure.
+  bool RebuildPage(uint64_t addr, uint8_t index, uint64_t pos, char *page);
+
+  // Brackets a commit from before its data is reserved until it is indexed.
+  // Returns the epoch to exit.
+  unsigned int EnterCommit();
+  void ExitCommit(unsigned int epoch);
+
+  // A record of up to two pieces to write
+  struct Record {
+    iovec iov[2];
+    int iovcnt;
+    size_t len;
+    FrameBuilder *frame; // if any, sealed at the position of the record
+  };
+  // Writes the records in order with one gathered write per run that fits
+  // in a segment, and sets their positions. Returns zero on success.
+  int WriteRuns(uint8_t index, const std::vector<Record> &records,
+      off_t pos[]);
+  // Returns the last frame, or a new one if the record of the length would
+  // make the last too long for a segment of the file.
+  FrameBuilder &NextFrame(std::vector<FrameBuilder> *frames, FrameType type,
+      uint8_t index, size_t len);
+
+  // Whether a record of the length fits in a segment of the file, which no
+  // record crosses, and in a frame if framed.
+  bool Fits(uint8_t index, size_t len, bool framed = false) const;
+  // Whether a commit of n pages fits, as a data record of the length and a
+  // metadata record. A commit that does not fails with EINVAL before any
+  // write.
+  bool CommitFits(uint8_t index, size_t data_len, uint32_t n) const {
+    return Fits(index, data_len) && Fits(0, framed_ ? FramedMetaLength(n) :
+        MetaLength(n), framed_);
+  }
+
+  // For writers that bypass File in direct mode: copies a raw data record
+  // into a buffer of whole blocks, padded at the end, and reserves
+  // block-aligned space for it. Returns the buffer, to be released with
+  // the length.
+  char *StageRawData(uint8_t index, const void *data, uint32_t size,
+      off_t *pos, size_t *len);
+  // Length of the buffer staged for data of the size
+  size_t StagedLength(uint32_t size) const;
+  void ReleaseStaged(char *buf, size_t len) { pool_->Free(buf, len); }
+
+  // Times appends of records of the length to a scratch file opened like
+  // the metadata file, each flushed if commits wait to be durable.
+  // Returns the median latency (ns), or -1 on failure.
+  int64_t TimeScratchWrites(size_t len, int count);
+
+  // Counts finished commits towards the sync policy, and waits for their
+  // records to be durable if required. A zero end means no record.
+  int Committed(uint8_t index, off_t data_end, off_t meta_end, size_t nbytes,
+      unsigned int count = 1);
+  // Flushes all files, in parallel by default.
+  virtual int Sync();
+  // Stops the syncer and waits for the index being persisted, both of which
+  // sync files. Called by derived destructors whose Sync() uses their
+  // members.
+  void StopSyncer();
+
+  // Deletes the segments of the file before the position, once no reader
+  // uses them. Returns the number of segments deleted.
+  virtual int DropSegments(File &file, off_t pos);
+
+  // Shared by readers of data files and exclusive to drop segments
+  std::shared_timed_mutex drop_mutex_;
+
  private:
+  friend class FileCompactor<DataEntry>;
+
+  // Waits until all commits entered so far have exited.
+  void DrainCommits();
+
+  void StartSyncer();
+  void RunSyncer();
+  bool SyncDue() const;
+
+  // Finds the end of the valid records in the newest non-empty segment.
+  void SeekEnd(File &file, bool meta);
+  // Visits the pages of each metadata record in [begin, end) whose data is
+  // stored, with the position of the data and, for a delta payload, its
+  // table or, if whole and there are shared entries, the whole payload.
+  // Returns the end of the records visited.
+  template <class Visitor>
+  off_t ScanMeta(off_t begin, off_t end, bool whole, Visitor visit);
+  void LoadIndex();
+  // Inserts the versions of the runs into the index, which holds only those
+  // after the runs since the store is opened. Called before compaction.
+  void LoadRuns();
+  // Whether the data at the indexed position has not been dropped
+  bool Stored(uint64_t indexed_pos) const {
+    uint8_t index = ParseIndexedPosition(&indexed_pos);
+    return index && index < out_files_.size() &&
+        (indexed_pos & ~kEntryFlags) >= (uint64_t)out_files_[index].begin();
+  }
+
+  VersionIndex index_;
+  std::unique_ptr<AlignedBufferPool> pool_; // for direct I/O
+  std::atomic<uint64_t> last_timestamp_;
+  std::atomic_uint epoch_;
+  std::atomic_int num_committing_[2]; // per epoch parity
   std::atomic_uint seq_num_;
-  unsigned int sync_freq_;
+
+  SyncPolicy sync_policy_;
+  bool wait_durable_;
+  bool framed_;
+  std::atomic_uint num_unsynced_commits_;
+  std::atomic<uint64_t> num_unsynced_bytes_;
+  bool stop_syncer_;
+  std::thread syncer_;
+  std::mutex sync_mutex_;
+  std::condition_variable sync_cv_; // wakes up the syncer
+
+  VersionRuns runs_;
+  std::atomic_bool runs_loaded_; // or none at open
+  std::mutex load_mutex_;
+  std::mutex persist_mutex_;
+  std::atomic<uint64_t> index_run_bytes_;
+  std::future<void> persist_future_; // under the sync mutex
 };
 
 // Implementation
 
 template <typename DataEntry>
-FileStore<DataEntry>::FileStore(const char *prefix, int num_files) :
-    seq_num_(0), sync_freq_(-1) {
+FileStore<DataEntry>::FileStore(const char *prefix, int num_files,
+    off_t segment_size) : out_files_(num_files + 1),
+    last_timestamp_(0), epoch_(0), seq_num_(0), sync_policy_{ 0, 0, 0 },
+    wait_durable_(false), framed_(false), num_unsynced_commits_(0),
+    num_unsynced_bytes_(0), stop_syncer_(false), runs_loaded_(true),
+    index_run_bytes_(0) {
   assert(num_files < 0xff); // index is 8-bit
+  num_committing_[0] = num_committing_[1] = 0;
 
   std::string name(prefix);
-  mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP;
+  for (int i = 0; i <= num_files; ++i) {
+    File &f = out_files_[i];
+    int err = f.Open(name + std::to_string(i), segment_size,
+        i ? EncodeDataPadding : EncodeMetaPadding);
+    assert(!err);
+    if (segment_size) SeekEnd(f, i == 0);
+  }
+  LoadIndex();
+}
 
-  std::string meta_name = name + "0";
-  int fd = open(meta_name.c_str(), O_RDWR | O_CREAT, mode);
-  assert(fd > 0);
-  lseek(fd, 0, SEEK_END);
-  out_files_.push_back(fd);
+template <typename DataEntry>
+FileStore<DataEntry>::~FileStore() {
+  StopSyncer();
+}
 
-  for (int i = 1; i <= num_files; ++i) {
-    std::string data_name = name + std::to_string(i);
-    int fd = open(data_name.c_str(), O_RDWR | O_CREAT, mode);
-    assert(fd > 0);
-    lseek(fd, 0, SEEK_END);
-    out_files_.push_back(fd);
+template <typename DataEntry>
+void FileStore<DataEntry>::set_sync_policy(const SyncPolicy &policy) {
+  {
+    std::lock_guard<std::mutex> lock(sync_mutex_);
+    sync_policy_ = policy;
   }
+  StartSyncer();
+  sync_cv_.notify_all();
 }
 
 template <typename DataEntry>
-FileStore<DataEntry>::~FileStore() {
+void FileStore<DataEntry>::set_sync_freq(unsigned int freq) {
+  SyncPolicy policy = sync_policy();
+  policy.commits = freq;
+  set_sync_policy(policy);
+}
+
+template <typename DataEntry>
+void FileStore<DataEntry>::StartSyncer() {
+  std::lock_guard<std::mutex> lock(sync_mutex_);
+  if (syncer_.joinable()) return;
+  stop_syncer_ = false;
+  syncer_ = std::thread(&FileStore<DataEntry>::RunSyncer, this);
+}
+
+template <typename DataEntry>
+void FileStore<DataEntry>::StopSyncer() {
+  std::future<void> persist;
+  {
+    std::lock_guard<std::mutex> lock(sync_mutex_);
+    persist = std::move(persist_future_);
+  }
+  if (persist.valid()) persist.wait();
+  {
+    std::lock_guard<std::mutex> lock(sync_mutex_);
+    if (!syncer_.joinable()) return;
+    stop_syncer_ = true;
+  }
+  sync_cv_.notify_all();
+  syncer_.join();
+}
+
+template <typename DataEntry>
+inline bool FileStore<DataEntry>::SyncDue() const {
+  return (sync_policy_.commits &&
+      num_unsynced_commits_ >= sync_policy_.commits) ||
+      (sync_policy_.bytes && num_unsynced_bytes_ >= sync_policy_.bytes);
+}
+
+template <typename DataEntry>
+void FileStore<DataEntry>::RunSyncer() {
+  using namespace std::chrono;
+  std::unique_lock<std::mutex> lock(sync_mutex_);
+  steady_clock::time_point last = steady_clock::now();
+  while (!stop_syncer_) {
+    auto ready = [this]() { return stop_syncer_ || SyncDue(); };
+    if (sync_policy_.micros) {
+      sync_cv_.wait_until(lock, last + microseconds(sync_policy_.micros),
+          ready);
+    } else {
+      sync_cv_.wait(lock, ready);
+    }
+    if (stop_syncer_) break;
+    num_unsynced_commits_ = 0;
+    num_unsynced_bytes_ = 0;
+    lock.unlock();
+    int err = Sync();
+    lock.lock();
+    if (err) perror("[ERROR] FileStore::RunSyncer");
+    last = steady_clock::now();
+  }
+}
+
+// Files with unsynced data are flushed by concurrent threads.
+template <typename DataEntry>
+int FileStore<DataEntry>::Sync() {
+  std::vector<std::future<int>> syncs;
+  for (File &f : out_files_) {
+    if (f.durable_offset() >= f.written_offset()) continue;
+    syncs.push_back(std::async(std::launch::async,
+        [&f]() { return f.Sync(); }));
+  }
+  int err = 0;
+  for (std::future<int> &s : syncs) {
+    if (s.get()) err = EIO;
+  }
+  return err;
+}
+
+template <typename DataEntry>
+int FileStore<DataEntry>::WriteRuns(uint8_t index,
+    const std::vector<Record> &records, off_t pos[]) {
+  File &f = out_files_[index];
+  const size_t limit = f.segment_size() ? f.segment_size() : SIZE_MAX;
+  std::vector<iovec> iov;
+  size_t begin = 0;
+  while (begin < records.size()) {
+    size_t end = begin;
+    size_t len = 0;
+    iov.clear();
+    while (end < records.size() && (end == begin ||
+        len + records[end].len <= limit)) {
+      const Record &r = records[end++];
+      iov.insert(iov.end(), r.iov, r.iov + r.iovcnt);
+      len += r.len;
+    }
+    off_t p = f.Reserve(len);
+    if (p < 0) return -1;
+    off_t q = p;
+    for (size_t r = begin; r < end; ++r) {
+      pos[r] = q;
+      if (records[r].frame) records[r].frame->Seal(q);
+      q += records[r].len;
+    }
+    if (f.WriteV(iov.data(), iov.size(), p) != (ssize_t)len) return -1;
+    begin = end;
+  }
+  return 0;
+}
+
+template <typename DataEntry>
+FrameBuilder &FileStore<DataEntry>::NextFrame(
+    std::vector<FrameBuilder> *frames, FrameType type, uint8_t index,
+    size_t len) {
+  off_t segment = out_files_[index].segment_size();
+  size_t limit = segment ? std::min<size_t>(segment, FrameLength(
+      kMaxFrameLength)) : FrameLength(kMaxFrameLength);
+  assert(FrameLength(len) <= limit);
+  if (frames->empty() || frames->back().length() + len > limit) {
+    frames->emplace_back(type);
+  }
+  return frames->back();
+}
+
+template <typename DataEntry>
+int FileStore<DataEntry>::EnableDirectIO(size_t block_size) {
+  if (!pool_) pool_.reset(new AlignedBufferPool(std::max<size_t>(block_size,
+      4096)));
   for (File &f : out_files_) {
-    f.lock();
-    close(f.descriptor());
+    if (f.SetDirect(block_size, pool_.get())) {
+      perror("[ERROR] FileStore::EnableDirectIO");
+      return EIO;
+    }
+  }
+  return 0;
+}
+
+// The scratch file is deleted afterwards.
+template <typename DataEntry>
+int64_t FileStore<DataEntry>::TimeScratchWrites(size_t len, int count) {
+  using namespace std::chrono;
+  const std::string name = out_files_[0].name() + ".tune";
+  std::vector<int64_t> samples;
+  {
+    File scratch;
+    if (scratch.Open(name) || (direct_block_size() &&
+        scratch.SetDirect(direct_block_size(), pool_.get()))) {
+      perror("[ERROR] FileStore::TimeScratchWrites open");
+      unlink(name.c_str());
+      return -1;
+    }
+    std::vector<char> record(len, 0);
+    for (int i = 0; i < count; ++i) {
+      steady_clock::time_point t1 = steady_clock::now();
+      off_t pos = scratch.Reserve(len);
+      if (scratch.Write(record.data(), len, pos) != (ssize_t)len ||
+          (wait_durable_ && scratch.Sync())) {
+        perror("[ERROR] FileStore::TimeScratchWrites write");
+        break;
+      }
+      steady_clock::time_point t2 = steady_clock::now();
+      samples.push_back(duration_cast<nanoseconds>(t2 - t1).count());
+    }
   }
+  unlink(name.c_str());
+  if (samples.empty()) return -1;
+  std::nth_element(samples.begin(), samples.begin() + samples.size() / 2,
+      samples.end());
+  return samples[samples.size() / 2];
 }
 
+// Padding of gaps is counted by the files.
 template <typename DataEntry>
-void **FileStore<DataEntry>::CheckoutPages(uint64_t timestamp, uint64_t addr[], int n) {
-  return nullptr; //TODO
+WriteStats FileStore<DataEntry>::write_stats() const {
+  WriteStats stats = write_counters_.stats();
+  for (const File &f : out_files_) {
+    WriteStats s = f.write_stats();
+    stats.padding_bytes += s.padding_bytes;
+    stats.write_calls += s.write_calls;
+    stats.device_bytes += s.device_bytes;
+  }
+  return stats;
+}
+
+template <typename DataEntry>
+char *FileStore<DataEntry>::StageRawData(uint8_t index, const void *data,
+    uint32_t size, off_t *pos, size_t *len) {
+  const size_t block = direct_block_size();
+  size_t record = sizeof(DataHeader) + size;
+  size_t total = StagedLength(size);
+  char *buf = pool_->Allocate(total);
+  assert(buf);
+  EncodeDataHeader(buf, kRawData, 0, size);
+  memcpy(buf + sizeof(DataHeader), data, size);
+  if (total > record) {
+    size_t count = EncodeDataPadding(buf + record, total - record);
+    memset(buf + record + count, 0, total - record - count);
+  }
+  *pos = out_files_[index].Reserve(total, block);
+  *len = total;
+  write_counters_.AddRecord(size, sizeof(DataHeader), total - record);
+  return buf;
+}
+
+// The padding at the end takes at least a header.
+template <typename DataEntry>
+size_t FileStore<DataEntry>::StagedLength(uint32_t size) const {
+  const size_t block = direct_block_size();
+  size_t record = sizeof(DataHeader) + size;
+  size_t total = (record + block - 1) / block * block;
+  if (total > record && total - record < sizeof(DataHeader)) total += block;
+  return total;
+}
+
+template <typename DataEntry>
+bool FileStore<DataEntry>::Fits(uint8_t index, size_t len,
+    bool framed) const {
+  off_t segment = out_files_[index].segment_size();
+  size_t limit = segment ? segment : SIZE_MAX;
+  if (framed) {
+    limit = std::min<size_t>(limit, FrameLength(kMaxFrameLength));
+    len = FrameLength(len);
+  }
+  return len <= limit;
+}
+
+template <typename DataEntry>
+int FileStore<DataEntry>::Committed(uint8_t index, off_t data_end,
+    off_t meta_end, size_t nbytes, unsigned int count) {
+  const SyncPolicy &policy = sync_policy_;
+  unsigned int commits = (num_unsynced_commits_ += count);
+  uint64_t bytes = (num_unsynced_bytes_ += nbytes);
+  if ((policy.commits && commits >= policy.commits &&
+      commits - count < policy.commits) || (policy.bytes &&
+      bytes >= policy.bytes && bytes - nbytes < policy.bytes)) {
+    std::lock_guard<std::mutex> lock(sync_mutex_);
+    sync_cv_.notify_one();
+  }
+  const uint64_t run_bytes = index_run_bytes_;
+  if (run_bytes && meta_end &&
+      (uint64_t)meta_end >= runs_.end() + run_bytes) {
+    // One persister at a time, replaced only once finished
+    std::lock_guard<std::mutex> lock(sync_mutex_);
+    if (!persist_future_.valid() ||
+        persist_future_.wait_for(std::chrono::seconds(0)) ==
+            std::future_status::ready) {
+      persist_future_ = std::async(std::launch::async,
+          [this]() { PersistIndex(); });
+    }
+  }
+  if (!wait_durable_) return 0;
+  int err = 0;
+  if (data_end) err = WaitDurable(index, data_end);
+  if (meta_end && !err) err = WaitDurable(0, meta_end);
+  return err;
+}
+
+template <typename DataEntry>
+int FileStore<DataEntry>::WaitDurable(uint8_t index, off_t offset) {
+  if (out_files_[index].SyncTo(offset)) {
+    perror("[ERROR] FileStore::WaitDurable");
+    return EIO;
+  }
+  return 0;
+}
+
+template <typename DataEntry>
+int FileStore<DataEntry>::DropSegments(File &file, off_t pos) {
+  std::lock_guard<std::shared_timed_mutex> lock(drop_mutex_);
+  return file.DropSegments(pos);
+}
+
+template <typename DataEntry>
+void FileStore<DataEntry>::SeekEnd(File &file, bool meta) {
+  off_t end = file.begin();
+  for (off_t begin = file.last_segment_begin(); begin >= file.begin();
+      begin -= file.segment_size()) {
+    LogScanner scanner(file, begin);
+    DataHeader header;
+    if (meta) {
+      while (scanner.NextMeta() >= 0);
+    } else {
+      while (scanner.NextData(&header));
+    }
+    if (scanner.end() > begin) { // a pre-created segment is empty
+      end = scanner.end();
+      break;
+    }
+  }
+  file.set_offset(end);
+}
+
+template <typename DataEntry>
+inline void FileStore<DataEntry>::IndexMeta(uint64_t timestamp,
+    const uint64_t meta[], uint32_t n, uint8_t index, uint64_t pos) {
+  index_.Insert(meta, n, timestamp, index, pos, sizeof(DataEntry));
+  uint64_t last = last_timestamp_;
+  while (last < timestamp &&
+      !last_timestamp_.compare_exchange_weak(last, timestamp));
+}
+
+template <typename DataEntry>
+inline unsigned int FileStore<DataEntry>::EnterCommit() {
+  while (true) {
+    unsigned int epoch = epoch_ & 1;
+    ++num_committing_[epoch];
+    if ((epoch_ & 1) == epoch) return epoch;
+    --num_committing_[epoch]; // raced with DrainCommits()
+  }
+}
+
+template <typename DataEntry>
+inline void FileStore<DataEntry>::ExitCommit(unsigned int epoch) {
+  --num_committing_[epoch];
+}
+
+// Only one thread drains at a time.
+template <typename DataEntry>
+void FileStore<DataEntry>::DrainCommits() {
+  unsigned int epoch = epoch_++ & 1;
+  while (num_committing_[epoch]) {
+    std::this_thread::yield();
+  }
+}
+
+template <typename DataEntry>
+void FileStore<DataEntry>::IndexDelta(uint64_t timestamp,
+    const uint64_t meta[], uint32_t n, uint8_t index, uint64_t pos,
+    const char *payload) {
+  for (uint32_t i = 0; i < n; ++i) {
+    uint64_t entry = DeltaEntryPosition(payload, i, pos);
+    if (entry & kSharedPosition) {
+      uint64_t target_addr, target_timestamp;
+      const char *ref = payload + (entry & ~kEntryFlags) - pos;
+      Deserialize(Deserialize(ref, &target_addr), &target_timestamp);
+      index_.InsertShared(meta[i], timestamp,
+          ToIndexedPosition(entry, index), target_addr, target_timestamp);
+      continue;
+    }
+    index_.Insert(meta[i], timestamp, ToIndexedPosition(entry, index));
+  }
+  uint64_t last = last_timestamp_;
+  while (last < timestamp &&
+      !last_timestamp_.compare_exchange_weak(last, timestamp));
+}
+
+template <typename DataEntry>
+int FileStore<DataEntry>::CommitDelta(uint64_t timestamp,
+    const char *payload, uint32_t len, const uint64_t meta[], uint32_t n) {
+  // Data files share the segment size, and the metadata is not framed.
+  if (!Fits(1, sizeof(DataHeader) + len) || !Fits(0, MetaLength(n))) {
+    return EINVAL;
+  }
+  unsigned int epoch = EnterCommit();
+  uint8_t index = OutIndex(seq_num());
+  char header[sizeof(DataHeader)];
+  EncodeDataHeader(header, kRawData, 0, len);
+  std::vector<Record> records = { { { { header, sizeof(header) },
+      { (char *)payload, len } }, 2, sizeof(header) + len } };
+  off_t data_pos;
+  int err = WriteRuns(index, records, &data_pos) ? EIO : 0;
+  uint64_t pos = data_pos + sizeof(header); // of the payload
+
+  File &mf = out_files_[0];
+  std::vector<char> meta_buf(MetaLength(n));
+  size_t meta_len = EncodeMeta(meta_buf.data(), timestamp, meta, n, index,
+      pos, kMetaDelta) - meta_buf.data();
+  off_t meta_pos = 0;
+  if (!err) {
+    meta_pos = mf.Reserve(meta_len);
+    if (mf.Write(meta_buf.data(), meta_len, meta_pos) != (ssize_t)meta_len) {
+      err = EIO;
+    }
+  }
+  if (!err) IndexDelta(timestamp, meta, n, index, pos, payload);
+  ExitCommit(epoch);
+  if (err) {
+    perror("[ERROR] FileStore::CommitDelta");
+    return err;
+  }
+  write_counters_.AddRecord(len, sizeof(header));
+  write_counters_.AddMeta(meta_len);
+  return Committed(index, pos + len, meta_pos + meta_len,
+      sizeof(header) + len + meta_len);
+}
+
+// Data inlined with CRC32 carries no page addresses and is not visited.
+template <typename DataEntry>
+template <class Visitor>
+off_t FileStore<DataEntry>::ScanMeta(off_t begin, off_t end, bool whole,
+    Visitor visit) {
+  LogScanner scanner(out_files_[0], begin);
+  std::vector<char> payload;
+  int64_t n;
+  while ((n = scanner.NextMeta()) >= 0) {
+    if (scanner.pos() >= end) return end;
+    uint64_t timestamp, data_pos;
+    uint32_t num;
+    DecodeMetaHeader(scanner.record(), &timestamp, &data_pos, &num);
+    const uint64_t *meta = scanner.words();
+    uint8_t index = ParseIndexedPosition(&data_pos);
+    if (!index || index >= out_files_.size()) { // corrupted
+      return scanner.pos();
+    }
+    File &f = out_files_[index];
+    // Skips versions whose data never reached the file or has been dropped.
+    if (data_pos < (uint64_t)f.begin()) continue;
+    if (MetaFlags(scanner.record()) & kMetaDelta) {
+      payload.resize(DeltaTableLength(n));
+      uint32_t len;
+      if (f.Read(payload.data(), payload.size(), data_pos) !=
+          (ssize_t)payload.size()) continue;
+      Deserialize(payload.data() + sizeof(uint32_t) * n, &len);
+      // The length is not checksummed, so it is bounded before any read.
+      if (len < payload.size() ||
+          len > MaxDeltaPayloadLength(n, sizeof(DataEntry)) ||
+          data_pos + len > (uint64_t)f.offset()) continue;
+      bool shared = false;
+      for (int64_t i = 0; i < n && whole && !shared; ++i) {
+        uint32_t offset;
+        Deserialize(payload.data() + sizeof(uint32_t) * i, &offset);
+        shared = offset & kDeltaShared;
+      }
+      if (shared) {
+        payload.resize(len);
+        if (f.Read(payload.data(), len, data_pos) != (ssize_t)len) continue;
+      }
+      visit(timestamp, meta, n, index, data_pos, payload.data());
+      continue;
+    }
+    if (data_pos + sizeof(DataEntry) * n > (uint64_t)f.offset()) continue;
+    visit(timestamp, meta, n, index, data_pos, (const char *)nullptr);
+  }
+  return std::min(scanner.end(), end);
+}
+
+// Rebuilds the version index from the metadata file in one sequential pass
+// over the records after the runs of the on-disk index, if any, whose
+// versions are looked up in place until loaded. The positions of delta
+// pages are read from the tables of their payloads, and whole payloads are
+// read for the targets of shared entries.
+template <typename DataEntry>
+void FileStore<DataEntry>::LoadIndex() {
+  File &mf = out_files_[0];
+  runs_.Open(mf.name(), mf.begin(), mf.offset());
+  runs_.RemoveUnused();
+  runs_loaded_ = runs_.empty();
+  last_timestamp_ = runs_.max_timestamp();
+  ScanMeta(std::max(runs_.end(), mf.begin()), mf.offset(), true,
+      [this](uint64_t timestamp, const uint64_t meta[], uint32_t n,
+          uint8_t index, uint64_t pos, const char *payload) {
+    if (payload) {
+      IndexDelta(timestamp, meta, n, index, pos, payload);
+    } else {
+      IndexMeta(timestamp, meta, n, index, pos);
+    }
+  });
+}
+
+// Shared versions are inserted with the targets read from their entries.
+template <typename DataEntry>
+void FileStore<DataEntry>::LoadRuns() {
+  std::lock_guard<std::mutex> lock(load_mutex_);
+  if (runs_loaded_) return;
+  auto stored = [this](uint64_t indexed_pos) { return Stored(indexed_pos); };
+  std::vector<VersionIndex::Entry> entries, shared;
+  runs_.Collect(stored, &entries);
+  index_.InsertOlder(entries, &shared);
+  std::shared_lock<std::shared_timed_mutex> drop_lock(drop_mutex_);
+  for (const VersionIndex::Entry &e : shared) {
+    uint64_t pos = e.indexed_pos;
+    uint8_t index = ParseIndexedPosition(&pos);
+    char ref[kSharedEntryLength];
+    uint64_t target_addr, target_timestamp;
+    if (out_files_[index].Read(ref, sizeof(ref), pos & ~kEntryFlags) !=
+        (ssize_t)sizeof(ref)) {
+      perror("[ERROR] FileStore::LoadRuns Read");
+      continue;
+    }
+    Deserialize(Deserialize(ref, &target_addr), &target_timestamp);
+    index_.InsertShared(e.addr, e.timestamp, e.indexed_pos,
+        target_addr, target_timestamp);
+  }
+  runs_loaded_ = true;
+}
+
+// The records before the end taken ahead of the sync are durable with their
+// data, so that a run never covers versions lost by a crash.
+template <typename DataEntry>
+int FileStore<DataEntry>::PersistIndex() {
+  std::lock_guard<std::mutex> lock(persist_mutex_);
+  File &mf = out_files_[0];
+  off_t end = mf.written_offset();
+  if (Sync()) {
+    perror("[ERROR] FileStore::PersistIndex Sync");
+    return EIO;
+  }
+  std::vector<VersionIndex::Entry> entries;
+  uint64_t max_timestamp = 0;
+  off_t begin;
+  {
+    std::shared_lock<std::shared_timed_mutex> drop_lock(drop_mutex_);
+    runs_.DropBefore(mf.begin()); // compacted
+    begin = std::max(runs_.end(), mf.begin());
+    if (begin >= end) return 0;
+    end = ScanMeta(begin, end, false,
+        [&entries, &max_timestamp](uint64_t timestamp,
+            const uint64_t meta[], uint32_t n, uint8_t index, uint64_t pos,
+            const char *table) {
+      for (uint32_t i = 0; i < n; ++i) {
+        uint64_t entry = table ? DeltaEntryPosition(table, i, pos) :
+            pos + sizeof(DataEntry) * i;
+        entries.push_back({ meta[i], timestamp,
+            ToIndexedPosition(entry, index) });
+      }
+      max_timestamp = std::max(max_timestamp, timestamp);
+    });
+  }
+  if (runs_.Append(&entries, begin, end, max_timestamp,
+      [this](uint64_t indexed_pos) { return Stored(indexed_pos); })) {
+    perror("[ERROR] FileStore::PersistIndex Append");
+    return EIO;
+  }
+  return 0;
+}
+
+// Until the runs are loaded, a version in them is found unless the index
+// has one at the same or a later timestamp.
+template <typename DataEntry>
+bool FileStore<DataEntry>::FindPage(uint64_t addr, uint64_t timestamp,
+    uint8_t *index, uint64_t *pos, uint64_t *version) {
+  const bool loaded = runs_loaded_; // before the index is searched
+  uint64_t found;
+  bool in_index = index_.Find(addr, timestamp, pos, &found);
+  if (!loaded) {
+    uint64_t run_pos, run_version;
+    if (runs_.Find(addr, timestamp,
+        [this](uint64_t indexed_pos) { return Stored(indexed_pos); },
+        &run_pos, &run_version) && (!in_index || run_version > found)) {
+      *pos = run_pos;
+      found = run_version;
+      in_index = true;
+    }
+  }
+  if (!in_index) return false;
+  if (version) *version = found;
+  *index = ParseIndexedPosition(pos);
+  return true;
+}
+
+// A version only in the runs is referenced as one in the same commit,
+// which keeps it until released. Nothing is pruned before the runs are
+// loaded anyway.
+template <typename DataEntry>
+bool FileStore<DataEntry>::ReferencePage(uint64_t addr, uint64_t timestamp,
+    bool indexed) {
+  if (!indexed || runs_loaded_) {
+    return index_.Reference(addr, timestamp, indexed);
+  }
+  if (index_.Reference(addr, timestamp)) return true;
+  uint8_t index;
+  uint64_t pos, version;
+  return FindPage(addr, timestamp, &index, &pos, &version) &&
+      version == timestamp && index_.Reference(addr, timestamp, false);
+}
+
+// Follows a reference to the version shared, and the base timestamps back
+// to a whole or compressed page, and applies the deltas on the way in
+// reverse.
+template <typename DataEntry>
+bool FileStore<DataEntry>::RebuildPage(uint64_t addr, uint8_t index,
+    uint64_t pos, char *page) {
+  const size_t max_len = sizeof(uint64_t) *
+      (1 + MaskWords(sizeof(DataEntry))) + sizeof(DataEntry);
+  while (pos & kSharedPosition) {
+    pos &= ~kSharedPosition;
+    char ref[kSharedEntryLength];
+    ssize_t count = out_files_[index].Read(ref, sizeof(ref), pos);
+    if (count != (ssize_t)sizeof(ref)) return false;
+    uint64_t timestamp, version;
+    Deserialize(Deserialize(ref, &addr), &timestamp);
+    if (!FindPage(addr, timestamp, &index, &pos, &version) ||
+        version != timestamp) {
+      return false;
+    }
+  }
+  std::vector<std::vector<char>> deltas;
+  while (pos & kBasedPosition) {
+    pos &= ~kBasedPosition;
+    deltas.emplace_back(max_len);
+    std::vector<char> &delta = deltas.back();
+    ssize_t count = out_files_[index].Read(delta.data(), max_len, pos);
+    if (count < (ssize_t)sizeof(uint64_t)) return false;
+    delta.resize(count);
+    uint64_t base = PageDeltaBase(delta.data()), version;
+    if (!FindPage(addr, base, &index, &pos, &version) || version != base) {
+      return false;
+    }
+  }
+  if (pos & kCompressedPosition) {
+    pos &= ~kCompressedPosition;
+    std::vector<char> entry(sizeof(uint32_t) + compressBound(
+        sizeof(DataEntry)));
+    ssize_t count = out_files_[index].Read(entry.data(), entry.size(), pos);
+    if (count <= 0 || !InflatePage(entry.data(), count, page,
+        sizeof(DataEntry))) return false;
+  } else if (out_files_[index].Read(page, sizeof(DataEntry), pos) !=
+      (ssize_t)sizeof(DataEntry)) {
+    return false;
+  }
+  for (auto d = deltas.rbegin(); d != deltas.rend(); ++d) {
+    if (!ApplyPageDelta(page, sizeof(DataEntry), d->data(),
+        d->data() + d->size())) return false;
+  }
+  return true;
+}
+
+// Returns an array of pages, each of which is nullptr if no version of the
+// address exists at or before the timestamp. Pages adjacent in the same
+// data file are read together with one vectored read.
+template <typename DataEntry>
+void **FileStore<DataEntry>::CheckoutPages(uint64_t timestamp,
+    uint64_t addr[], int n) {
+  struct PageRead {
+    uint8_t index;
+    uint64_t pos;
+    int i;
+    bool operator<(const PageRead &other) const {
+      return index < other.index ||
+          (index == other.index && pos < other.pos);
+    }
+  };
+
+  void **pages = (void **)malloc(sizeof(void *) * n);
+  std::vector<PageRead> reads;
+  std::shared_lock<std::shared_timed_mutex> lock(drop_mutex_);
+  for (int i = 0; i < n; ++i) {
+    uint8_t index;
+    uint64_t pos;
+    if (FindPage(addr[i], timestamp, &index, &pos)) {
+      pages[i] = malloc(sizeof(DataEntry));
+      if (!(pos & kEntryFlags)) {
+        reads.push_back({ index, pos, i });
+      } else if (!RebuildPage(addr[i], index, pos, (char *)pages[i])) {
+        perror("[ERROR] FileStore::CheckoutPages RebuildPage");
+        free(pages[i]);
+        pages[i] = nullptr;
+      }
+    } else {
+      pages[i] = nullptr;
+    }
+  }
+  std::sort(reads.begin(), reads.end());
+
+  iovec iov[IOV_MAX];
+  size_t begin = 0;
+  while (begin < reads.size()) {
+    size_t end = begin + 1;
+    iov[0] = { pages[reads[begin].i], sizeof(DataEntry) };
+    while (end < reads.size() && end - begin < IOV_MAX &&
+        reads[end].index == reads[begin].index &&
+        reads[end].pos == reads[end - 1].pos + sizeof(DataEntry)) {
+      iov[end - begin] = { pages[reads[end].i], sizeof(DataEntry) };
+      ++end;
+    }
+    File &f = out_files_[reads[begin].index];
+    ssize_t count = f.ReadV(iov, end - begin, reads[begin].pos);
+    if (count != (ssize_t)(sizeof(DataEntry) * (end - begin))) {
+      perror("[ERROR] FileStore::CheckoutPages ReadV");
+      for (size_t r = begin; r < end; ++r) {
+        free(pages[reads[r].i]);
+        pages[reads[r].i] = nullptr;
+      }
+    }
+    begin = end;
+  }
+  return pages;
 }
 
 template <typename DataEntry>
@@ -115,6 +987,7 @@ void FileStore<DataEntry>::DestroyPages(void *pages[], int n) {
   for (int i = 0; i < n; ++i) {
     free(pages[i]);
   }
+  free(pages);
 }
 
 } // namespace plib
@@ -9,10 +9,15 @@
 #ifndef VM_PERSISTENCE_PLIB_FORMAT_H_
 #define VM_PERSISTENCE_PLIB_FORMAT_H_
 
+#include <cassert>
 #include <cstdint>
 #include <cstring>
+#include <vector>
 #include <zlib.h>
 
+#include "checksum.h"
+#include "delta_codec.h"
+
 namespace plib {
 
 // Utils
@@ -28,6 +33,12 @@ inline char *Serialize(char *mem, const T &obj) {
   return mem + sizeof(T);
 }
 
+template <typename T>
+inline const char *Deserialize(const char *mem, T *obj) {
+  *obj = *(const T *)mem;
+  return mem + sizeof(T);
+}
+
 inline uint64_t ToIndexedPosition(uint64_t pos, uint8_t index) {
   return (pos << 8) + index;
 }
@@ -39,38 +50,432 @@ inline uint8_t ParseIndexedPosition(uint64_t *pos) {
 }
 
 // Data format
+//
+// Every record in a data file starts with a header, so that a data file can
+// be scanned without its metadata. A CRC32 record is followed by its payload
+// and a checksum over both, which is CRC32C for the CRC32C type and zlib
+// CRC32 for logs written before it. A raw record is followed by its payload
+// only, and is described by a metadata record pointing to the payload.
+// A padding record covers the unused tail of a segment. A frame (see below)
+// starts with a header of the frame type.
+
+enum DataType : uint32_t {
+  kCRC32Data = 1,
+  kRawData = 2,
+  kPaddingData = 3,
+  kCRC32CData = 4,
+  kFrameData = 5,
+  kFramedData = 6, // inline data in a frame, checksummed by the frame
+};
+
+struct DataHeader {
+  uint32_t magic; // kDataMagic plus type
+  uint32_t length; // of the payload
+  uint64_t timestamp; // zero for raw data, whose timestamp is in metadata
+};
+
+static const uint32_t kDataMagic = 0x706c6200; // "plb"
+
+inline char *EncodeDataHeader(char *mem,
+    DataType type, uint64_t timestamp, uint32_t nbytes) {
+  DataHeader header = { kDataMagic | type, nbytes, timestamp };
+  return Serialize(mem, header);
+}
+
+// Returns the data type, or zero if the header is not valid.
+inline uint32_t DecodeDataHeader(const char *mem, DataHeader *header) {
+  Deserialize(mem, header);
+  if ((header->magic & ~0xffu) != kDataMagic) return 0;
+  uint32_t type = header->magic & 0xff;
+  return (type >= kCRC32Data && type <= kFramedData) ? type : 0;
+}
+
+// Whether the type is of a checksummed record with inline payload.
+inline bool IsCRC32Data(uint32_t type) {
+  return type == kCRC32Data || type == kCRC32CData || type == kFramedData;
+}
+
+// Serves as a File::Filler for data files.
+inline size_t EncodeDataPadding(char *mem, size_t len) {
+  if (len < sizeof(DataHeader)) return 0;
+  EncodeDataHeader(mem, kPaddingData, 0, len - sizeof(DataHeader));
+  return sizeof(DataHeader);
+}
 
 inline size_t CRC32DataLength(size_t nbytes) {
-  return sizeof(uint64_t) + nbytes + sizeof(uint32_t); // plus version and CRC32
+  return sizeof(DataHeader) + nbytes + sizeof(uint32_t); // plus CRC32
 }
 
-inline char *CRC32DataEncode(char *mem,
-    uint64_t timestamp, void *data, size_t nbytes) {
-  mem = Serialize(mem, timestamp);
-  mem = Serialize(mem, data, nbytes);
-  uint32_t checksum = crc32(0, (unsigned char *)mem, nbytes);
-  return Serialize(mem, checksum);
+// The payload is copied and checksummed in one pass. Streaming stores
+// keep it out of the cache.
+inline char *CRC32DataEncode(char *mem, uint64_t timestamp,
+    const void *data, size_t nbytes, bool streaming = false) {
+  mem = EncodeDataHeader(mem, kCRC32CData, timestamp, nbytes);
+  uint32_t checksum = CRC32C(0, mem - sizeof(DataHeader), sizeof(DataHeader));
+  checksum = CRC32CCopy(checksum, mem, data, nbytes, streaming);
+  return Serialize(mem + nbytes, checksum);
+}
+
+// Verifies a CRC32 record whose header has been decoded.
+inline bool CRC32DataVerify(const char *mem, const DataHeader &header) {
+  size_t len = sizeof(DataHeader) + header.length;
+  uint32_t checksum;
+  Deserialize(mem + len, &checksum);
+  if ((header.magic & 0xff) == kCRC32Data) {
+    return crc32(0, (const unsigned char *)mem, len) == checksum;
+  }
+  return CRC32C(0, mem, len) == checksum;
 }
 
 // Meta format
+//
+// The top bit of the number of words marks a CRC32C checksum.
+// Records without it, written before, carry zlib CRC32.
+// The second bit marks words packed by DeltaEncode(), preceded by the
+// length of the packing. Words are packed when that is shorter.
+// The third bit marks a record of delta pages (see below).
 
+static const uint32_t kMetaCRC32C = 0x80000000u;
+static const uint32_t kMetaPacked = 0x40000000u;
+static const uint32_t kMetaDelta = 0x20000000u;
+static const uint32_t kMetaFlags = kMetaCRC32C | kMetaPacked | kMetaDelta;
+// Bounds the number of words of a record read back, whose header may be
+// torn.
+static const uint32_t kMaxMetaWords = 1 << 24;
+
+// The length of a metadata record of n plain words, which bounds that
+// of a packed one.
 inline size_t MetaLength(uint32_t n) {
   size_t len = 2 * sizeof(uint64_t) + sizeof(uint32_t); // header
   len += sizeof(uint64_t) * n;
-  return len;
+  return len + sizeof(uint32_t); // plus CRC32
 }
 
-inline char *EncodeMeta(char *mem, uint64_t timestamp,
-    uint64_t meta[], uint32_t n, uint8_t index, uint64_t pos) {
+// Returns the length of the packed words and sets the shift, or returns
+// zero if they are to be written plain.
+inline size_t PackMetaWords(const uint64_t meta[], uint32_t n, int *shift) {
+  size_t packed = DeltaLength(meta, n, shift);
+  return packed && sizeof(uint32_t) + packed < sizeof(uint64_t) * n ?
+      packed : 0;
+}
+
+// The length of the metadata record the words are encoded into.
+inline size_t EncodedMetaLength(const uint64_t meta[], uint32_t n) {
+  int shift;
+  size_t packed = PackMetaWords(meta, n, &shift);
+  return packed ? MetaLength(0) + sizeof(uint32_t) + packed : MetaLength(n);
+}
+
+// Encodes a metadata record without its checksum.
+inline char *EncodeMetaBody(char *mem, uint64_t timestamp,
+    const uint64_t meta[], uint32_t n, uint8_t index, uint64_t pos,
+    uint32_t flags) {
   mem = Serialize(mem, timestamp);
   mem = Serialize(mem, ToIndexedPosition(pos, index));
-  mem = Serialize(mem, n);
+  int shift;
+  uint32_t packed = PackMetaWords(meta, n, &shift);
+  if (packed) {
+    mem = Serialize(mem, n | flags | kMetaPacked);
+    mem = Serialize(mem, packed);
+    return DeltaEncode(mem, meta, n, shift);
+  }
+  mem = Serialize(mem, n | flags);
   for (uint32_t i = 0; i < n; ++i) {
     mem = Serialize(mem, meta[i]);
   }
   return mem;
 }
 
+// The position is that of the payload of the raw data record.
+inline char *EncodeMeta(char *mem, uint64_t timestamp,
+    const uint64_t meta[], uint32_t n, uint8_t index, uint64_t pos,
+    uint32_t flags = 0) {
+  char *end = EncodeMetaBody(mem, timestamp, meta, n, index, pos,
+      flags | kMetaCRC32C);
+  uint32_t checksum = CRC32C(0, mem, end - mem);
+  return Serialize(end, checksum);
+}
+
+// Returns the beginning of the metadata words, or of the length of their
+// packing. Use DecodeMetaWords() for the words.
+inline const char *DecodeMetaHeader(const char *mem, uint64_t *timestamp,
+    uint64_t *indexed_pos, uint32_t *n) {
+  mem = Deserialize(mem, timestamp);
+  mem = Deserialize(mem, indexed_pos);
+  mem = Deserialize(mem, n);
+  *n &= ~kMetaFlags;
+  return mem;
+}
+
+inline uint32_t MetaFlags(const char *mem) {
+  uint32_t flagged;
+  Deserialize(mem + 2 * sizeof(uint64_t), &flagged);
+  return flagged & kMetaFlags;
+}
+
+// The length of a metadata record without its checksum, from its header
+// and, if packed, the following length.
+inline size_t MetaBodyLength(const char *mem) {
+  uint32_t flagged, packed;
+  mem = Deserialize(mem + 2 * sizeof(uint64_t), &flagged);
+  if (!(flagged & kMetaPacked)) {
+    return MetaLength(flagged & ~kMetaFlags) - sizeof(uint32_t);
+  }
+  Deserialize(mem, &packed);
+  return MetaLength(0) + packed;
+}
+
+inline size_t MetaRecordLength(const char *mem) {
+  return MetaBodyLength(mem) + sizeof(uint32_t); // plus CRC32
+}
+
+// Returns the words of a verified metadata record, unpacked into the
+// buffer if they are packed.
+inline const uint64_t *DecodeMetaWords(const char *mem,
+    std::vector<uint64_t> *buffer) {
+  uint64_t timestamp, indexed_pos;
+  uint32_t n, flagged;
+  const char *words = DecodeMetaHeader(mem, &timestamp, &indexed_pos, &n);
+  Deserialize(mem + 2 * sizeof(uint64_t), &flagged);
+  if (!(flagged & kMetaPacked)) return (const uint64_t *)words;
+  uint32_t packed;
+  words = Deserialize(words, &packed);
+  buffer->resize(n);
+  DeltaDecode(words, packed, n, buffer->data());
+  return buffer->data();
+}
+
+// Serves as a File::Filler for metadata files. The padding is a record
+// of no words whose position has index zero and holds the padding length.
+inline size_t EncodeMetaPadding(char *mem, size_t len) {
+  if (len < MetaLength(0)) return 0;
+  char *end = EncodeMeta(mem, 0, nullptr, 0, 0, len);
+  return end - mem;
+}
+
+// Verifies a whole metadata record.
+inline bool VerifyMeta(const char *mem) {
+  size_t len = MetaBodyLength(mem);
+  uint32_t checksum, flagged;
+  Deserialize(mem + len, &checksum);
+  Deserialize(mem + 2 * sizeof(uint64_t), &flagged);
+  if (!(flagged & kMetaCRC32C)) {
+    return crc32(0, (const unsigned char *)mem, len) == checksum;
+  }
+  return CRC32C(0, mem, len) == checksum;
+}
+
+// Delta pages
+//
+// The raw record of a kMetaDelta metadata record holds n page entries after
+// a table of n + 1 offsets (uint32_t) in the payload, the last being the
+// length of the payload. An entry is the whole page, or, if its offset is
+// marked kDeltaBased, a delta against the version of the page at its base
+// timestamp (see page_delta.h), or, if marked kDeltaCompressed, the page
+// compressed by zlib after its compressed length (uint32_t), or, if marked
+// kDeltaShared, the address and timestamp (uint64_t) of another version of
+// the same contents. Whole pages are indexed at their positions as usual,
+// and other entries at their positions marked kBasedPosition,
+// kCompressedPosition or kSharedPosition.
+
+static const uint32_t kDeltaBased = 0x80000000u;
+static const uint32_t kDeltaCompressed = 0x40000000u;
+static const uint32_t kDeltaShared = 0x20000000u;
+static const uint32_t kDeltaFlags =
+    kDeltaBased | kDeltaCompressed | kDeltaShared;
+static const uint64_t kBasedPosition = 1ull << 54;
+static const uint64_t kCompressedPosition = 1ull << 53;
+static const uint64_t kSharedPosition = 1ull << 52;
+static const uint64_t kEntryFlags =
+    kBasedPosition | kCompressedPosition | kSharedPosition;
+
+static const size_t kSharedEntryLength = sizeof(uint64_t) * 2;
+
+inline size_t DeltaTableLength(uint32_t n) {
+  return sizeof(uint32_t) * (n + 1);
+}
+
+// Bounds the length of a delta payload of pages of the size, as read back
+// from its table. No entry is longer than twice the page, be it a delta of
+// every line or a page that zlib cannot compress.
+inline size_t MaxDeltaPayloadLength(uint32_t n, size_t page_size) {
+  return DeltaTableLength(n) + (2 * page_size + 64) * n;
+}
+
+// The position of entry i of a delta payload at the position, marked as
+// its offset in the table is.
+inline uint64_t DeltaEntryPosition(const char *table, uint32_t i,
+    uint64_t pos) {
+  uint32_t offset;
+  Deserialize(table + sizeof(uint32_t) * i, &offset);
+  uint64_t entry = pos + (offset & ~kDeltaFlags);
+  if (offset & kDeltaBased) entry |= kBasedPosition;
+  if (offset & kDeltaCompressed) entry |= kCompressedPosition;
+  if (offset & kDeltaShared) entry |= kSharedPosition;
+  return entry;
+}
+
+// Whether an indexed position is of a delta, which depends on the version
+// before it.
+inline bool IsBasedPosition(uint64_t indexed_pos) {
+  return (indexed_pos >> 8) & kBasedPosition;
+}
+
+// Whether an indexed position is of a reference to another version.
+inline bool IsSharedPosition(uint64_t indexed_pos) {
+  return (indexed_pos >> 8) & kSharedPosition;
+}
+
+// Inflates a compressed entry of the available length into the page.
+inline bool InflatePage(const char *mem, size_t len, char *page,
+    size_t size) {
+  uint32_t compressed;
+  if (len < sizeof(uint32_t)) return false;
+  mem = Deserialize(mem, &compressed);
+  if (compressed > len - sizeof(uint32_t)) return false;
+  uLongf inflated = size;
+  return uncompress((Bytef *)page, &inflated, (const Bytef *)mem,
+      compressed) == Z_OK && inflated == size;
+}
+
+// Frame format (version 2)
+//
+// A frame packs the records of a batch behind one header and is followed
+// by one CRC32C over its records and then its header, so that the header
+// can be filled in last. The LSN of a frame is its position in the log,
+// which tells a frame from stale bytes of an earlier one. A data frame
+// holds inline data records of the framed type, and a metadata frame holds
+// metadata records without their checksums. In a metadata file, a record
+// starting with the frame magic is a frame if it verifies.
+
+enum FrameType : uint16_t {
+  kDataFrame = 1,
+  kMetaFrame = 2,
+};
+
+struct FrameHeader {
+  uint32_t magic; // kDataMagic plus kFrameData
+  uint32_t length; // of the records
+  uint64_t lsn;
+  uint16_t version;
+  uint16_t type;
+  uint32_t count; // of the records
+};
+
+static const uint16_t kFrameVersion = 2;
+static const size_t kMaxFrameLength = 1 << 20;
+
+inline size_t FrameLength(size_t nbytes) {
+  return sizeof(FrameHeader) + nbytes + sizeof(uint32_t); // plus CRC32C
+}
+
+inline size_t FramedDataLength(size_t nbytes) {
+  return sizeof(DataHeader) + nbytes;
+}
+
+inline size_t FramedMetaLength(uint32_t n) {
+  return MetaLength(n) - sizeof(uint32_t);
+}
+
+// Returns the frame type, or zero if the header is not of a valid frame.
+inline uint32_t DecodeFrameHeader(const char *mem, FrameHeader *header) {
+  Deserialize(mem, header);
+  if (header->magic != (kDataMagic | kFrameData) ||
+      header->version != kFrameVersion ||
+      header->length > kMaxFrameLength) return 0;
+  return (header->type == kDataFrame || header->type == kMetaFrame) ?
+      header->type : 0;
+}
+
+// Verifies a whole frame whose header has been decoded.
+inline bool VerifyFrame(const char *mem, const FrameHeader &header) {
+  uint32_t checksum;
+  Deserialize(mem + sizeof(FrameHeader) + header.length, &checksum);
+  uint32_t crc = CRC32C(0, mem + sizeof(FrameHeader), header.length);
+  return CRC32C(crc, mem, sizeof(FrameHeader)) == checksum;
+}
+
+// Builds a frame in memory. Records are checksummed as they are added,
+// and the header when the frame is sealed at its position.
+class FrameBuilder {
+ public:
+  explicit FrameBuilder(FrameType type);
+
+  FrameType type() const { return type_; }
+  uint32_t count() const { return count_; }
+  bool empty() const { return !count_; }
+  // Of the whole frame
+  size_t length() const { return buffer_.size(); }
+  // The frame, sealed or not, valid until the next record is added.
+  const char *data() const { return buffer_.data(); }
+
+  void AddData(uint64_t timestamp, const void *data, uint32_t nbytes);
+  void AddMeta(uint64_t timestamp, const uint64_t meta[], uint32_t n,
+      uint8_t index, uint64_t pos);
+  // Fills in the header and the checksum.
+  const char *Seal(uint64_t lsn);
+  void Clear();
+
+ private:
+  // Returns the space of a new record.
+  char *Extend(size_t len);
+
+  FrameType type_;
+  uint32_t count_;
+  uint32_t checksum_; // of the records
+  std::vector<char> buffer_; // with room for the header and the checksum
+};
+
+// Implementation of FrameBuilder
+
+inline FrameBuilder::FrameBuilder(FrameType type) : type_(type) {
+  Clear();
+}
+
+inline void FrameBuilder::Clear() {
+  count_ = 0;
+  checksum_ = 0;
+  buffer_.resize(FrameLength(0));
+}
+
+inline char *FrameBuilder::Extend(size_t len) {
+  size_t offset = buffer_.size() - sizeof(uint32_t);
+  assert(offset - sizeof(FrameHeader) + len <= kMaxFrameLength);
+  buffer_.resize(buffer_.size() + len);
+  ++count_;
+  return buffer_.data() + offset;
+}
+
+inline void FrameBuilder::AddData(uint64_t timestamp, const void *data,
+    uint32_t nbytes) {
+  assert(type_ == kDataFrame);
+  char *mem = Extend(FramedDataLength(nbytes));
+  EncodeDataHeader(mem, kFramedData, timestamp, nbytes);
+  checksum_ = CRC32C(checksum_, mem, sizeof(DataHeader));
+  checksum_ = CRC32CCopy(checksum_, mem + sizeof(DataHeader), data, nbytes);
+}
+
+inline void FrameBuilder::AddMeta(uint64_t timestamp, const uint64_t meta[],
+    uint32_t n, uint8_t index, uint64_t pos) {
+  assert(type_ == kMetaFrame);
+  size_t len = FramedMetaLength(n);
+  char *mem = Extend(len);
+  char *end = EncodeMetaBody(mem, timestamp, meta, n, index, pos, 0);
+  buffer_.resize(buffer_.size() - (len - (end - mem))); // if packed
+  checksum_ = CRC32C(checksum_, mem, end - mem);
+}
+
+inline const char *FrameBuilder::Seal(uint64_t lsn) {
+  uint32_t length = buffer_.size() - FrameLength(0);
+  FrameHeader header = { kDataMagic | kFrameData, length, lsn,
+      kFrameVersion, type_, count_ };
+  char *mem = buffer_.data();
+  Serialize(mem, header);
+  uint32_t checksum = CRC32C(checksum_, mem, sizeof(FrameHeader));
+  Serialize(mem + sizeof(FrameHeader) + length, checksum);
+  return mem;
+}
+
 // SSD data striping
 
 class FlashStriper {
@@ -16,6 +16,7 @@
 #include "format.h"
 #include "buffer_array.h"
 #include "writer.h"
+#include "write_stats.h"
 
 namespace plib {
 
@@ -26,14 +27,24 @@ class GroupCommitter {
   GroupCommitter(int num_lanes, int buffer_size, Writer &writer);
 
   void Commit(uint64_t timestamp, void *data, uint32_t size, int flag = 0);
+  // Commits the records as one data frame, whose LSN is its log address.
+  void CommitFrame(const uint64_t timestamps[], void *const data[],
+      const uint32_t sizes[], int n, int flag = 0);
+
+  // Bytes of the records, with padding to the minimum write size, and the
+  // writes handed to the writer
+  WriteStats write_stats() const { return counters_.stats(); }
  
  private:
+  // Places the record at its address through the buffers.
+  void Place(uint64_t head_addr, char *source, int total, int flag);
   void Fill(uint64_t tag, uint64_t offset, int len, char *data, int flag);
   bool TryPad(uint64_t tag, int len, char *data);
 
   std::atomic_uint_fast64_t address_ alignas(64);
   BufferArray buffers_ alignas(64);
   Writer &writer_;
+  WriteCounters counters_;
 };
 
 inline GroupCommitter::GroupCommitter(int buffer_size, int num_buffers,
@@ -65,6 +76,7 @@ inline void GroupCommitter::Fill(uint64_t tag, uint64_t offset, int len,
         tid, buffer, flush_size);
 #endif
     writer_.Write(buffer->data(0), flush_size, tag, flag);
+    counters_.AddWrites(1, flush_size);
     buffer->Release(tag);
   }
 }
@@ -92,8 +104,34 @@ inline void GroupCommitter::Commit(uint64_t timestamp,
   const int total = crc32len < kMinWriteSize ? kMinWriteSize : crc32len;
   char source[total]; // may contain redandunt trailing bytes
   CRC32DataEncode(source, timestamp, data, size);
+  counters_.AddRecord(size, crc32len - size, total - crc32len);
+  Place(address_.fetch_add(total), source, total, flag);
+}
 
+inline void GroupCommitter::CommitFrame(const uint64_t timestamps[],
+    void *const data[], const uint32_t sizes[], int n, int flag) {
+  FrameBuilder frame(kDataFrame);
+  uint64_t payload = 0;
+  for (int i = 0; i < n; ++i) {
+    frame.AddData(timestamps[i], data[i], sizes[i]);
+    payload += sizes[i];
+  }
+  const int len = frame.length();
+  const int total = len < kMinWriteSize ? kMinWriteSize : len;
+  counters_.AddRecord(payload, len - payload, total - len);
   const uint64_t head_addr = address_.fetch_add(total);
+  frame.Seal(head_addr);
+  if (total == len) {
+    Place(head_addr, (char *)frame.data(), total, flag);
+  } else {
+    char source[total];
+    memcpy(source, frame.data(), len);
+    Place(head_addr, source, total, flag);
+  }
+}
+
+inline void GroupCommitter::Place(uint64_t head_addr, char *source,
+    int total, int flag) {
   const uint64_t end_addr = head_addr + total;
   const uint64_t head_tag = buffers_.BufferTag(head_addr);
   const uint64_t tail_tag = buffers_.BufferTag(end_addr - 1);
@@ -138,6 +176,7 @@ inline void GroupCommitter::Commit(uint64_t timestamp,
     // Flushes aligned data without using buffers
     writer_.Write(source + head_len, total - head_len - tail_len,
         head_addr + head_len, flag);
+    counters_.AddWrites(1, total - head_len - tail_len);
   }
 
   if (tail_status == 1) { // not tagged
@@ -153,6 +192,7 @@ inline void GroupCommitter::Commit(uint64_t timestamp,
           tid, tail_buffer, flush_size);
 #endif
       writer_.Write(tail_buffer->data(0), flush_size, tail_tag, flag);
+      counters_.AddWrites(1, flush_size);
       tail_buffer->Release(tail_tag);
     }
   }
@@ -0,0 +1,136 @@
+//
+//  inline_tuner.h
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 23, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#ifndef VM_PERSISTENCE_PLIB_INLINE_TUNER_H_
+#define VM_PERSISTENCE_PLIB_INLINE_TUNER_H_
+
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include "format.h"
+
+namespace plib {
+
+// Chooses the data size below which a store inlines data with a checksum
+// rather than writes it raw with a separate metadata record. The crossover
+// is where checksumming the data costs as much as the metadata record, so
+// the threshold is the cost of a record over that of checksumming one byte.
+// Both are measured by calibration, and optionally averaged from costs
+// measured by commits, which include encoding and indexing the record.
+// Stores do not index inlined data, so the threshold also bounds the
+// commits that cannot be checked out. Measured costs only lower it, unless
+// the cap is raised.
+class InlineTuner {
+ public:
+  // Starts from the threshold until calibrated, and caps it there.
+  explicit InlineTuner(size_t threshold);
+
+  size_t threshold() const { return threshold_; }
+  // Fixes the threshold as if calibrated.
+  void set_threshold(size_t threshold);
+  // Measured costs set the threshold at most to the cap.
+  size_t max_threshold() const { return max_threshold_; }
+  void set_max_threshold(size_t threshold) {
+    max_threshold_ = std::min(threshold, (size_t)kMaxThreshold);
+  }
+
+  // Measures the checksum cost, and takes the latency (ns) of writing a
+  // record, to set the threshold. A negative latency keeps the threshold.
+  void Calibrate(int64_t write_ns);
+  bool calibrated() const { return calibrated_; }
+
+  // Whether commits feed their measured costs into the threshold
+  bool online() const { return online_; }
+  void set_online(bool online) { online_ = online; }
+  // Samples racing with each other may be lost, which only slows the
+  // averages.
+  void AddChecksumSample(size_t nbytes, int64_t ns);
+  void AddWriteSample(int64_t ns);
+
+  double checksum_cost() const { return checksum_cost_; } // ns per byte
+  double write_cost() const { return write_cost_; } // ns per record
+
+  static const size_t kSampleBytes = 16 << 10;
+  static const int kRounds = 16;
+  static const size_t kMaxThreshold = 64 << 10; // inlined on the stack
+  static const int kAverageShift = 4; // of the weight of old samples
+
+ private:
+  void Update();
+
+  std::atomic<size_t> threshold_;
+  std::atomic<size_t> max_threshold_;
+  std::atomic_bool calibrated_;
+  std::atomic_bool online_;
+  std::atomic<double> checksum_cost_;
+  std::atomic<double> write_cost_;
+};
+
+// Implementation of InlineTuner
+
+inline InlineTuner::InlineTuner(size_t threshold) : threshold_(threshold),
+    max_threshold_(std::min(threshold, (size_t)kMaxThreshold)),
+    calibrated_(false), online_(false), checksum_cost_(0), write_cost_(0) {
+}
+
+inline void InlineTuner::set_threshold(size_t threshold) {
+  threshold_ = threshold;
+  calibrated_ = true;
+}
+
+// The fastest of a few rounds is least disturbed.
+inline void InlineTuner::Calibrate(int64_t write_ns) {
+  using namespace std::chrono;
+  std::vector<char> data(kSampleBytes);
+  std::vector<char> record(CRC32DataLength(kSampleBytes));
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = i * 131;
+  }
+  int64_t min_ns = INT64_MAX;
+  for (int r = 0; r < kRounds; ++r) {
+    steady_clock::time_point t1 = steady_clock::now();
+    CRC32DataEncode(record.data(), r, data.data(), data.size());
+    steady_clock::time_point t2 = steady_clock::now();
+    min_ns = std::min<int64_t>(min_ns,
+        duration_cast<nanoseconds>(t2 - t1).count());
+  }
+  checksum_cost_ = (double)std::max<int64_t>(min_ns, 1) / kSampleBytes;
+  if (write_ns >= 0) {
+    write_cost_ = write_ns;
+    Update();
+  }
+  calibrated_ = true;
+}
+
+inline void InlineTuner::AddChecksumSample(size_t nbytes, int64_t ns) {
+  if (!nbytes) return;
+  double cost = checksum_cost_;
+  cost += ((double)ns / nbytes - cost) / (1 << kAverageShift);
+  checksum_cost_ = cost;
+  Update();
+}
+
+inline void InlineTuner::AddWriteSample(int64_t ns) {
+  double cost = write_cost_;
+  cost += (ns - cost) / (1 << kAverageShift);
+  write_cost_ = cost;
+  Update();
+}
+
+inline void InlineTuner::Update() {
+  double checksum = checksum_cost_;
+  if (checksum <= 0) return; // not calibrated
+  threshold_ = std::min(write_cost_ / checksum, (double)max_threshold_);
+}
+
+} // namespace plib
+
+#endif // VM_PERSISTENCE_PLIB_INLINE_TUNER_H_
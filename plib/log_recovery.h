@@ -0,0 +1,270 @@
+//
+//  log_recovery.h
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 8, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#ifndef VM_PERSISTENCE_PLIB_LOG_RECOVERY_H_
+#define VM_PERSISTENCE_PLIB_LOG_RECOVERY_H_
+
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "file.h"
+#include "format.h"
+#include "log_scanner.h"
+
+namespace plib {
+
+struct RecoveredRecord {
+  uint64_t timestamp;
+  uint8_t index; // of the data file
+  uint64_t pos; // of the payload
+  uint32_t length; // of the payload
+  const uint64_t *meta; // nullptr for CRC32 data
+  uint32_t n;
+  bool delta; // the payload holds delta pages (see format.h)
+};
+
+// Scans the logs of a file store after a crash, one thread per file.
+// A data record is consistent if it lies in the valid prefix of its file,
+// i.e., before the first torn record or hole. A metadata record is
+// consistent if it is intact and its raw data record is consistent.
+// The recovered state consists of all consistent records older than the
+// first inconsistent metadata record, and the metadata file is cut before
+// the first record not recovered, or before its frame.
+class LogRecovery {
+ public:
+  LogRecovery(const char *name_prefix, int num_files,
+      size_t read_size = 16 << 20, off_t segment_size = 0);
+
+  // Returns the number of records recovered.
+  size_t Run();
+  // Cuts torn tails and unrecovered metadata so that new records follow
+  // the valid prefixes.
+  int Truncate();
+
+  // Visits recovered records in timestamp order.
+  template <class Visitor>
+  void Replay(Visitor visitor) const;
+
+  uint64_t last_timestamp() const { return last_timestamp_; }
+  // End of the valid prefix of a file
+  off_t valid_end(int index) const { return scans_[index].valid_end; }
+  size_t num_orphans() const { return num_orphans_; }
+  uint64_t bytes() const { return bytes_; }
+  double seconds() const { return seconds_; }
+  double throughput() const { return bytes_ / seconds_ / 1e9; } // GB/s
+
+ private:
+  struct Extent {
+    uint64_t pos;
+    uint32_t length;
+    bool operator<(const Extent &other) const { return pos < other.pos; }
+  };
+
+  struct MetaRecord {
+    uint64_t timestamp;
+    uint64_t indexed_pos;
+    size_t word; // offset in the words of the scan
+    uint32_t n;
+    off_t pos; // in the metadata file
+    bool delta;
+  };
+
+  struct Scan {
+    File file;
+    off_t valid_end;
+    std::vector<Extent> raw; // sorted by position
+    std::vector<RecoveredRecord> crc32;
+    std::vector<MetaRecord> meta;
+    std::vector<uint64_t> words;
+  };
+
+  void ScanData(Scan *scan);
+  void ScanMeta(Scan *scan);
+
+  const size_t read_size_;
+  std::vector<Scan> scans_; // index 0 is for metadata
+  std::vector<RecoveredRecord> records_;
+  uint64_t last_timestamp_;
+  size_t num_orphans_;
+  uint64_t bytes_;
+  double seconds_;
+};
+
+// Implementation of LogRecovery
+
+inline LogRecovery::LogRecovery(const char *prefix, int num_files,
+    size_t read_size, off_t segment_size) :
+    read_size_(read_size), scans_(num_files + 1), last_timestamp_(0),
+    num_orphans_(0), bytes_(0), seconds_(0) {
+  for (int i = 0; i <= num_files; ++i) {
+    Scan &scan = scans_[i];
+    scan.file.Open(std::string(prefix) + std::to_string(i), segment_size,
+        nullptr, false);
+    scan.valid_end = scan.file.begin();
+  }
+}
+
+inline void LogRecovery::ScanData(Scan *scan) {
+  LogScanner scanner(scan->file, scan->file.begin(), read_size_);
+  DataHeader header;
+  uint32_t type;
+  while ((type = scanner.NextData(&header))) {
+    uint64_t pos = scanner.record_pos() + sizeof(DataHeader); // payload
+    if (type == kRawData) {
+      // The payload is only checked against its metadata.
+      scan->raw.push_back({ pos, header.length });
+    } else {
+      scan->crc32.push_back({ header.timestamp, 0, pos, header.length,
+          nullptr, 0 });
+    }
+  }
+  scan->valid_end = scanner.end();
+}
+
+inline void LogRecovery::ScanMeta(Scan *scan) {
+  LogScanner scanner(scan->file, scan->file.begin(), read_size_);
+  while (scanner.NextMeta() >= 0) {
+    MetaRecord record;
+    DecodeMetaHeader(scanner.record(), &record.timestamp,
+        &record.indexed_pos, &record.n);
+    const uint64_t *words = scanner.words();
+    record.pos = scanner.pos();
+    record.delta = MetaFlags(scanner.record()) & kMetaDelta;
+    record.word = scan->words.size();
+    scan->words.insert(scan->words.end(), words, words + record.n);
+    scan->meta.push_back(record);
+  }
+  scan->valid_end = scanner.end();
+}
+
+inline size_t LogRecovery::Run() {
+  using namespace std::chrono;
+  high_resolution_clock::time_point t1 = high_resolution_clock::now();
+
+  std::vector<std::thread> threads;
+  threads.emplace_back(&LogRecovery::ScanMeta, this, &scans_[0]);
+  for (size_t i = 1; i < scans_.size(); ++i) {
+    threads.emplace_back(&LogRecovery::ScanData, this, &scans_[i]);
+  }
+  for (std::thread &t : threads) {
+    t.join();
+  }
+
+  // Matches metadata with raw data. Metadata of data dropped by
+  // compaction is skipped.
+  Scan &ms = scans_[0];
+  std::vector<RecoveredRecord> matches(ms.meta.size());
+  std::vector<std::vector<bool>> referenced(scans_.size());
+  uint64_t first_dangling = UINT64_MAX;
+  for (size_t k = 0; k < ms.meta.size(); ++k) {
+    const MetaRecord &mr = ms.meta[k];
+    uint64_t pos = mr.indexed_pos;
+    uint8_t index = ParseIndexedPosition(&pos);
+    matches[k].index = 0; // unmatched
+    if (!index || index >= scans_.size()) {
+      first_dangling = std::min(first_dangling, mr.timestamp);
+      continue;
+    }
+    if (pos < (uint64_t)scans_[index].file.begin()) continue; // compacted
+    const std::vector<Extent> &raw = scans_[index].raw;
+    auto it = std::lower_bound(raw.begin(), raw.end(), Extent{ pos, 0 });
+    if (it == raw.end() || it->pos != pos) {
+      first_dangling = std::min(first_dangling, mr.timestamp);
+      continue;
+    }
+    matches[k] = { mr.timestamp, index, pos, it->length,
+        ms.words.data() + mr.word, mr.n, mr.delta };
+  }
+  // Metadata records before the first unrecovered one are all consistent.
+  size_t num_consistent = 0;
+  while (num_consistent < ms.meta.size() &&
+      ms.meta[num_consistent].timestamp < first_dangling) {
+    ++num_consistent;
+  }
+  if (num_consistent < ms.meta.size()) {
+    // A frame is cut as a whole, so its records are not recovered either,
+    // nor is data committed after them.
+    off_t pos = ms.meta[num_consistent].pos;
+    while (num_consistent && ms.meta[num_consistent - 1].pos == pos) {
+      --num_consistent;
+      first_dangling = std::min(first_dangling,
+          ms.meta[num_consistent].timestamp);
+    }
+    ms.valid_end = pos;
+  }
+
+  std::vector<RecoveredRecord> records;
+  for (size_t i = 1; i < scans_.size(); ++i) {
+    referenced[i].resize(scans_[i].raw.size());
+  }
+  for (size_t k = 0; k < num_consistent; ++k) {
+    const RecoveredRecord &r = matches[k];
+    if (!r.index) continue;
+    const std::vector<Extent> &raw = scans_[r.index].raw;
+    referenced[r.index][std::lower_bound(raw.begin(), raw.end(),
+        Extent{ r.pos, 0 }) - raw.begin()] = true;
+    records.push_back(r);
+  }
+  for (size_t i = 1; i < scans_.size(); ++i) {
+    num_orphans_ += std::count(referenced[i].begin(), referenced[i].end(),
+        false);
+    for (RecoveredRecord r : scans_[i].crc32) {
+      r.index = i;
+      records.push_back(r);
+    }
+  }
+
+  records_.clear();
+  last_timestamp_ = 0;
+  for (const RecoveredRecord &r : records) {
+    if (r.timestamp >= first_dangling) continue;
+    records_.push_back(r);
+    last_timestamp_ = std::max(last_timestamp_, r.timestamp);
+  }
+  std::stable_sort(records_.begin(), records_.end(),
+      [](const RecoveredRecord &a, const RecoveredRecord &b) {
+    return a.timestamp < b.timestamp;
+  });
+
+  high_resolution_clock::time_point t2 = high_resolution_clock::now();
+  seconds_ = duration_cast<duration<double>>(t2 - t1).count();
+  bytes_ = 0;
+  for (const Scan &scan : scans_) {
+    bytes_ += scan.valid_end - scan.file.begin();
+  }
+  return records_.size();
+}
+
+inline int LogRecovery::Truncate() {
+  for (Scan &scan : scans_) {
+    File &f = scan.file;
+    if (!f.segment_size() && f.offset() == scan.valid_end) continue;
+    if (f.Truncate(scan.valid_end)) {
+      perror("[ERROR] LogRecovery::Truncate");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+template <class Visitor>
+inline void LogRecovery::Replay(Visitor visitor) const {
+  for (const RecoveredRecord &r : records_) {
+    visitor(r);
+  }
+}
+
+} // namespace plib
+
+#endif // VM_PERSISTENCE_PLIB_LOG_RECOVERY_H_
@@ -0,0 +1,254 @@
+//
+//  log_scanner.h
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 10, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#ifndef VM_PERSISTENCE_PLIB_LOG_SCANNER_H_
+#define VM_PERSISTENCE_PLIB_LOG_SCANNER_H_
+
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+
+#include "file.h"
+#include "format.h"
+
+namespace plib {
+
+// Walks through the valid prefix of a data or metadata file with large
+// sequential reads. Padding and unused segment tails are skipped.
+// A frame is verified as a whole, and then its records are returned
+// one by one.
+class LogScanner {
+ public:
+  LogScanner(File &file, off_t begin, size_t chunk_size = 1 << 20);
+
+  // Moves to the next data record and returns its type, or zero at the end
+  // of the valid prefix. A CRC32 record is verified before it is returned.
+  // The payload of raw data is not read.
+  uint32_t NextData(DataHeader *header);
+  // Moves to the next metadata record and returns its number of words,
+  // or -1 at the end of the valid prefix.
+  int64_t NextMeta();
+
+  // The current record, valid until the next move.
+  // Raw data is not available.
+  const char *record() const { return record_; }
+  // Words of the current metadata record, valid until the next move.
+  const uint64_t *words() { return DecodeMetaWords(record_, &words_); }
+  off_t record_pos() const { return record_pos_; }
+  // Beginning of the current record, or of its frame.
+  off_t pos() const { return pos_; }
+  // End of the current record or frame, or of the valid prefix after the
+  // last move.
+  off_t end() const { return end_; }
+  bool framed() const { return frame_; }
+
+ private:
+  // Returns the bytes at the position, or nullptr if absent.
+  const char *Get(off_t pos, size_t len);
+  // Whether a record at the position may end there, within the segment
+  // and the bytes on disk. Lengths read from a torn tail are rejected
+  // before any buffer is sized for them.
+  bool Fits(off_t pos, off_t end, off_t segment_end);
+  // Verifies a frame of the type at the position, and enters it.
+  bool EnterFrame(off_t pos, off_t segment_end, FrameType type);
+  // Moves to the next record in the current frame, if any.
+  bool NextInFrame();
+  // Returns the length of the record in the current frame, or zero if it
+  // is not valid there.
+  size_t FramedLength(const char *mem) const;
+
+  File &file_;
+  const size_t chunk_size_;
+  std::vector<char> buffer_;
+  off_t buffer_pos_;
+  off_t stored_end_; // last known end of the bytes on disk
+  std::vector<uint64_t> words_; // unpacked
+
+  const char *record_;
+  off_t record_pos_;
+  off_t pos_;
+  off_t end_;
+
+  const char *frame_; // nullptr if not in a frame
+  const char *frame_end_; // of the records
+  FrameType frame_type_;
+  uint32_t frame_left_; // number of records
+};
+
+// Implementation of LogScanner
+
+inline LogScanner::LogScanner(File &file, off_t begin, size_t chunk_size) :
+    file_(file), chunk_size_(chunk_size), buffer_pos_(0), stored_end_(0),
+    record_(nullptr), record_pos_(begin), pos_(begin), end_(begin),
+    frame_(nullptr), frame_end_(nullptr), frame_type_(kDataFrame),
+    frame_left_(0) {
+}
+
+inline const char *LogScanner::Get(off_t pos, size_t len) {
+  if (pos >= buffer_pos_ && pos + len <= buffer_pos_ + buffer_.size()) {
+    return buffer_.data() + (pos - buffer_pos_);
+  }
+  buffer_.resize(std::max(chunk_size_, len));
+  ssize_t count = file_.Read(buffer_.data(), buffer_.size(), pos);
+  buffer_.resize(count > 0 ? count : 0);
+  buffer_pos_ = pos;
+  return buffer_.size() >= len ? buffer_.data() : nullptr;
+}
+
+// The size on disk is checked only past its last known end.
+inline bool LogScanner::Fits(off_t pos, off_t end, off_t segment_end) {
+  if (end > segment_end) return false;
+  if (end > stored_end_) stored_end_ = file_.StoredEnd(pos);
+  return end <= stored_end_;
+}
+
+inline bool LogScanner::EnterFrame(off_t pos, off_t segment_end,
+    FrameType type) {
+  const char *mem = Get(pos, sizeof(FrameHeader));
+  FrameHeader header;
+  if (!mem || DecodeFrameHeader(mem, &header) != type ||
+      header.lsn != (uint64_t)pos) return false;
+  off_t end = pos + FrameLength(header.length);
+  if (!Fits(pos, end, segment_end)) return false;
+  mem = Get(pos, end - pos);
+  if (!mem || !VerifyFrame(mem, header)) return false;
+  frame_ = mem;
+  frame_end_ = mem + sizeof(FrameHeader) + header.length;
+  frame_type_ = type;
+  frame_left_ = header.count;
+  record_ = nullptr;
+  pos_ = pos;
+  end_ = end;
+  return true;
+}
+
+inline size_t LogScanner::FramedLength(const char *mem) const {
+  size_t len;
+  if (frame_type_ == kDataFrame) {
+    DataHeader header;
+    if (mem + sizeof(DataHeader) > frame_end_ ||
+        DecodeDataHeader(mem, &header) != kFramedData) return 0;
+    len = FramedDataLength(header.length);
+  } else {
+    // The checksum of the frame follows, so a packed length can be read.
+    if (mem + FramedMetaLength(0) > frame_end_) return 0;
+    len = MetaBodyLength(mem);
+  }
+  return mem + len <= frame_end_ ? len : 0;
+}
+
+inline bool LogScanner::NextInFrame() {
+  if (!frame_) return false;
+  const char *mem = record_ ? record_ + FramedLength(record_) :
+      frame_ + sizeof(FrameHeader);
+  if (!frame_left_ || !FramedLength(mem)) {
+    frame_ = nullptr;
+    record_ = nullptr;
+    return false;
+  }
+  --frame_left_;
+  record_ = mem;
+  record_pos_ = pos_ + (mem - frame_);
+  return true;
+}
+
+inline uint32_t LogScanner::NextData(DataHeader *header) {
+  if (NextInFrame()) {
+    return DecodeDataHeader(record_, header);
+  }
+  off_t pos = end_;
+  record_ = nullptr;
+  while (true) {
+    off_t segment_end = file_.SegmentEnd(pos);
+    if (segment_end - pos < (off_t)sizeof(DataHeader)) {
+      pos = segment_end;
+      continue;
+    }
+    const char *mem = Get(pos, sizeof(DataHeader));
+    uint32_t type = mem ? DecodeDataHeader(mem, header) : 0;
+    if (!type || type == kFramedData) break;
+    if (type == kFrameData) {
+      if (!EnterFrame(pos, segment_end, kDataFrame)) break;
+      if (NextInFrame()) return DecodeDataHeader(record_, header);
+      pos = end_; // empty
+      continue;
+    }
+    off_t end = pos + sizeof(DataHeader) + header->length;
+    if (IsCRC32Data(type)) end += sizeof(uint32_t);
+    if (!Fits(pos, end, segment_end)) break;
+
+    if (type == kPaddingData) {
+      pos = end;
+      continue;
+    } else if (type == kRawData) {
+      if (!Get(end - 1, 1)) break;
+    } else { // CRC32 data
+      mem = Get(pos, end - pos);
+      if (!mem || !CRC32DataVerify(mem, *header)) break;
+      record_ = mem;
+    }
+    record_pos_ = pos_ = pos;
+    end_ = end;
+    return type;
+  }
+  record_pos_ = pos_ = end_ = pos;
+  return 0;
+}
+
+inline int64_t LogScanner::NextMeta() {
+  uint64_t timestamp, indexed_pos;
+  uint32_t n;
+  if (NextInFrame()) {
+    DecodeMetaHeader(record_, &timestamp, &indexed_pos, &n);
+    return n;
+  }
+  off_t pos = end_;
+  record_ = nullptr;
+  while (true) {
+    off_t segment_end = file_.SegmentEnd(pos);
+    if (segment_end - pos < (off_t)MetaLength(0)) {
+      pos = segment_end;
+      continue;
+    }
+    const char *mem = Get(pos, MetaLength(0));
+    if (!mem) break;
+    uint32_t magic;
+    Deserialize(mem, &magic);
+    if (magic == (kDataMagic | kFrameData) &&
+        EnterFrame(pos, segment_end, kMetaFrame)) {
+      if (NextInFrame()) {
+        DecodeMetaHeader(record_, &timestamp, &indexed_pos, &n);
+        return n;
+      }
+      pos = end_; // empty
+      continue;
+    }
+    DecodeMetaHeader(mem, &timestamp, &indexed_pos, &n);
+    if (n > kMaxMetaWords || MetaRecordLength(mem) > MetaLength(n)) break;
+    off_t end = pos + MetaRecordLength(mem);
+    if (!Fits(pos, end, segment_end)) break;
+    mem = Get(pos, end - pos);
+    if (!mem || !VerifyMeta(mem)) break;
+
+    if (!ParseIndexedPosition(&indexed_pos)) { // padding
+      if (indexed_pos < MetaLength(0)) break;
+      pos += indexed_pos;
+      continue;
+    }
+    record_ = mem;
+    record_pos_ = pos_ = pos;
+    end_ = end;
+    return n;
+  }
+  record_pos_ = pos_ = end_ = pos;
+  return -1;
+}
+
+} // namespace plib
+
+#endif // VM_PERSISTENCE_PLIB_LOG_SCANNER_H_
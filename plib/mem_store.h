@@ -38,7 +38,7 @@ inline int MemStore<DataEntry>::Commit(void *handle, uint64_t timestamp,
   // TODO judge size
   size_t len = CRC32DataLength(data_size);
   char data_buf[len];
-  CRC32DataEncode(data_buf, timestamp, handle, data_size);
+  CRC32DataEncode(data_buf, timestamp, handle, data_size, true);
   pmem_flush(data_buf, len);
   for (int i = 0; i < 7; ++i) {
     memset(data_buf, i, len);
@@ -0,0 +1,209 @@
+//
+//  mmap_store.h
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 16, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#ifndef VM_PERSISTENCE_PLIB_MMAP_STORE_H_
+#define VM_PERSISTENCE_PLIB_MMAP_STORE_H_
+
+#include "file_store.h"
+
+#include <cstring>
+#include <atomic>
+#include <mutex>
+#include <unordered_set>
+#include <boost/pool/pool_alloc.hpp>
+#include "format.h"
+
+namespace plib {
+
+// Writes records straight into shared mappings of the preallocated log
+// segments, without write calls. Syncs flush only the dirty ranges with
+// msync. Checked-out pages point into the mappings and must not be
+// written. Data segments are not dropped while any of them are held, and
+// compaction retries the drops on later passes. Pages stored as deltas or
+// compressed are rebuilt in memory of their own instead. Commits fail with
+// EIO if a segment cannot be preallocated or mapped.
+// Direct I/O does not apply to this store.
+template <typename DataEntry>
+class MmapStore : public FileStore<DataEntry> {
+ public:
+  MmapStore(const char *name, int num_files,
+      off_t segment_size = kDefaultSegmentSize);
+
+  void *Submit(DataEntry data[], uint32_t n);
+  int Commit(void *handle, uint64_t timestamp, uint64_t meta[], uint32_t n);
+
+  void **CheckoutPages(uint64_t timestamp, uint64_t addr[], int n);
+  void DestroyPages(void *pages[], int n);
+
+  // Whether the files are mapped, which takes segments. Otherwise commits
+  // fail with EINVAL.
+  bool ok() const { return ok_; }
+
+  static const off_t kDefaultSegmentSize = 64 << 20;
+
+ private:
+  struct MmapHandle {
+    uint64_t pos; // of the data header
+    size_t len; // including the header
+    unsigned int seq;
+    unsigned int epoch;
+    int err; // if nothing is written
+  };
+
+  int DropSegments(File &file, off_t pos);
+
+  boost::fast_pool_allocator<MmapHandle> handle_pool_;
+  std::atomic_int num_checkouts_; // holding pages in the mappings
+  std::unordered_set<void *> rebuilt_; // pages checked out from deltas
+  std::mutex rebuilt_mutex_;
+  bool ok_;
+};
+
+// Implementation
+
+template <typename DataEntry>
+MmapStore<DataEntry>::MmapStore(const char *name, int num_files,
+    off_t segment_size) :
+    FileStore<DataEntry>(name, num_files, segment_size), num_checkouts_(0),
+    ok_(true) {
+  for (File &f : this->out_files_) {
+    if (f.EnableMapping()) {
+      perror("[ERROR] MmapStore::MmapStore EnableMapping");
+      ok_ = false;
+      return;
+    }
+  }
+}
+
+template <typename DataEntry>
+void *MmapStore<DataEntry>::Submit(DataEntry data[], uint32_t n) {
+  MmapHandle *handle = handle_pool_.allocate();
+  handle->seq = this->seq_num();
+  handle->epoch = this->EnterCommit();
+  uint8_t index = this->OutIndex(handle->seq);
+  File &f = this->out_files_[index];
+
+  uint32_t size = sizeof(DataEntry) * n;
+  handle->len = sizeof(DataHeader) + size;
+  handle->err = 0;
+  if (!ok_ || !this->Fits(index, handle->len) ||
+      !this->Fits(0, MetaLength(n))) {
+    handle->err = EINVAL;
+    return handle;
+  }
+  handle->pos = f.Reserve(handle->len);
+  char *mem = f.Map(handle->pos);
+  if (!mem) {
+    perror("[ERROR] MmapStore::Submit Map");
+    f.SetError(EIO); // the range stays unwritten
+    handle->err = EIO;
+    return handle;
+  }
+  mem = EncodeDataHeader(mem, kRawData, 0, size);
+  memcpy(mem, data, size);
+  this->write_counters_.AddRecord(size, sizeof(DataHeader));
+  return handle;
+}
+
+template <typename DataEntry>
+int MmapStore<DataEntry>::Commit(void *handle, uint64_t timestamp,
+    uint64_t metadata[], uint32_t n) {
+  MmapHandle *mh = (MmapHandle *)handle;
+  if (mh->err) {
+    int err = mh->err;
+    this->ExitCommit(mh->epoch);
+    handle_pool_.deallocate(mh);
+    return err;
+  }
+  uint8_t index = this->OutIndex(mh->seq);
+  uint64_t pos = mh->pos + sizeof(DataHeader); // of the payload
+  this->out_files_[index].Complete(mh->pos, mh->len);
+
+  size_t len = EncodedMetaLength(metadata, n);
+  File &mf = this->out_files_[0]; // metadata file
+  off_t meta_pos = mf.Reserve(len);
+  char *mem = mf.Map(meta_pos);
+  if (!mem) {
+    perror("[ERROR] MmapStore::Commit Map");
+    mf.SetError(EIO);
+    this->ExitCommit(mh->epoch);
+    handle_pool_.deallocate(mh);
+    return EIO;
+  }
+  EncodeMeta(mem, timestamp, metadata, n, index, pos);
+  mf.Complete(meta_pos, len);
+  this->write_counters_.AddMeta(len);
+  this->IndexMeta(timestamp, metadata, n, index, pos);
+  this->ExitCommit(mh->epoch);
+
+  size_t nbytes = mh->len + len;
+  off_t data_end = mh->pos + mh->len;
+  handle_pool_.deallocate(mh);
+  return this->Committed(index, data_end, meta_pos + len, nbytes);
+}
+
+// Returns pages in the mappings without copying.
+template <typename DataEntry>
+void **MmapStore<DataEntry>::CheckoutPages(uint64_t timestamp,
+    uint64_t addr[], int n) {
+  void **pages = (void **)malloc(sizeof(void *) * n);
+  bool found = false;
+  std::shared_lock<std::shared_timed_mutex> lock(this->drop_mutex_);
+  for (int i = 0; i < n; ++i) {
+    uint8_t index;
+    uint64_t pos;
+    pages[i] = nullptr;
+    if (!this->FindPage(addr[i], timestamp, &index, &pos)) continue;
+    if (pos & kEntryFlags) {
+      char *page = (char *)malloc(sizeof(DataEntry));
+      if (!this->RebuildPage(addr[i], index, pos, page)) {
+        perror("[ERROR] MmapStore::CheckoutPages RebuildPage");
+        free(page);
+        continue;
+      }
+      std::lock_guard<std::mutex> rebuilt_lock(rebuilt_mutex_);
+      rebuilt_.insert(page);
+      pages[i] = page;
+    } else {
+      pages[i] = this->out_files_[index].Map(pos);
+      found |= (pages[i] != nullptr);
+    }
+  }
+  if (found) ++num_checkouts_;
+  return pages;
+}
+
+template <typename DataEntry>
+void MmapStore<DataEntry>::DestroyPages(void *pages[], int n) {
+  bool found = false;
+  {
+    std::lock_guard<std::mutex> lock(rebuilt_mutex_);
+    for (int i = 0; i < n; ++i) {
+      if (!pages[i]) continue;
+      if (rebuilt_.erase(pages[i])) {
+        free(pages[i]);
+      } else {
+        found = true;
+      }
+    }
+  }
+  free(pages);
+  if (found) --num_checkouts_;
+}
+
+// Checked-out pages are only in data files.
+template <typename DataEntry>
+int MmapStore<DataEntry>::DropSegments(File &file, off_t pos) {
+  std::lock_guard<std::shared_timed_mutex> lock(this->drop_mutex_);
+  if (num_checkouts_ && &file != &this->out_files_[0]) return 0;
+  return file.DropSegments(pos);
+}
+
+} // namespace plib
+
+#endif // VM_PERSISTENCE_PLIB_MMAP_STORE_H_
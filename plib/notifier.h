@@ -10,11 +10,19 @@
 #define VM_PERSISTENCE_PLIB_NOTIFIER_H_
 
 #include <cassert>
+#include <climits>
+#include <ctime>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <mutex>
 #include <thread>
 
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 namespace plib {
 
 class SleepingNotifier {
@@ -38,6 +46,73 @@ class SleepingNotifier {
   std::condition_variable condition_;
 };
 
+// A drop-in replacement of SleepingNotifier for short waits. Both its lock
+// and its waits poll with bounded exponential backoff before they park on
+// a futex, so that a waiter woken within microseconds never sleeps, and a
+// notification makes a system call only if some waiter is parked.
+class SpinningNotifier {
+ public:
+  SpinningNotifier() : seq_(0), num_parked_(0) {}
+
+  template<class Lambda>
+  auto TakeAction(Lambda lambda);
+
+  template<class Pre, class Wakeup>
+  void Wait(Pre pre, Wakeup wakeup);
+
+  template<class Pre, class Wakeup, class Timeout>
+  void WaitFor(int seconds, Pre pre, Wakeup wakeup, Timeout timeout);
+
+  void NotifyAll();
+
+  static const bool kWait = false;
+  static const bool kRelease = true;
+
+  // Pauses polled before parking, with the backoff doubled up to the limit
+  static const int kSpinPauses = 4096;
+  static const int kMaxBackoff = 64;
+
+ private:
+  // Futex-based mutex: 0 if unlocked, 1 if locked, or 2 if any thread may
+  // be parked on it
+  class Mutex {
+   public:
+    Mutex() : state_(0) {}
+    void lock();
+    void unlock();
+   private:
+    std::atomic_int state_;
+  };
+
+  using Clock = std::chrono::steady_clock;
+
+  // Polls until the word differs from the value. Returns false if it has
+  // not after kSpinPauses, or at once on a single CPU, where the thread to
+  // change it cannot run while the caller spins.
+  static bool Spin(const std::atomic_int &word, int value);
+  // Sleeps until the sequence number differs from the value. Returns false
+  // if the deadline, if any, passes first.
+  bool Park(int seq, const Clock::time_point *deadline);
+
+  static void FutexWait(std::atomic_int *word, int value,
+      const timespec *timeout = nullptr) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, timeout,
+        nullptr, 0);
+  }
+  static void FutexWake(std::atomic_int *word, int count) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+  }
+  static void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  }
+
+  Mutex mutex_;
+  std::atomic_int seq_; // of notifications
+  std::atomic_int num_parked_; // waiters sleeping on seq_
+};
+
 // Implementation of SleepingNotifier
 
 template<class Lambda>
@@ -73,6 +148,119 @@ inline void SleepingNotifier::NotifyAll() {
   condition_.notify_all();
 }
 
+// Implementation of SpinningNotifier
+
+inline void SpinningNotifier::Mutex::lock() {
+  int c = 0;
+  if (state_.compare_exchange_strong(c, 1, std::memory_order_acquire)) {
+    return;
+  }
+  if (Spin(state_, c)) {
+    c = 0;
+    if (state_.compare_exchange_strong(c, 1, std::memory_order_acquire)) {
+      return;
+    }
+  }
+  if (c != 2) c = state_.exchange(2, std::memory_order_acquire);
+  while (c) {
+    FutexWait(&state_, 2);
+    c = state_.exchange(2, std::memory_order_acquire);
+  }
+}
+
+inline void SpinningNotifier::Mutex::unlock() {
+  if (state_.fetch_sub(1, std::memory_order_release) != 1) {
+    state_.store(0, std::memory_order_release);
+    FutexWake(&state_, 1);
+  }
+}
+
+inline bool SpinningNotifier::Spin(const std::atomic_int &word, int value) {
+  static const bool multicore = std::thread::hardware_concurrency() > 1;
+  int backoff = 1;
+  for (int pauses = 0; multicore && pauses < kSpinPauses;
+      pauses += backoff) {
+    if (word.load(std::memory_order_acquire) != value) return true;
+    for (int i = 0; i < backoff; ++i) {
+      CpuRelax();
+    }
+    backoff = std::min(backoff * 2, (int)kMaxBackoff);
+  }
+  return word.load(std::memory_order_acquire) != value;
+}
+
+// A notifier bumps the sequence number before it checks for parked
+// waiters, and a waiter counts itself before the futex checks the number,
+// so either the notifier wakes the waiter or the waiter does not sleep.
+inline bool SpinningNotifier::Park(int seq,
+    const Clock::time_point *deadline) {
+  ++num_parked_;
+  bool woken = true;
+  while (seq_.load() == seq) {
+    if (!deadline) {
+      FutexWait(&seq_, seq);
+      continue;
+    }
+    auto left = *deadline - Clock::now();
+    if (left <= Clock::duration::zero()) {
+      woken = false;
+      break;
+    }
+    auto sec = std::chrono::duration_cast<std::chrono::seconds>(left);
+    auto nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        left - sec);
+    timespec timeout = { (time_t)sec.count(), (long)nsec.count() };
+    FutexWait(&seq_, seq, &timeout);
+  }
+  --num_parked_;
+  return woken;
+}
+
+template<class Lambda>
+inline auto SpinningNotifier::TakeAction(Lambda lambda) {
+  std::unique_lock<Mutex> lock(mutex_);
+  return lambda();
+}
+
+// The sequence number is taken before each check, so that a notification
+// after the check is not missed, even of a change made without the lock.
+template<class Pre, class Wakeup>
+inline void SpinningNotifier::Wait(Pre pre, Wakeup wakeup) {
+  std::unique_lock<Mutex> lock(mutex_);
+  int seq = seq_;
+  if (pre() == kRelease) return;
+  do {
+    lock.unlock();
+    if (!Spin(seq_, seq)) Park(seq, nullptr);
+    lock.lock();
+    seq = seq_;
+  } while (wakeup() == kWait);
+}
+
+template<class Pre, class Wakeup, class Timeout>
+inline void SpinningNotifier::WaitFor(int sec,
+    Pre pre, Wakeup wakeup, Timeout timeout) {
+  std::unique_lock<Mutex> lock(mutex_);
+  int seq = seq_;
+  if (pre() == kRelease) return;
+  bool timed_out;
+  Clock::time_point deadline = Clock::now() + std::chrono::seconds(sec);
+  do {
+    lock.unlock();
+    timed_out = !Spin(seq_, seq) && !Park(seq, &deadline);
+    lock.lock();
+    seq = seq_;
+  } while (!timed_out && wakeup() == kWait);
+  if (timed_out) timeout();
+}
+
+// Waiters recheck their conditions after they take the sequence number,
+// so the lock is not taken here.
+inline void SpinningNotifier::NotifyAll() {
+  ++seq_;
+  if (num_parked_) FutexWake(&seq_, INT_MAX);
+}
+
 } // namespace plib
 
 #endif // VM_PERSISTENCE_PLIB_NOTIFIER_H_
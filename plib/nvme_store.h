@@ -12,13 +12,18 @@
 #include <cassert>
 #include <cstdint>
 #include <cstdio>
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <mutex>
+#include <vector>
 #include <error.h>
 #include <linux/nvme.h>
 #include <sys/ioctl.h>
 #include "format.h"
+#include "inline_tuner.h"
 #include "versioned_persistence.h"
+#include "write_stats.h"
 
 using namespace std::chrono;
 using microsec = duration<double, std::ratio<1,1000000>>;
@@ -36,7 +41,15 @@ class NVMeStore : public VersionedPersistence<DataEntry> {
   void **CheckoutPages(uint64_t timestamp, uint64_t addr[], int n);
   void DestroyPages(void *pages[], int n) {}
 
-  const size_t kCRC32Threshold = 10240; // 11.6 ns @ 2.50 GHz
+  // Data smaller than the threshold of the tuner is inlined with CRC32.
+  // Unless set, the threshold is calibrated at the first commit.
+  InlineTuner &inline_tuner() { return inline_tuner_; }
+
+  // Bytes of the records written by commits, with padding to whole blocks,
+  // and the ioctls issued, one per block, including those of calibration.
+  WriteStats write_stats() const { return write_counters_.stats(); }
+
+  static const int kCalibrationWrites = 16;
 
  protected:
   const int block_bits_;
@@ -45,6 +58,9 @@ class NVMeStore : public VersionedPersistence<DataEntry> {
   std::atomic_uint_fast64_t meta_slba_;
   std::atomic_uint_fast64_t data_slba_;
   FlashStriper striper_;
+  InlineTuner inline_tuner_;
+  std::once_flag calibrate_once_;
+  WriteCounters write_counters_;
 
   uint16_t NumBlocks(size_t size) {
     size_t n = (size >> block_bits_) + ((size & block_mask_) > 0);
@@ -53,13 +69,15 @@ class NVMeStore : public VersionedPersistence<DataEntry> {
   }
 
   int Write(uint64_t slba, void *data, uint16_t nblocks);
+  size_t InlineThreshold();
 };
 
 template <typename DataEntry>
 inline NVMeStore<DataEntry>::NVMeStore(int blk_bits,
     const char *dev, uint64_t offset) :
     block_bits_(blk_bits), block_mask_((1 << blk_bits) - 1),
-    meta_slba_(0), data_slba_(offset), striper_(8, 3) {
+    meta_slba_(0), data_slba_(offset), striper_(8, 3),
+    inline_tuner_(10240) {
   fildes_ = open(dev, O_RDWR);
   if (fildes_ < 0) perror(dev);
 }
@@ -70,26 +88,74 @@ inline int NVMeStore<DataEntry>::Commit(void *handle, uint64_t timestamp,
   if (fildes_ < 0) return -EIO;
 
   size_t data_size = sizeof(DataEntry) * n;
-  if (data_size < kCRC32Threshold) {
-    uint16_t nblocks = NumBlocks(CRC32DataLength(data_size));
+  const bool online = inline_tuner_.online();
+  high_resolution_clock::time_point t1, t2;
+  if (data_size < InlineThreshold()) {
+    size_t len = CRC32DataLength(data_size);
+    uint16_t nblocks = NumBlocks(len);
     char data_buf[nblocks << block_bits_];
+    if (online) t1 = high_resolution_clock::now();
     CRC32DataEncode(data_buf, timestamp, handle, data_size);
+    if (online) {
+      t2 = high_resolution_clock::now();
+      inline_tuner_.AddChecksumSample(data_size,
+          duration_cast<nanoseconds>(t2 - t1).count());
+    }
     uint64_t slba = data_slba_.fetch_add(nblocks, std::memory_order_relaxed);
+    write_counters_.AddRecord(data_size, len - data_size,
+        (nblocks << block_bits_) - len);
     return Write(slba, data_buf, nblocks);
   } else {
     uint16_t nblocks = NumBlocks(data_size);
     uint64_t slba = data_slba_.fetch_add(nblocks, std::memory_order_relaxed);
+    write_counters_.AddRecord(data_size, 0,
+        (nblocks << block_bits_) - data_size);
     int err = Write(slba, handle, nblocks);
     if (err) return err;
 
-    nblocks = NumBlocks(MetaLength(n));
+    nblocks = NumBlocks(EncodedMetaLength(metadata, n));
     char meta_buf[nblocks << block_bits_];
-    EncodeMeta(meta_buf, timestamp, metadata, n, 0, slba);
+    size_t len = EncodeMeta(meta_buf, timestamp, metadata, n, 0, slba) -
+        meta_buf;
+    write_counters_.AddMeta(len);
+    write_counters_.AddPadding((nblocks << block_bits_) - len);
     slba = meta_slba_.fetch_add(nblocks, std::memory_order_relaxed);
-    return Write(slba, meta_buf, nblocks);
+    if (online) t1 = high_resolution_clock::now();
+    err = Write(slba, meta_buf, nblocks);
+    if (online && !err) {
+      t2 = high_resolution_clock::now();
+      inline_tuner_.AddWriteSample(
+          duration_cast<nanoseconds>(t2 - t1).count());
+    }
+    return err;
   }
 }
 
+// Times writes of one block to the next free metadata block, which later
+// commits overwrite.
+template <typename DataEntry>
+size_t NVMeStore<DataEntry>::InlineThreshold() {
+  std::call_once(calibrate_once_, [this]() {
+    if (inline_tuner_.calibrated()) return;
+    std::vector<char> block(1 << block_bits_);
+    std::vector<int64_t> samples;
+    for (int i = 0; i < kCalibrationWrites; ++i) {
+      high_resolution_clock::time_point t1 = high_resolution_clock::now();
+      if (Write(meta_slba_, block.data(), 1)) break;
+      high_resolution_clock::time_point t2 = high_resolution_clock::now();
+      samples.push_back(duration_cast<nanoseconds>(t2 - t1).count());
+    }
+    int64_t write_ns = -1;
+    if (!samples.empty()) {
+      std::nth_element(samples.begin(),
+          samples.begin() + samples.size() / 2, samples.end());
+      write_ns = samples[samples.size() / 2];
+    }
+    inline_tuner_.Calibrate(write_ns);
+  });
+  return inline_tuner_.threshold();
+}
+
 template <typename DataEntry>
 int NVMeStore<DataEntry>::Write(uint64_t slba, void *data, uint16_t nblocks) {
   struct nvme_user_io io = {};
@@ -107,6 +173,7 @@ int NVMeStore<DataEntry>::Write(uint64_t slba, void *data, uint16_t nblocks) {
 #endif
     err = ioctl(fildes_, NVME_IOCTL_SUBMIT_IO, &io);
     if (err) return err;
+    write_counters_.AddWrites(1, 1 << block_bits_);
 #ifdef PERF_TRACE
     high_resolution_clock::time_point t2 = high_resolution_clock::now();
     std::cout << io.slba << '\t' << io.nblocks << '\t';
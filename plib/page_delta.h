@@ -0,0 +1,204 @@
+//
+//  page_delta.h
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 20, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#ifndef VM_PERSISTENCE_PLIB_PAGE_DELTA_H_
+#define VM_PERSISTENCE_PLIB_PAGE_DELTA_H_
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "format.h"
+
+namespace plib {
+
+// A page delta lists the 64-byte lines of a page that differ from its base
+// version, by a bitmap of lines, followed by the new bytes of those lines.
+// The last line of a page whose size is not a multiple of 64 is short.
+//
+//   uint64_t base_timestamp; uint64_t mask[MaskWords(size)]; lines
+
+static const size_t kLineSize = 64;
+
+inline size_t NumLines(size_t size) {
+  return (size + kLineSize - 1) / kLineSize;
+}
+
+inline size_t MaskWords(size_t size) {
+  return (NumLines(size) + 63) / 64;
+}
+
+// Sets the bits of the lines that differ and returns their number.
+typedef size_t (*LineDiffFunction)(const char *page, const char *base,
+    size_t size, uint64_t mask[]);
+
+namespace page_delta {
+
+inline size_t LineLength(size_t size, size_t line) {
+  size_t begin = kLineSize * line;
+  return size - begin < kLineSize ? size - begin : kLineSize;
+}
+
+// Compares the lines from the first up to a full one with memcmp.
+inline size_t DiffTail(const char *page, const char *base, size_t size,
+    size_t line, uint64_t mask[]) {
+  size_t count = 0;
+  for (; line < NumLines(size); ++line) {
+    size_t offset = kLineSize * line;
+    if (memcmp(page + offset, base + offset, LineLength(size, line))) {
+      mask[line / 64] |= 1ull << (line % 64);
+      ++count;
+    }
+  }
+  return count;
+}
+
+} // namespace page_delta
+
+inline size_t LineDiffPortable(const char *page, const char *base,
+    size_t size, uint64_t mask[]) {
+  memset(mask, 0, sizeof(uint64_t) * MaskWords(size));
+  return page_delta::DiffTail(page, base, size, 0, mask);
+}
+
+#if defined(__x86_64__)
+
+// Four 16-byte compares per line, folded into one movemask.
+inline size_t LineDiffSSE2(const char *page, const char *base, size_t size,
+    uint64_t mask[]) {
+  memset(mask, 0, sizeof(uint64_t) * MaskWords(size));
+  const size_t full = size / kLineSize;
+  size_t count = 0;
+  for (size_t line = 0; line < full; ++line) {
+    const __m128i *p = (const __m128i *)(page + kLineSize * line);
+    const __m128i *b = (const __m128i *)(base + kLineSize * line);
+    __m128i eq = _mm_and_si128(
+        _mm_and_si128(
+            _mm_cmpeq_epi8(_mm_loadu_si128(p), _mm_loadu_si128(b)),
+            _mm_cmpeq_epi8(_mm_loadu_si128(p + 1), _mm_loadu_si128(b + 1))),
+        _mm_and_si128(
+            _mm_cmpeq_epi8(_mm_loadu_si128(p + 2), _mm_loadu_si128(b + 2)),
+            _mm_cmpeq_epi8(_mm_loadu_si128(p + 3), _mm_loadu_si128(b + 3))));
+    if (_mm_movemask_epi8(eq) != 0xffff) {
+      mask[line / 64] |= 1ull << (line % 64);
+      ++count;
+    }
+  }
+  return count + page_delta::DiffTail(page, base, size, full, mask);
+}
+
+__attribute__((target("avx2")))
+inline size_t LineDiffAVX2(const char *page, const char *base, size_t size,
+    uint64_t mask[]) {
+  memset(mask, 0, sizeof(uint64_t) * MaskWords(size));
+  const size_t full = size / kLineSize;
+  size_t count = 0;
+  for (size_t line = 0; line < full; ++line) {
+    const __m256i *p = (const __m256i *)(page + kLineSize * line);
+    const __m256i *b = (const __m256i *)(base + kLineSize * line);
+    __m256i eq = _mm256_and_si256(
+        _mm256_cmpeq_epi8(_mm256_loadu_si256(p), _mm256_loadu_si256(b)),
+        _mm256_cmpeq_epi8(_mm256_loadu_si256(p + 1),
+            _mm256_loadu_si256(b + 1)));
+    if (_mm256_movemask_epi8(eq) != -1) {
+      mask[line / 64] |= 1ull << (line % 64);
+      ++count;
+    }
+  }
+  return count + page_delta::DiffTail(page, base, size, full, mask);
+}
+
+#endif // __x86_64__
+
+// The fastest kernel the CPU supports, chosen by CPUID.
+inline LineDiffFunction SelectLineDiff(const char **name = nullptr) {
+  LineDiffFunction kernel = LineDiffPortable;
+  const char *kernel_name = "portable";
+#if defined(__x86_64__)
+  kernel = LineDiffSSE2;
+  kernel_name = "sse2";
+  unsigned int eax, ebx, ecx, edx;
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_OSXSAVE) &&
+      __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_AVX2)) {
+    kernel = LineDiffAVX2;
+    kernel_name = "avx2";
+  }
+#endif
+  if (name) *name = kernel_name;
+  return kernel;
+}
+
+inline size_t LineDiff(const char *page, const char *base, size_t size,
+    uint64_t mask[]) {
+  static const LineDiffFunction kernel = SelectLineDiff();
+  return kernel(page, base, size, mask);
+}
+
+// The length of a delta of the page size with so many changed lines.
+inline size_t PageDeltaLength(size_t size, size_t count,
+    const uint64_t mask[]) {
+  size_t len = sizeof(uint64_t) * (1 + MaskWords(size)) + kLineSize * count;
+  size_t last = NumLines(size) - 1;
+  if (mask[last / 64] & (1ull << (last % 64))) {
+    len -= kLineSize - page_delta::LineLength(size, last);
+  }
+  return len;
+}
+
+inline char *EncodePageDelta(char *mem, uint64_t base_timestamp,
+    const char *page, size_t size, const uint64_t mask[]) {
+  mem = Serialize(mem, base_timestamp);
+  memcpy(mem, mask, sizeof(uint64_t) * MaskWords(size));
+  mem += sizeof(uint64_t) * MaskWords(size);
+  for (size_t w = 0; w < MaskWords(size); ++w) {
+    for (uint64_t bits = mask[w]; bits; bits &= bits - 1) {
+      size_t line = 64 * w + __builtin_ctzll(bits);
+      size_t len = page_delta::LineLength(size, line);
+      memcpy(mem, page + kLineSize * line, len);
+      mem += len;
+    }
+  }
+  return mem;
+}
+
+inline uint64_t PageDeltaBase(const char *mem) {
+  uint64_t base_timestamp;
+  Deserialize(mem, &base_timestamp);
+  return base_timestamp;
+}
+
+// Overwrites the changed lines of the base page. Returns the end of the
+// delta, or nullptr if it would pass the limit.
+inline const char *ApplyPageDelta(char *page, size_t size, const char *mem,
+    const char *limit) {
+  const size_t words = MaskWords(size);
+  if (mem + sizeof(uint64_t) * (1 + words) > limit) return nullptr;
+  const char *mask = mem + sizeof(uint64_t);
+  mem = mask + sizeof(uint64_t) * words;
+  for (size_t w = 0; w < words; ++w) {
+    uint64_t bits;
+    Deserialize(mask + sizeof(uint64_t) * w, &bits);
+    for (; bits; bits &= bits - 1) {
+      size_t line = 64 * w + __builtin_ctzll(bits);
+      if (line >= NumLines(size)) return nullptr;
+      size_t len = page_delta::LineLength(size, line);
+      if (mem + len > limit) return nullptr;
+      memcpy(page + kLineSize * line, mem, len);
+      mem += len;
+    }
+  }
+  return mem;
+}
+
+} // namespace plib
+
+#endif // VM_PERSISTENCE_PLIB_PAGE_DELTA_H_
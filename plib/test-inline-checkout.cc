@@ -0,0 +1,84 @@
+//
+//  test-inline-checkout.cc
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 27, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "sync_file_store.h"
+
+// Commits of a few KB should still be checked out after the inline
+// threshold is calibrated, however slow writes of metadata records are
+// measured to be. Returns nonzero on failure.
+
+struct DataEntry {
+  char bytes[512];
+};
+
+const int kNumRuns = 8;
+const int64_t kSlowWrite = 10000000; // ns, as of a flush to a slow disk
+const uint32_t kNumPages[] = { 2, 16, 64 }; // 1, 8 and 32 KB
+
+// Calibrates with the latency of a record write, or measures it if
+// negative.
+bool Run(const std::string &prefix, int64_t write_ns) {
+  plib::SyncFileStore<DataEntry> store(prefix.c_str(), 1);
+  store.set_wait_durable(true);
+  if (write_ns >= 0) store.inline_tuner().Calibrate(write_ns);
+  store.inline_tuner().set_online(true);
+  std::vector<DataEntry> pages(kNumPages[2]);
+  std::vector<uint64_t> addrs(kNumPages[2]);
+  for (uint32_t i = 0; i < addrs.size(); ++i) {
+    addrs[i] = sizeof(DataEntry) * i;
+  }
+
+  bool ok = true;
+  uint64_t timestamp = 0;
+  for (int r = 0; r < kNumRuns && ok; ++r) {
+    for (uint32_t n : kNumPages) {
+      ++timestamp;
+      for (uint32_t i = 0; i < n; ++i) {
+        memset(pages[i].bytes, timestamp + i, sizeof(DataEntry));
+      }
+      if (store.Commit(store.Submit(pages.data(), n), timestamp,
+          addrs.data(), n)) {
+        fprintf(stderr, "[ERROR] %s: commit %lu failed\n", prefix.c_str(),
+            timestamp);
+        return false;
+      }
+      void **checkout = store.CheckoutPages(timestamp, addrs.data(), n);
+      for (uint32_t i = 0; i < n; ++i) {
+        if (!checkout[i] ||
+            memcmp(checkout[i], &pages[i], sizeof(DataEntry))) {
+          fprintf(stderr, "[ERROR] %s: %u pages at %lu not checked out with "
+              "threshold %lu\n", prefix.c_str(), n, timestamp,
+              store.inline_tuner().threshold());
+          ok = false;
+          break;
+        }
+      }
+      store.DestroyPages(checkout, n);
+    }
+  }
+  return ok;
+}
+
+int main() {
+  char dir[] = "/tmp/plib-inline-checkout-XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("[ERROR] mkdtemp");
+    return 1;
+  }
+  std::string base = std::string(dir) + "/log_";
+  bool ok = Run(base + "measured_", -1);
+  ok = Run(base + "slow_", kSlowWrite) && ok;
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}
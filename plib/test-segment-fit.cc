@@ -0,0 +1,138 @@
+//
+//  test-segment-fit.cc
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 27, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "async_file_store.h"
+#include "delta_stage.h"
+#include "log_recovery.h"
+#include "mmap_store.h"
+#include "sync_file_store.h"
+
+// A commit whose records would not fit in a segment should fail with
+// EINVAL and leave the log readable, for every write path. Returns nonzero
+// on failure.
+
+struct DataEntry {
+  char bytes[4096];
+};
+
+const off_t kSegmentSize = 64 << 10;
+const int kNumPages = 4;
+const int kNumLarge = 32; // pages beyond a segment
+
+// Commits small, too large, and small again with the function, which
+// takes the pages, addresses, count and timestamp.
+template <class Commit>
+bool Run(const std::string &prefix, Commit commit) {
+  std::vector<DataEntry> pages(kNumLarge);
+  std::vector<uint64_t> addrs(kNumLarge);
+  for (int i = 0; i < kNumLarge; ++i) {
+    memset(pages[i].bytes, i + 1, sizeof(DataEntry));
+    addrs[i] = i;
+  }
+  const int sizes[] = { kNumPages, kNumLarge, kNumPages };
+  for (int t = 1; t <= 3; ++t) {
+    int err = commit(pages.data(), addrs.data(), sizes[t - 1], t);
+    if (err != (t == 2 ? EINVAL : 0)) {
+      fprintf(stderr, "[ERROR] %s: commit %d returned %d\n", prefix.c_str(),
+          t, err);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Commits through the persistence.
+struct PersistCommit {
+  plib::VersionedPersistence<DataEntry> &persist;
+  int operator()(DataEntry *pages, uint64_t *addrs, int n, uint64_t t) {
+    return persist.Commit(persist.Submit(pages, n), t, addrs, n);
+  }
+};
+
+// The log is scanned record by record, so a record across segments would
+// cut it at the first.
+bool Check(const std::string &prefix) {
+  plib::LogRecovery recovery(prefix.c_str(), 1, 1 << 20, kSegmentSize);
+  recovery.Run();
+  plib::SyncFileStore<DataEntry> store(prefix.c_str(), 1, kSegmentSize);
+  std::vector<uint64_t> addrs = { 0, 1, 2, 3 };
+  void **pages = store.CheckoutPages(3, addrs.data(), kNumPages);
+  bool ok = store.last_timestamp() == 3;
+  for (int i = 0; i < kNumPages && ok; ++i) {
+    char expected[sizeof(DataEntry)];
+    memset(expected, i + 1, sizeof(expected));
+    ok = pages[i] && !memcmp(pages[i], expected, sizeof(expected));
+  }
+  store.DestroyPages(pages, kNumPages);
+  if (!ok) fprintf(stderr, "[ERROR] %s: versions lost\n", prefix.c_str());
+  return ok;
+}
+
+int main() {
+  char dir[] = "/tmp/plib-segment-fit-XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("[ERROR] mkdtemp");
+    return 1;
+  }
+  std::string base = std::string(dir) + "/log_";
+  bool ok = true;
+  {
+    std::string prefix = base + "sync_";
+    {
+      plib::SyncFileStore<DataEntry> store(prefix.c_str(), 1, kSegmentSize);
+      ok = Run(prefix, PersistCommit{ store }) && ok;
+    }
+    ok = Check(prefix) && ok;
+  }
+  {
+    std::string prefix = base + "batch_";
+    {
+      plib::SyncFileStore<DataEntry> store(prefix.c_str(), 1, kSegmentSize);
+      ok = Run(prefix, [&store](DataEntry *pages, uint64_t *addrs, int n,
+          uint64_t t) {
+        plib::CommitEntry<DataEntry> entry = { pages, addrs, (uint32_t)n, t };
+        return store.CommitBatch(&entry, 1);
+      }) && ok;
+    }
+    ok = Check(prefix) && ok;
+  }
+  {
+    std::string prefix = base + "delta_";
+    {
+      plib::SyncFileStore<DataEntry> store(prefix.c_str(), 1, kSegmentSize);
+      plib::DeltaStage<DataEntry> stage(store);
+      ok = Run(prefix, PersistCommit{ stage }) && ok;
+    }
+    ok = Check(prefix) && ok;
+  }
+  {
+    std::string prefix = base + "async_";
+    {
+      plib::AsyncFileStore<DataEntry> store(prefix.c_str(), 1, kSegmentSize);
+      ok = Run(prefix, PersistCommit{ store }) && ok;
+    }
+    ok = Check(prefix) && ok;
+  }
+  {
+    std::string prefix = base + "mmap_";
+    {
+      plib::MmapStore<DataEntry> store(prefix.c_str(), 1, kSegmentSize);
+      ok = Run(prefix, PersistCommit{ store }) && ok;
+    }
+    ok = Check(prefix) && ok;
+  }
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}
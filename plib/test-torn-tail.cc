@@ -0,0 +1,119 @@
+//
+//  test-torn-tail.cc
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 26, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "log_recovery.h"
+#include "sync_file_store.h"
+
+// Recovery and reopening should cut a torn tail whose header claims a huge
+// length, without allocating for it. Returns nonzero on failure.
+
+struct DataEntry {
+  char bytes[4096];
+};
+
+const int kNumPages = 4;
+const int kNumCommits = 10;
+
+// Writes the bytes at the position of the log, in its segment if any.
+bool Overwrite(const std::string &name, off_t segment_size, off_t pos,
+    const char *mem, size_t len) {
+  std::string path = name;
+  if (segment_size) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), ".%06ld", (long)(pos / segment_size));
+    path += suffix;
+    pos %= segment_size;
+  }
+  int fd = open(path.c_str(), O_WRONLY);
+  if (fd < 0) return false;
+  bool ok = pwrite(fd, mem, len, pos) == (ssize_t)len;
+  close(fd);
+  return ok;
+}
+
+bool Run(const std::string &prefix, off_t segment_size) {
+  std::vector<DataEntry> pages(kNumPages);
+  std::vector<uint64_t> addrs(kNumPages);
+  {
+    plib::SyncFileStore<DataEntry> store(prefix.c_str(), 1, segment_size);
+    for (int t = 1; t <= kNumCommits; ++t) {
+      for (int i = 0; i < kNumPages; ++i) {
+        memset(pages[i].bytes, t * kNumPages + i, sizeof(DataEntry));
+        addrs[i] = i;
+      }
+      void *handle = store.Submit(pages.data(), kNumPages);
+      if (store.Commit(handle, t, addrs.data(), kNumPages)) return false;
+    }
+  }
+
+  plib::LogRecovery before(prefix.c_str(), 1, 1 << 20, segment_size);
+  size_t num_records = before.Run();
+
+  // A metadata header whose packed words claim 4 GB, and a CRC32 data
+  // header of nearly 4 GB
+  char meta[36] = {};
+  char *mem = plib::Serialize(meta, (uint64_t)kNumCommits + 1);
+  mem = plib::Serialize(mem, plib::ToIndexedPosition(0, 1));
+  mem = plib::Serialize(mem, (uint32_t)0x3fffffff);
+  plib::Serialize(mem, (uint32_t)0xffffffff);
+  char data[sizeof(plib::DataHeader)];
+  plib::EncodeDataHeader(data, plib::kCRC32CData, kNumCommits + 1,
+      0xfffffff0u);
+  if (!Overwrite(prefix + "0", segment_size, before.valid_end(0), meta,
+      sizeof(meta)) || !Overwrite(prefix + "1", segment_size,
+      before.valid_end(1), data, sizeof(data))) {
+    perror("[ERROR] Overwrite");
+    return false;
+  }
+
+  plib::LogRecovery after(prefix.c_str(), 1, 1 << 20, segment_size);
+  if (after.Run() != num_records ||
+      after.valid_end(0) != before.valid_end(0) ||
+      after.valid_end(1) != before.valid_end(1)) {
+    fprintf(stderr, "[ERROR] torn tail recovered\n");
+    return false;
+  }
+
+  plib::SyncFileStore<DataEntry> store(prefix.c_str(), 1, segment_size);
+  void **checkout = store.CheckoutPages(kNumCommits, addrs.data(),
+      kNumPages);
+  bool ok = store.last_timestamp() == kNumCommits;
+  for (int i = 0; i < kNumPages && ok; ++i) {
+    ok = checkout[i] && !memcmp(checkout[i], pages[i].bytes,
+        sizeof(DataEntry));
+  }
+  store.DestroyPages(checkout, kNumPages);
+  if (!ok) fprintf(stderr, "[ERROR] pages lost after reopening\n");
+  return ok;
+}
+
+int main() {
+  char dir[] = "/tmp/plib-torn-tail-XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("[ERROR] mkdtemp");
+    return 1;
+  }
+  // Far below what a length read from the torn header would take
+  rlimit limit = { 1ul << 30, 1ul << 30 };
+  setrlimit(RLIMIT_AS, &limit);
+
+  std::string base = std::string(dir) + "/log_";
+  bool ok = Run(base + "plain_", 0) && Run(base + "segmented_", 1 << 20);
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,258 @@
+//
+//  uring.h
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 2, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#ifndef VM_PERSISTENCE_PLIB_URING_H_
+#define VM_PERSISTENCE_PLIB_URING_H_
+
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace plib {
+
+// Completion slot of one SQE. Its address is passed as the user data.
+struct UringRequest {
+  UringRequest() : done(false), result(0) { }
+
+  std::atomic_bool done;
+  int result;
+};
+
+// A single io_uring instance shared by all threads.
+// SQEs are queued without entering the kernel and handed over in batches
+// by whichever thread first needs one of them. Completions are reaped from
+// the mapped CQ ring by any waiting thread.
+class IoUring {
+ public:
+  IoUring(unsigned int entries);
+  ~IoUring();
+  IoUring(const IoUring &) = delete;
+  IoUring &operator=(const IoUring &) = delete;
+
+  bool ok() const { return ring_fd_ >= 0; }
+
+  int RegisterFiles(const int fds[], unsigned int n);
+  int RegisterBuffers(const iovec iovs[], unsigned int n);
+
+  // Queues a copy of the SQE and returns its ticket. The caller fills all
+  // fields but user_data, which is set to the request.
+  uint64_t Prepare(const io_uring_sqe &sqe, UringRequest *request);
+  // Makes sure the SQE of the ticket, and all queued before it, are
+  // visible to the kernel. On failure, the SQEs not taken by the kernel are
+  // withdrawn and their requests complete with the negative error, which
+  // is returned.
+  int Submit(uint64_t ticket);
+  // Blocks until the request completes and returns its result.
+  int Wait(uint64_t ticket, UringRequest *request);
+
+ private:
+  int Enter(unsigned int to_submit, unsigned int min_complete,
+      unsigned int flags);
+  int SubmitLocked();
+  int ReapLocked();
+
+  int ring_fd_;
+  unsigned int sq_entries_;
+  unsigned int cq_entries_;
+
+  void *sq_ring_;
+  size_t sq_ring_size_;
+  void *cq_ring_;
+  size_t cq_ring_size_;
+  io_uring_sqe *sqes_;
+
+  unsigned int *sq_tail_;
+  unsigned int sq_mask_;
+  unsigned int *sq_array_;
+  unsigned int *cq_head_;
+  unsigned int *cq_tail_;
+  unsigned int cq_mask_;
+  io_uring_cqe *cqes_;
+
+  std::mutex sq_mutex_; // guards SQE filling and submission
+  uint64_t queued_;
+  std::atomic_uint_fast64_t submitted_;
+
+  std::mutex cq_mutex_; // only one thread reaps or waits in the kernel
+  std::atomic_uint inflight_;
+};
+
+// Implementation of IoUring
+
+inline IoUring::IoUring(unsigned int entries) :
+    ring_fd_(-1), sq_ring_(MAP_FAILED), cq_ring_(MAP_FAILED),
+    sqes_((io_uring_sqe *)MAP_FAILED),
+    queued_(0), submitted_(0), inflight_(0) {
+  io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  ring_fd_ = syscall(__NR_io_uring_setup, entries, &p);
+  if (ring_fd_ < 0) {
+    perror("[ERROR] IoUring::IoUring io_uring_setup");
+    return;
+  }
+  sq_entries_ = p.sq_entries;
+  cq_entries_ = p.cq_entries;
+
+  sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    if (cq_ring_size_ > sq_ring_size_) sq_ring_size_ = cq_ring_size_;
+    cq_ring_size_ = sq_ring_size_;
+  }
+
+  sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  cq_ring_ = single_mmap ? sq_ring_ :
+      mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+          MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+  sqes_ = (io_uring_sqe *)mmap(nullptr,
+      p.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED ||
+      sqes_ == MAP_FAILED) {
+    perror("[ERROR] IoUring::IoUring mmap");
+    close(ring_fd_);
+    ring_fd_ = -1;
+    return;
+  }
+
+  char *sq = (char *)sq_ring_;
+  sq_tail_ = (unsigned int *)(sq + p.sq_off.tail);
+  sq_mask_ = *(unsigned int *)(sq + p.sq_off.ring_mask);
+  sq_array_ = (unsigned int *)(sq + p.sq_off.array);
+
+  char *cq = (char *)cq_ring_;
+  cq_head_ = (unsigned int *)(cq + p.cq_off.head);
+  cq_tail_ = (unsigned int *)(cq + p.cq_off.tail);
+  cq_mask_ = *(unsigned int *)(cq + p.cq_off.ring_mask);
+  cqes_ = (io_uring_cqe *)(cq + p.cq_off.cqes);
+}
+
+inline IoUring::~IoUring() {
+  if (sqes_ != MAP_FAILED) munmap(sqes_, sq_entries_ * sizeof(io_uring_sqe));
+  if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+    munmap(cq_ring_, cq_ring_size_);
+  }
+  if (sq_ring_ != MAP_FAILED) munmap(sq_ring_, sq_ring_size_);
+  if (ring_fd_ >= 0) close(ring_fd_);
+}
+
+inline int IoUring::RegisterFiles(const int fds[], unsigned int n) {
+  return syscall(__NR_io_uring_register, ring_fd_,
+      IORING_REGISTER_FILES, fds, n);
+}
+
+inline int IoUring::RegisterBuffers(const iovec iovs[], unsigned int n) {
+  return syscall(__NR_io_uring_register, ring_fd_,
+      IORING_REGISTER_BUFFERS, iovs, n);
+}
+
+inline int IoUring::Enter(unsigned int to_submit, unsigned int min_complete,
+    unsigned int flags) {
+  int ret;
+  do {
+    ret = syscall(__NR_io_uring_enter, ring_fd_, to_submit, min_complete,
+        flags, nullptr, 0);
+  } while (ret < 0 && errno == EINTR);
+  return ret;
+}
+
+inline uint64_t IoUring::Prepare(const io_uring_sqe &sqe,
+    UringRequest *request) {
+  std::lock_guard<std::mutex> lock(sq_mutex_);
+  if (queued_ - submitted_ == sq_entries_) SubmitLocked();
+  // Keeps completions within the CQ ring.
+  while (inflight_ >= cq_entries_) {
+    SubmitLocked();
+    std::lock_guard<std::mutex> cq_lock(cq_mutex_);
+    if (!ReapLocked()) Enter(0, 1, IORING_ENTER_GETEVENTS);
+  }
+
+  unsigned int tail = *sq_tail_;
+  unsigned int index = tail & sq_mask_;
+  sqes_[index] = sqe;
+  sqes_[index].user_data = (uint64_t)request;
+  sq_array_[index] = index;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  ++inflight_;
+  return queued_++;
+}
+
+inline int IoUring::SubmitLocked() {
+  while (submitted_ < queued_) {
+    int ret = Enter(queued_ - submitted_, 0, 0);
+    if (ret >= 0) {
+      submitted_ += ret;
+      continue;
+    }
+    if (errno == EAGAIN || errno == EBUSY) continue;
+    int err = -errno;
+    perror("[ERROR] IoUring::Submit io_uring_enter");
+    // Withdraws the SQEs at the tail, which the kernel has not read.
+    unsigned int count = queued_ - submitted_;
+    unsigned int tail = *sq_tail_ - count;
+    for (unsigned int i = 0; i < count; ++i) {
+      UringRequest *request =
+          (UringRequest *)sqes_[(tail + i) & sq_mask_].user_data;
+      request->result = err;
+      request->done.store(true, std::memory_order_release);
+    }
+    __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+    inflight_ -= count;
+    submitted_ = queued_;
+    return err;
+  }
+  return 0;
+}
+
+inline int IoUring::Submit(uint64_t ticket) {
+  if (ticket < submitted_) return 0;
+  std::lock_guard<std::mutex> lock(sq_mutex_);
+  return SubmitLocked();
+}
+
+inline int IoUring::ReapLocked() {
+  unsigned int head = *cq_head_;
+  unsigned int tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  int count = 0;
+  for (; head != tail; ++head, ++count) {
+    io_uring_cqe &cqe = cqes_[head & cq_mask_];
+    UringRequest *request = (UringRequest *)cqe.user_data;
+    request->result = cqe.res;
+    request->done.store(true, std::memory_order_release);
+  }
+  __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  inflight_ -= count;
+  return count;
+}
+
+inline int IoUring::Wait(uint64_t ticket, UringRequest *request) {
+  Submit(ticket);
+  while (!request->done.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> lock(cq_mutex_);
+    if (request->done.load(std::memory_order_acquire)) break;
+    // Holding the lock, no completion can be taken away before we sleep.
+    if (!ReapLocked()) Enter(0, 1, IORING_ENTER_GETEVENTS);
+  }
+  return request->result;
+}
+
+} // namespace plib
+
+#endif // VM_PERSISTENCE_PLIB_URING_H_
@@ -0,0 +1,291 @@
+//
+//  uring_file_store.h
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 2, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#ifndef VM_PERSISTENCE_PLIB_URING_FILE_STORE_H_
+#define VM_PERSISTENCE_PLIB_URING_FILE_STORE_H_
+
+#include "file_store.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <new>
+#include <boost/pool/pool_alloc.hpp>
+#include "format.h"
+#include "uring.h"
+
+namespace plib {
+
+template <typename DataEntry>
+class UringFileStore : public FileStore<DataEntry> {
+ public:
+  // Registered files are used only without segments, since segment
+  // descriptors change while requests are queued.
+  UringFileStore(const char *name, int num_files, off_t segment_size = 0,
+      unsigned int queue_depth = 256, int num_buffers = 64);
+  ~UringFileStore();
+
+  void *Submit(DataEntry data[], uint32_t n);
+  int Commit(void *handle, uint64_t timestamp, uint64_t meta[], uint32_t n);
+
+  static const size_t kBufferSize = 4096; // of registered metadata buffers
+
+ private:
+  struct UringHandle {
+    UringRequest request;
+    uint64_t ticket;
+    unsigned int seq;
+    unsigned int epoch;
+    uint64_t pos; // of the data header
+    uint32_t len; // including the header
+    char *staged; // the whole record in direct mode
+    char header[sizeof(DataHeader)];
+    iovec iov[2];
+    int err; // if nothing is written
+  };
+
+  void PrepareWrite(io_uring_sqe *sqe, uint8_t index,
+      void *buf, uint32_t len, uint64_t pos);
+  bool segmented() const { return this->out_files_[0].segment_size(); }
+  int AcquireBuffer();
+  void ReleaseBuffer(int i);
+  int Sync();
+
+  IoUring ring_;
+  char *buffer_mem_;
+  std::vector<iovec> buffers_;
+  std::vector<int> free_buffers_;
+  std::mutex buffer_mutex_;
+  boost::fast_pool_allocator<UringHandle> handle_pool_;
+};
+
+// Implementation
+
+template <typename DataEntry>
+UringFileStore<DataEntry>::UringFileStore(const char *name, int num_files,
+    off_t segment_size, unsigned int queue_depth, int num_buffers) :
+    FileStore<DataEntry>(name, num_files, segment_size), ring_(queue_depth),
+    buffer_mem_(nullptr) {
+  if (!ring_.ok()) exit(EXIT_FAILURE);
+
+  if (!segmented()) {
+    std::vector<int> fds;
+    for (File &f : this->out_files_) {
+      fds.push_back(f.descriptor());
+    }
+    if (ring_.RegisterFiles(fds.data(), fds.size())) {
+      perror("[ERROR] UringFileStore::UringFileStore register files");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  int err = posix_memalign((void **)&buffer_mem_, kBufferSize,
+      kBufferSize * num_buffers);
+  assert(!err);
+  for (int i = 0; i < num_buffers; ++i) {
+    buffers_.push_back({ buffer_mem_ + kBufferSize * i, kBufferSize });
+    free_buffers_.push_back(i);
+  }
+  if (ring_.RegisterBuffers(buffers_.data(), buffers_.size())) {
+    perror("[ERROR] UringFileStore::UringFileStore register buffers");
+    exit(EXIT_FAILURE);
+  }
+}
+
+template <typename DataEntry>
+UringFileStore<DataEntry>::~UringFileStore() {
+  this->StopSyncer(); // before the ring goes
+  free(buffer_mem_);
+}
+
+template <typename DataEntry>
+inline void UringFileStore<DataEntry>::PrepareWrite(io_uring_sqe *sqe,
+    uint8_t index, void *buf, uint32_t len, uint64_t pos) {
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITE;
+  if (segmented()) { // records never cross segments
+    File &f = this->out_files_[index];
+    sqe->fd = f.descriptor(pos);
+    sqe->off = f.SegmentOffset(pos);
+  } else {
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = index; // position in the registered file table
+    sqe->off = pos;
+  }
+  sqe->addr = (uint64_t)buf;
+  sqe->len = len;
+}
+
+template <typename DataEntry>
+inline int UringFileStore<DataEntry>::AcquireBuffer() {
+  std::lock_guard<std::mutex> lock(buffer_mutex_);
+  if (free_buffers_.empty()) return -1;
+  int i = free_buffers_.back();
+  free_buffers_.pop_back();
+  return i;
+}
+
+template <typename DataEntry>
+inline void UringFileStore<DataEntry>::ReleaseBuffer(int i) {
+  std::lock_guard<std::mutex> lock(buffer_mutex_);
+  free_buffers_.push_back(i);
+}
+
+template <typename DataEntry>
+void *UringFileStore<DataEntry>::Submit(DataEntry data[], uint32_t n) {
+  unsigned int seq = this->seq_num();
+  uint8_t index = this->OutIndex(seq);
+  File &f = this->out_files_[index];
+
+  UringHandle *handle = ::new (handle_pool_.allocate()) UringHandle();
+  handle->seq = seq;
+  handle->epoch = this->EnterCommit();
+  uint32_t size = sizeof(DataEntry) * n;
+  if (!this->Fits(index, this->direct_block_size() ?
+      this->StagedLength(size) : sizeof(DataHeader) + size) ||
+      !this->Fits(0, MetaLength(n))) {
+    handle->err = EINVAL;
+    return handle;
+  }
+  io_uring_sqe sqe;
+  if (this->direct_block_size()) {
+    off_t pos;
+    size_t len;
+    handle->staged = this->StageRawData(index, data, size, &pos, &len);
+    handle->pos = pos;
+    handle->len = len;
+    PrepareWrite(&sqe, index, handle->staged, len, pos);
+  } else {
+    EncodeDataHeader(handle->header, kRawData, 0, size);
+    handle->iov[0] = { handle->header, sizeof(handle->header) };
+    handle->iov[1] = { data, size };
+    handle->len = sizeof(handle->header) + size;
+    handle->pos = f.Reserve(handle->len);
+    this->write_counters_.AddRecord(size, sizeof(handle->header));
+    PrepareWrite(&sqe, index, handle->iov, 2, handle->pos);
+    sqe.opcode = IORING_OP_WRITEV;
+  }
+  handle->ticket = ring_.Prepare(sqe, &handle->request);
+  return handle;
+}
+
+template <typename DataEntry>
+int UringFileStore<DataEntry>::Commit(void *handle, uint64_t timestamp,
+    uint64_t metadata[], uint32_t n) {
+  UringHandle *uh = (UringHandle *)handle;
+  if (uh->err) {
+    int err = uh->err;
+    this->ExitCommit(uh->epoch);
+    uh->~UringHandle();
+    handle_pool_.deallocate(uh);
+    return err;
+  }
+  uint8_t index = this->OutIndex(uh->seq);
+  uint64_t pos = uh->pos + sizeof(uh->header); // of the payload
+  File &mf = this->out_files_[0]; // metadata file
+  size_t len = MetaLength(n);
+  uint64_t meta_pos;
+  int data_res, meta_res;
+
+  if (uh->staged) {
+    // Metadata shares blocks with its neighbors, so it is merged and
+    // written through the file while the data is in flight.
+    ring_.Submit(uh->ticket);
+    char meta_buf[len];
+    len = EncodeMeta(meta_buf, timestamp, metadata, n, index, pos) - meta_buf;
+    meta_pos = mf.Reserve(len);
+    iovec iov = { meta_buf, len };
+    meta_res = mf.WriteV(&iov, 1, meta_pos);
+    data_res = ring_.Wait(uh->ticket, &uh->request);
+    this->ReleaseStaged(uh->staged, uh->len);
+  } else {
+    int buf_index = (len <= kBufferSize) ? AcquireBuffer() : -1;
+    char *meta_buf = (buf_index >= 0) ?
+        (char *)buffers_[buf_index].iov_base : (char *)malloc(len);
+    char *end = EncodeMeta(meta_buf, timestamp, metadata, n, index, pos);
+    len = end - meta_buf;
+
+    meta_pos = mf.Reserve(len);
+    io_uring_sqe sqe;
+    PrepareWrite(&sqe, 0, meta_buf, len, meta_pos);
+    if (buf_index >= 0) {
+      sqe.opcode = IORING_OP_WRITE_FIXED;
+      sqe.buf_index = buf_index;
+    }
+    UringRequest meta_request;
+    uint64_t ticket = ring_.Prepare(sqe, &meta_request);
+
+    ring_.Submit(ticket); // data and metadata in one batch
+    data_res = ring_.Wait(uh->ticket, &uh->request);
+    meta_res = ring_.Wait(ticket, &meta_request);
+
+    if (buf_index >= 0) {
+      ReleaseBuffer(buf_index);
+    } else {
+      free(meta_buf);
+    }
+  }
+  int err = (data_res != (int)uh->len || meta_res != (int)len) ? EIO : 0;
+  this->out_files_[index].CountWrites(1, std::max(data_res, 0));
+  if (!uh->staged) mf.CountWrites(1, std::max(meta_res, 0));
+  if (!err) {
+    this->out_files_[index].Complete(uh->pos, uh->len);
+    if (!uh->staged) mf.Complete(meta_pos, len);
+    this->IndexMeta(timestamp, metadata, n, index, pos);
+    this->write_counters_.AddMeta(len);
+  } else {
+    this->out_files_[index].SetError(err);
+    if (!uh->staged) mf.SetError(err);
+  }
+  this->ExitCommit(uh->epoch);
+  size_t nbytes = uh->len + len;
+  off_t data_end = uh->pos + uh->len;
+  uh->~UringHandle();
+  handle_pool_.deallocate(uh);
+  if (err) return err;
+  return this->Committed(index, data_end, meta_pos + len, nbytes);
+}
+
+template <typename DataEntry>
+int UringFileStore<DataEntry>::Sync() {
+  // Flushes only the segments with new data.
+  if (segmented()) return FileStore<DataEntry>::Sync();
+
+  const size_t num_files = this->out_files_.size();
+  std::vector<UringRequest> requests(num_files);
+  uint64_t tickets[num_files];
+  off_t targets[num_files];
+  bool dirty[num_files];
+  for (size_t i = 0; i < num_files; ++i) {
+    targets[i] = this->out_files_[i].written_offset();
+    dirty[i] = this->out_files_[i].durable_offset() < targets[i];
+    if (!dirty[i]) continue;
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_FSYNC;
+    sqe.flags = IOSQE_FIXED_FILE;
+    sqe.fd = i;
+    sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+    tickets[i] = ring_.Prepare(sqe, &requests[i]);
+  }
+  int err = 0;
+  for (size_t i = 0; i < num_files; ++i) {
+    if (!dirty[i]) continue;
+    if (ring_.Wait(tickets[i], &requests[i]) < 0) {
+      err = EIO;
+    } else {
+      this->out_files_[i].MarkDurable(targets[i]);
+    }
+  }
+  return err;
+}
+
+} // namespace plib
+
+#endif // VM_PERSISTENCE_PLIB_URING_FILE_STORE_H_
@@ -0,0 +1,344 @@
+//
+//  version_index.h
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 5, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#ifndef VM_PERSISTENCE_PLIB_VERSION_INDEX_H_
+#define VM_PERSISTENCE_PLIB_VERSION_INDEX_H_
+
+#include <cstdint>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "format.h"
+
+namespace plib {
+
+// In-memory map from each page address to its persisted versions.
+class VersionIndex {
+ public:
+  struct Version {
+    uint64_t timestamp;
+    uint64_t indexed_pos; // see ToIndexedPosition()
+  };
+
+  struct Location {
+    uint64_t addr;
+    uint64_t timestamp;
+    uint64_t pos; // in the data file
+    uint64_t flags; // of an entry other than a whole page (see format.h)
+  };
+
+  // A version with its address, as persisted in runs (see version_run.h)
+  struct Entry {
+    uint64_t addr;
+    uint64_t timestamp;
+    uint64_t indexed_pos;
+  };
+
+  void Insert(uint64_t addr, uint64_t timestamp, uint64_t indexed_pos);
+  // Inserts n pages laid out back to back from the position.
+  void Insert(const uint64_t addr[], uint32_t n, uint64_t timestamp,
+      uint8_t index, uint64_t pos, size_t page_size);
+  // Finds the newest version at or before the timestamp, and optionally
+  // its own timestamp.
+  bool Find(uint64_t addr, uint64_t timestamp, uint64_t *indexed_pos,
+      uint64_t *version = nullptr) const;
+  // Tells which of n pages laid out back to back are still indexed there.
+  void Contains(const uint64_t addr[], uint32_t n, uint64_t timestamp,
+      uint8_t index, uint64_t pos, size_t page_size, bool present[]) const;
+
+  // Inserts a version stored as a reference to another, which is counted
+  // until the version is pruned.
+  void InsertShared(uint64_t addr, uint64_t timestamp, uint64_t indexed_pos,
+      uint64_t target_addr, uint64_t target_timestamp);
+  // Counts a reference to a version, which is not pruned until all are
+  // released. Unless the version may be indexed later, fails if it is not
+  // indexed now.
+  bool Reference(uint64_t addr, uint64_t timestamp, bool indexed = true);
+  void Release(uint64_t addr, uint64_t timestamp);
+
+  // Scans below go through a batch of buckets per lock acquisition.
+  static const size_t kScanBuckets = 1024;
+
+  // Inserts versions sorted by address and then timestamp, older than
+  // those indexed, except where a version of the same timestamp is indexed.
+  // Shared versions are appended to the list instead, to be inserted by
+  // InsertShared() once their targets are read. Takes the lock once per
+  // batch of addresses.
+  void InsertOlder(const std::vector<Entry> &entries,
+      std::vector<Entry> *shared);
+
+  // Removes versions that are visible neither at or after the horizon nor
+  // at any of the pinned timestamps, except those a kept delta is based on
+  // and those referenced. Returns the number removed.
+  // Entries moved by a concurrent rehash may be left for the next time.
+  size_t Prune(uint64_t horizon, const std::vector<uint64_t> &pins);
+  // Collects versions stored in [begin, end) of a data file.
+  void Collect(uint8_t index, uint64_t begin, uint64_t end,
+      std::vector<Location> *locations) const;
+  // Moves n pages of a version that are still at the old position.
+  // Returns the number moved.
+  uint32_t Relocate(const uint64_t addr[], uint32_t n, uint64_t timestamp,
+      uint8_t index, uint64_t old_pos, uint64_t new_pos, size_t page_size);
+
+  size_t size() const;
+
+ private:
+  using VersionList = std::vector<Version>; // sorted by timestamp
+  using VersionKey = std::pair<uint64_t, uint64_t>; // address, timestamp
+
+  void InsertLocked(uint64_t addr, uint64_t timestamp, uint64_t indexed_pos);
+  void ReleaseLocked(const VersionKey &key);
+
+  std::unordered_map<uint64_t, VersionList> versions_;
+  std::map<VersionKey, VersionKey> targets_; // of shared versions
+  std::map<VersionKey, uint32_t> references_; // to versions
+  mutable std::shared_timed_mutex mutex_;
+};
+
+// Implementation of VersionIndex
+
+inline void VersionIndex::Insert(uint64_t addr, uint64_t timestamp,
+    uint64_t indexed_pos) {
+  std::lock_guard<std::shared_timed_mutex> lock(mutex_);
+  InsertLocked(addr, timestamp, indexed_pos);
+}
+
+inline void VersionIndex::Insert(const uint64_t addr[], uint32_t n,
+    uint64_t timestamp, uint8_t index, uint64_t pos, size_t page_size) {
+  std::lock_guard<std::shared_timed_mutex> lock(mutex_);
+  for (uint32_t i = 0; i < n; ++i) {
+    InsertLocked(addr[i], timestamp,
+        ToIndexedPosition(pos + page_size * i, index));
+  }
+}
+
+inline void VersionIndex::InsertLocked(uint64_t addr, uint64_t timestamp,
+    uint64_t indexed_pos) {
+  VersionList &list = versions_[addr];
+  if (list.empty() || list.back().timestamp <= timestamp) {
+    list.push_back({ timestamp, indexed_pos });
+  } else { // committed out of order
+    auto it = std::upper_bound(list.begin(), list.end(), timestamp,
+        [](uint64_t t, const Version &v) { return t < v.timestamp; });
+    list.insert(it, { timestamp, indexed_pos });
+  }
+}
+
+inline bool VersionIndex::Find(uint64_t addr, uint64_t timestamp,
+    uint64_t *indexed_pos, uint64_t *version) const {
+  std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+  auto entry = versions_.find(addr);
+  if (entry == versions_.end()) return false;
+  const VersionList &list = entry->second;
+  auto it = std::upper_bound(list.begin(), list.end(), timestamp,
+      [](uint64_t t, const Version &v) { return t < v.timestamp; });
+  if (it == list.begin()) return false;
+  *indexed_pos = (--it)->indexed_pos;
+  if (version) *version = it->timestamp;
+  return true;
+}
+
+inline void VersionIndex::Contains(const uint64_t addr[], uint32_t n,
+    uint64_t timestamp, uint8_t index, uint64_t pos, size_t page_size,
+    bool present[]) const {
+  std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+  for (uint32_t i = 0; i < n; ++i) {
+    present[i] = false;
+    auto entry = versions_.find(addr[i]);
+    if (entry == versions_.end()) continue;
+    uint64_t indexed_pos = ToIndexedPosition(pos + page_size * i, index);
+    for (const Version &v : entry->second) {
+      if (v.timestamp == timestamp && v.indexed_pos == indexed_pos) {
+        present[i] = true;
+        break;
+      }
+    }
+  }
+}
+
+inline void VersionIndex::InsertShared(uint64_t addr, uint64_t timestamp,
+    uint64_t indexed_pos, uint64_t target_addr, uint64_t target_timestamp) {
+  std::lock_guard<std::shared_timed_mutex> lock(mutex_);
+  InsertLocked(addr, timestamp, indexed_pos);
+  VersionKey target(target_addr, target_timestamp);
+  if (targets_.emplace(VersionKey(addr, timestamp), target).second) {
+    ++references_[target];
+  }
+}
+
+inline bool VersionIndex::Reference(uint64_t addr, uint64_t timestamp,
+    bool indexed) {
+  std::lock_guard<std::shared_timed_mutex> lock(mutex_);
+  if (indexed) {
+    auto entry = versions_.find(addr);
+    if (entry == versions_.end()) return false;
+    const VersionList &list = entry->second;
+    auto it = std::lower_bound(list.begin(), list.end(), timestamp,
+        [](const Version &v, uint64_t t) { return v.timestamp < t; });
+    if (it == list.end() || it->timestamp != timestamp) return false;
+  }
+  ++references_[VersionKey(addr, timestamp)];
+  return true;
+}
+
+inline void VersionIndex::Release(uint64_t addr, uint64_t timestamp) {
+  std::lock_guard<std::shared_timed_mutex> lock(mutex_);
+  ReleaseLocked(VersionKey(addr, timestamp));
+}
+
+inline void VersionIndex::ReleaseLocked(const VersionKey &key) {
+  auto it = references_.find(key);
+  if (it != references_.end() && !--it->second) references_.erase(it);
+}
+
+inline void VersionIndex::InsertOlder(const std::vector<Entry> &entries,
+    std::vector<Entry> *shared) {
+  VersionList merged;
+  size_t i = 0;
+  while (i < entries.size()) {
+    std::lock_guard<std::shared_timed_mutex> lock(mutex_);
+    for (size_t b = 0; b < kScanBuckets && i < entries.size(); ++b) {
+      const uint64_t addr = entries[i].addr;
+      VersionList &list = versions_[addr];
+      merged.clear();
+      auto it = list.begin();
+      for (; i < entries.size() && entries[i].addr == addr; ++i) {
+        const Entry &e = entries[i];
+        while (it != list.end() && it->timestamp < e.timestamp) {
+          merged.push_back(*it++);
+        }
+        if (it != list.end() && it->timestamp == e.timestamp) continue;
+        if (IsSharedPosition(e.indexed_pos)) {
+          shared->push_back(e);
+        } else {
+          merged.push_back({ e.timestamp, e.indexed_pos });
+        }
+      }
+      merged.insert(merged.end(), it, list.end());
+      list.swap(merged);
+    }
+  }
+}
+
+// A version stays visible until the timestamp of the next one. A delta is
+// based on the version before it. A version released by a pruned reference
+// is left for the next time.
+inline size_t VersionIndex::Prune(uint64_t horizon,
+    const std::vector<uint64_t> &pins) {
+  size_t count = 0;
+  std::vector<bool> live;
+  for (size_t bucket = 0; ; bucket += kScanBuckets) {
+    std::lock_guard<std::shared_timed_mutex> lock(mutex_);
+    size_t num_buckets = versions_.bucket_count();
+    if (bucket >= num_buckets) break;
+    for (size_t b = bucket; b < std::min(bucket + kScanBuckets, num_buckets);
+        ++b) {
+      for (auto it = versions_.begin(b); it != versions_.end(b); ++it) {
+        VersionList &list = it->second;
+        live.assign(list.size(), false);
+        bool based = false; // the next version is a kept delta
+        for (size_t i = list.size(); i-- > 0;) {
+          live[i] = (i + 1 == list.size()) || based;
+          if (!live[i] && list[i + 1].timestamp != list[i].timestamp) {
+            uint64_t next = list[i + 1].timestamp;
+            auto pin = std::lower_bound(pins.begin(), pins.end(),
+                list[i].timestamp);
+            live[i] = next > horizon || (pin != pins.end() && *pin < next);
+          }
+          if (!live[i] && !references_.empty()) {
+            live[i] = references_.count(VersionKey(it->first,
+                list[i].timestamp));
+          }
+          based = live[i] && IsBasedPosition(list[i].indexed_pos);
+        }
+        size_t j = 0;
+        for (size_t i = 0; i < list.size(); ++i) {
+          if (live[i]) {
+            list[j++] = list[i];
+          } else if (IsSharedPosition(list[i].indexed_pos)) {
+            auto target = targets_.find(VersionKey(it->first,
+                list[i].timestamp));
+            if (target == targets_.end()) continue;
+            ReleaseLocked(target->second);
+            targets_.erase(target);
+          }
+        }
+        count += list.size() - j;
+        list.resize(j);
+      }
+    }
+  }
+  return count;
+}
+
+// Starts over if a rehash happens in between, since nothing may be missed.
+inline void VersionIndex::Collect(uint8_t index, uint64_t begin,
+    uint64_t end, std::vector<Location> *locations) const {
+  const size_t size = locations->size();
+  size_t bucket = 0, first_count = 0;
+  while (true) {
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    size_t num_buckets = versions_.bucket_count();
+    if (!bucket) {
+      first_count = num_buckets;
+    } else if (num_buckets != first_count) {
+      locations->resize(size);
+      bucket = 0;
+      continue;
+    }
+    if (bucket >= num_buckets) break;
+    for (size_t b = bucket; b < std::min(bucket + kScanBuckets, num_buckets);
+        ++b) {
+      for (auto it = versions_.begin(b); it != versions_.end(b); ++it) {
+        for (const Version &v : it->second) {
+          uint64_t pos = v.indexed_pos;
+          if (ParseIndexedPosition(&pos) != index) continue;
+          uint64_t flags = pos & kEntryFlags;
+          pos &= ~kEntryFlags;
+          if (pos >= begin && pos < end) {
+            locations->push_back({ it->first, v.timestamp, pos, flags });
+          }
+        }
+      }
+    }
+    bucket += kScanBuckets;
+  }
+}
+
+inline uint32_t VersionIndex::Relocate(const uint64_t addr[], uint32_t n,
+    uint64_t timestamp, uint8_t index, uint64_t old_pos, uint64_t new_pos,
+    size_t page_size) {
+  std::lock_guard<std::shared_timed_mutex> lock(mutex_);
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < n; ++i) {
+    auto entry = versions_.find(addr[i]);
+    if (entry == versions_.end()) continue;
+    uint64_t from = ToIndexedPosition(old_pos + page_size * i, index);
+    for (Version &v : entry->second) {
+      if (v.timestamp == timestamp && v.indexed_pos == from) {
+        v.indexed_pos = ToIndexedPosition(new_pos + page_size * i, index);
+        ++count;
+        break;
+      }
+    }
+  }
+  return count;
+}
+
+inline size_t VersionIndex::size() const {
+  std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+  return versions_.size();
+}
+
+} // namespace plib
+
+#endif // VM_PERSISTENCE_PLIB_VERSION_INDEX_H_
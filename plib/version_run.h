@@ -0,0 +1,477 @@
+//
+//  version_run.h
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 25, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#ifndef VM_PERSISTENCE_PLIB_VERSION_RUN_H_
+#define VM_PERSISTENCE_PLIB_VERSION_RUN_H_
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "format.h"
+#include "version_index.h"
+
+namespace plib {
+
+// Run format
+//
+// A run persists the versions indexed from the metadata records in
+// [meta_begin, meta_end) of a metadata file, as entries sorted by address
+// and then timestamp, after a header with its own CRC32C. A run is written
+// under a temporary name and renamed once synced, so that it is either
+// whole or absent. It is mapped read-only and searched in place, so its
+// entries are not checksummed, which would take reading all of them.
+
+struct RunHeader {
+  uint32_t magic;
+  uint32_t checksum; // CRC32C of the rest of the header
+  uint64_t num_entries;
+  uint64_t meta_begin;
+  uint64_t meta_end;
+  uint64_t max_timestamp;
+};
+
+static const uint32_t kRunMagic = 0x706c7200; // "plr"
+
+using RunEntry = VersionIndex::Entry;
+
+inline bool RunEntryLess(const RunEntry &a, const RunEntry &b) {
+  return a.addr < b.addr || (a.addr == b.addr && a.timestamp < b.timestamp);
+}
+
+inline uint32_t RunHeaderChecksum(const RunHeader &header) {
+  const size_t skip = offsetof(RunHeader, num_entries);
+  return CRC32C(0, (const char *)&header + skip, sizeof(header) - skip);
+}
+
+// A run mapped into memory
+class VersionRun {
+ public:
+  VersionRun() : header_(nullptr), size_(0) {}
+  ~VersionRun();
+  VersionRun(const VersionRun &) = delete;
+  VersionRun &operator=(const VersionRun &) = delete;
+
+  // Writes the sorted entries as a run of the range. Returns zero on
+  // success.
+  static int Write(const std::string &name,
+      const std::vector<RunEntry> &entries, uint64_t meta_begin,
+      uint64_t meta_end, uint64_t max_timestamp);
+  // Maps the run and verifies its header. Returns zero on success.
+  int Open(const std::string &name);
+
+  const std::string &name() const { return name_; }
+  uint64_t meta_begin() const { return header_->meta_begin; }
+  uint64_t meta_end() const { return header_->meta_end; }
+  uint64_t max_timestamp() const { return header_->max_timestamp; }
+  size_t size() const { return header_->num_entries; }
+  const RunEntry *begin() const { return (const RunEntry *)(header_ + 1); }
+  const RunEntry *end() const { return begin() + size(); }
+
+  // Finds the newest entry of the address at or before the timestamp whose
+  // position the predicate accepts. Returns nullptr if none.
+  template <class Valid>
+  const RunEntry *Find(uint64_t addr, uint64_t timestamp, Valid valid) const;
+
+ private:
+  std::string name_;
+  const RunHeader *header_;
+  size_t size_; // of the mapping
+};
+
+// The runs of a metadata file, named NAME.run.BEGIN-END by their ranges in
+// hex, which form a chain covering the file from its beginning. A new run
+// covers the records after the last one. The last two runs are merged
+// while the one before is at most twice as large, so that there are
+// logarithmically many. Lookups probe each run by binary search, and an
+// entry in a newer run shadows one of the same address and timestamp in an
+// older run, e.g., of a version relocated by compaction.
+// Appending, merging and dropping runs are not concurrent with each other.
+class VersionRuns {
+ public:
+  VersionRuns() : end_(0), max_timestamp_(0) {}
+
+  // Maps the chain of runs of the metadata file that starts at or before
+  // the beginning and stops before the end of the file. Other runs are
+  // ignored.
+  void Open(const std::string &name, off_t begin, off_t end);
+  // Deletes the files of runs ignored, including those left by crashes.
+  void RemoveUnused();
+
+  size_t size() const;
+  bool empty() const { return !size(); }
+  size_t num_entries() const;
+  // End of the metadata covered, or zero if nothing has been
+  off_t end() const { return end_; }
+  uint64_t max_timestamp() const { return max_timestamp_; }
+
+  // Finds the newest version of the address at or before the timestamp,
+  // among the entries whose positions the predicate accepts.
+  template <class Valid>
+  bool Find(uint64_t addr, uint64_t timestamp, Valid valid,
+      uint64_t *indexed_pos, uint64_t *version = nullptr) const;
+  // Collects the entries of all runs, sorted, each the newest accepted one
+  // of its address and timestamp.
+  template <class Valid>
+  void Collect(Valid valid, std::vector<RunEntry> *entries) const;
+
+  // Persists the entries of the records in [begin, end) as a new run
+  // after the others, sorted in place and dropping those the predicate
+  // rejects, and merges the newest runs. Returns zero on success.
+  template <class Valid>
+  int Append(std::vector<RunEntry> *entries, off_t begin, off_t end,
+      uint64_t max_timestamp, Valid valid);
+  // Deletes the runs that end at or before the position, whose records
+  // have been compacted and copied after it.
+  void DropBefore(off_t pos);
+
+  static const size_t kMergeRatio = 2;
+  static const size_t kMaxRuns = 16;
+
+ private:
+  std::string RunName(uint64_t begin, uint64_t end) const;
+  // Paths of the run files of the metadata file, including temporary ones
+  std::vector<std::string> ListFiles() const;
+  // Keeps the newest accepted entry of each address and timestamp among
+  // the sorted entries, where newer ones follow older ones.
+  template <class Valid>
+  static void Normalize(std::vector<RunEntry> *entries, Valid valid);
+  template <class Valid>
+  int MergeLast(Valid valid);
+
+  std::string name_;
+  std::vector<std::shared_ptr<VersionRun>> runs_; // from old to new
+  std::atomic<off_t> end_;
+  std::atomic<uint64_t> max_timestamp_;
+  mutable std::shared_timed_mutex mutex_; // exclusive to change the runs
+};
+
+// Implementation of VersionRun
+
+inline VersionRun::~VersionRun() {
+  if (header_) munmap((void *)header_, size_);
+}
+
+inline int VersionRun::Write(const std::string &name,
+    const std::vector<RunEntry> &entries, uint64_t meta_begin,
+    uint64_t meta_end, uint64_t max_timestamp) {
+  RunHeader header = { kRunMagic, 0, entries.size(), meta_begin, meta_end,
+      max_timestamp };
+  header.checksum = RunHeaderChecksum(header);
+  std::string temp = name + ".tmp";
+  mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP;
+  int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+  if (fd < 0) {
+    perror("[ERROR] VersionRun::Write open");
+    return -1;
+  }
+  iovec iov[2] = { { &header, sizeof(header) },
+      { (void *)entries.data(), sizeof(RunEntry) * entries.size() } };
+  int iovcnt = 2;
+  iovec *v = iov;
+  int err = 0;
+  while (iovcnt && !err) { // resumes short writes
+    ssize_t ret = writev(fd, v, iovcnt);
+    if (ret < 0) {
+      if (errno != EINTR) err = errno;
+      continue;
+    }
+    while (iovcnt && (size_t)ret >= v->iov_len) {
+      ret -= v->iov_len;
+      ++v;
+      --iovcnt;
+    }
+    if (iovcnt) {
+      v->iov_base = (char *)v->iov_base + ret;
+      v->iov_len -= ret;
+    }
+  }
+  if (!err && fdatasync(fd)) err = errno;
+  close(fd);
+  if (err || rename(temp.c_str(), name.c_str())) {
+    perror("[ERROR] VersionRun::Write");
+    unlink(temp.c_str());
+    return -1;
+  }
+  // Makes the rename durable.
+  size_t slash = name.rfind('/');
+  std::string dir = (slash == std::string::npos) ? "." :
+      name.substr(0, slash + 1);
+  int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+  return 0;
+}
+
+// Lookups touch a few entries far apart, so readahead is disabled.
+inline int VersionRun::Open(const std::string &name) {
+  int fd = open(name.c_str(), O_RDONLY);
+  if (fd < 0) return -1;
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < (off_t)sizeof(RunHeader)) {
+    close(fd);
+    return -1;
+  }
+  void *mem = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) return -1;
+  const RunHeader *header = (const RunHeader *)mem;
+  if (header->magic != kRunMagic ||
+      header->checksum != RunHeaderChecksum(*header) ||
+      sizeof(RunHeader) + sizeof(RunEntry) * header->num_entries !=
+      (uint64_t)st.st_size) {
+    munmap(mem, st.st_size);
+    return -1;
+  }
+  madvise(mem, st.st_size, MADV_RANDOM);
+  if (header_) munmap((void *)header_, size_);
+  name_ = name;
+  header_ = header;
+  size_ = st.st_size;
+  return 0;
+}
+
+template <class Valid>
+const RunEntry *VersionRun::Find(uint64_t addr, uint64_t timestamp,
+    Valid valid) const {
+  const RunEntry key = { addr, timestamp, 0 };
+  const RunEntry *it = std::upper_bound(begin(), end(), key, RunEntryLess);
+  while (it != begin()) {
+    --it;
+    if (it->addr != addr) break;
+    if (valid(it->indexed_pos)) return it;
+  }
+  return nullptr;
+}
+
+// Implementation of VersionRuns
+
+inline std::string VersionRuns::RunName(uint64_t begin, uint64_t end) const {
+  char suffix[48];
+  snprintf(suffix, sizeof(suffix), ".run.%016" PRIx64 "-%016" PRIx64,
+      begin, end);
+  return name_ + suffix;
+}
+
+inline std::vector<std::string> VersionRuns::ListFiles() const {
+  std::vector<std::string> paths;
+  size_t slash = name_.rfind('/');
+  std::string dir = (slash == std::string::npos) ? "." :
+      name_.substr(0, slash + 1);
+  std::string prefix = name_.substr(slash == std::string::npos ? 0 :
+      slash + 1) + ".run.";
+  DIR *dp = opendir(dir.c_str());
+  if (!dp) return paths;
+  while (dirent *entry = readdir(dp)) {
+    std::string file(entry->d_name);
+    if (file.compare(0, prefix.size(), prefix)) continue;
+    paths.push_back(slash == std::string::npos ? file : dir + file);
+  }
+  closedir(dp);
+  return paths;
+}
+
+// Among runs starting at the same point, the longest is a merge of the
+// others left by a crash.
+inline void VersionRuns::Open(const std::string &name, off_t begin,
+    off_t end) {
+  name_ = name;
+  std::vector<std::shared_ptr<VersionRun>> found;
+  for (const std::string &path : ListFiles()) {
+    std::shared_ptr<VersionRun> run(new VersionRun());
+    if (!run->Open(path)) found.push_back(run);
+  }
+
+  std::lock_guard<std::shared_timed_mutex> lock(mutex_);
+  runs_.clear();
+  off_t covered = begin;
+  uint64_t max_timestamp = 0;
+  while (true) {
+    std::shared_ptr<VersionRun> next;
+    for (const std::shared_ptr<VersionRun> &run : found) {
+      off_t run_begin = run->meta_begin(), run_end = run->meta_end();
+      if ((runs_.empty() ? run_begin > covered : run_begin != covered) ||
+          run_end <= covered || run_end > end) continue;
+      if (!next || run_end > (off_t)next->meta_end()) next = run;
+    }
+    if (!next) break;
+    runs_.push_back(next);
+    covered = next->meta_end();
+    max_timestamp = std::max(max_timestamp, next->max_timestamp());
+  }
+  end_ = runs_.empty() ? 0 : covered;
+  max_timestamp_ = max_timestamp;
+}
+
+inline void VersionRuns::RemoveUnused() {
+  std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+  for (const std::string &path : ListFiles()) {
+    bool used = false;
+    for (const std::shared_ptr<VersionRun> &run : runs_) {
+      used |= (run->name() == path);
+    }
+    if (!used) unlink(path.c_str());
+  }
+}
+
+inline size_t VersionRuns::size() const {
+  std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+  return runs_.size();
+}
+
+inline size_t VersionRuns::num_entries() const {
+  std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+  size_t n = 0;
+  for (const std::shared_ptr<VersionRun> &run : runs_) {
+    n += run->size();
+  }
+  return n;
+}
+
+// Ties go to the newer run.
+template <class Valid>
+bool VersionRuns::Find(uint64_t addr, uint64_t timestamp, Valid valid,
+    uint64_t *indexed_pos, uint64_t *version) const {
+  std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+  const RunEntry *found = nullptr;
+  for (const std::shared_ptr<VersionRun> &run : runs_) {
+    const RunEntry *e = run->Find(addr, timestamp, valid);
+    if (e && (!found || e->timestamp >= found->timestamp)) found = e;
+  }
+  if (!found) return false;
+  *indexed_pos = found->indexed_pos;
+  if (version) *version = found->timestamp;
+  return true;
+}
+
+template <class Valid>
+void VersionRuns::Normalize(std::vector<RunEntry> *entries, Valid valid) {
+  std::vector<RunEntry> &e = *entries;
+  size_t n = 0;
+  for (size_t i = 0; i < e.size();) {
+    size_t j = i + 1;
+    while (j < e.size() && e[j].addr == e[i].addr &&
+        e[j].timestamp == e[i].timestamp) {
+      ++j;
+    }
+    for (size_t k = j; k-- > i;) {
+      if (valid(e[k].indexed_pos)) {
+        e[n++] = e[k];
+        break;
+      }
+    }
+    i = j;
+  }
+  e.resize(n);
+}
+
+template <class Valid>
+void VersionRuns::Collect(Valid valid,
+    std::vector<RunEntry> *entries) const {
+  std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+  entries->clear();
+  for (const std::shared_ptr<VersionRun> &run : runs_) {
+    size_t middle = entries->size();
+    entries->insert(entries->end(), run->begin(), run->end());
+    std::inplace_merge(entries->begin(), entries->begin() + middle,
+        entries->end(), RunEntryLess);
+  }
+  Normalize(entries, valid);
+}
+
+template <class Valid>
+int VersionRuns::Append(std::vector<RunEntry> *entries, off_t begin,
+    off_t end, uint64_t max_timestamp, Valid valid) {
+  std::stable_sort(entries->begin(), entries->end(), RunEntryLess);
+  Normalize(entries, valid);
+  std::string name = RunName(begin, end);
+  std::shared_ptr<VersionRun> run(new VersionRun());
+  if (VersionRun::Write(name, *entries, begin, end, max_timestamp) ||
+      run->Open(name)) {
+    return -1;
+  }
+  {
+    std::lock_guard<std::shared_timed_mutex> lock(mutex_);
+    runs_.push_back(run);
+  }
+  end_ = end;
+  if (max_timestamp > max_timestamp_) max_timestamp_ = max_timestamp;
+
+  while (runs_.size() >= 2 && (runs_.size() > kMaxRuns ||
+      runs_[runs_.size() - 2]->size() <= kMergeRatio * runs_.back()->size())) {
+    if (MergeLast(valid)) return -1;
+  }
+  return 0;
+}
+
+// The merged run replaces the two before they are deleted, so that a crash
+// in between leaves all three, and the merged one is chosen at open.
+template <class Valid>
+int VersionRuns::MergeLast(Valid valid) {
+  const size_t n = runs_.size();
+  const VersionRun &older = *runs_[n - 2];
+  const VersionRun &newer = *runs_[n - 1];
+  std::vector<RunEntry> entries(older.begin(), older.end());
+  entries.insert(entries.end(), newer.begin(), newer.end());
+  std::inplace_merge(entries.begin(), entries.begin() + older.size(),
+      entries.end(), RunEntryLess);
+  Normalize(&entries, valid);
+
+  std::string name = RunName(older.meta_begin(), newer.meta_end());
+  std::shared_ptr<VersionRun> run(new VersionRun());
+  if (VersionRun::Write(name, entries, older.meta_begin(), newer.meta_end(),
+      std::max(older.max_timestamp(), newer.max_timestamp())) ||
+      run->Open(name)) {
+    return -1;
+  }
+  std::string older_name = older.name(), newer_name = newer.name();
+  {
+    std::lock_guard<std::shared_timed_mutex> lock(mutex_);
+    runs_.resize(n - 2);
+    runs_.push_back(run);
+  }
+  unlink(older_name.c_str());
+  unlink(newer_name.c_str());
+  return 0;
+}
+
+inline void VersionRuns::DropBefore(off_t pos) {
+  std::vector<std::string> names;
+  {
+    std::lock_guard<std::shared_timed_mutex> lock(mutex_);
+    while (!runs_.empty() && (off_t)runs_.front()->meta_end() <= pos) {
+      names.push_back(runs_.front()->name());
+      runs_.erase(runs_.begin());
+    }
+  }
+  for (const std::string &name : names) {
+    unlink(name.c_str());
+  }
+}
+
+} // namespace plib
+
+#endif // VM_PERSISTENCE_PLIB_VERSION_RUN_H_
@@ -13,12 +13,23 @@
 
 namespace plib {
 
+// One commit in a batch: n entries of data and their metadata words.
+template <typename DataEntry>
+struct CommitEntry {
+  DataEntry *data;
+  uint64_t *metadata;
+  uint32_t n;
+  uint64_t timestamp;
+};
+
 template <typename DataEntry>
 class VersionedPersistence {
  public:
   virtual void *Submit(DataEntry data[], uint32_t n) = 0;
   virtual int Commit(void *handle, uint64_t timestamp,
       uint64_t metadata[], uint32_t n) = 0;
+  // Submits and commits the entries in order. Returns the first error.
+  virtual int CommitBatch(const CommitEntry<DataEntry> entries[], int count);
 
   virtual void **CheckoutPages(uint64_t timestamp, uint64_t addr[], int n) = 0;
   virtual void DestroyPages(void *pages[], int n) = 0;
@@ -26,6 +37,19 @@ class VersionedPersistence {
   virtual ~VersionedPersistence() { }
 };
 
+template <typename DataEntry>
+int VersionedPersistence<DataEntry>::CommitBatch(
+    const CommitEntry<DataEntry> entries[], int count) {
+  int err = 0;
+  for (int i = 0; i < count; ++i) {
+    const CommitEntry<DataEntry> &e = entries[i];
+    void *handle = Submit(e.data, e.n);
+    int ret = Commit(handle, e.timestamp, e.metadata, e.n);
+    if (ret && !err) err = ret;
+  }
+  return err;
+}
+
 } // namespace plib
 
 #endif // VM_PERSISTENCE_PLIB_VERSIONED_PERSISTENCE_H_
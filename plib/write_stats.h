@@ -0,0 +1,115 @@
+//
+//  write_stats.h
+//  vm_persistence
+//
+//  Created by Jinglei Ren on Jun. 24, 2015.
+//  Copyright (c) 2015 Jinglei Ren <jinglei@ren.systems>.
+//
+
+#ifndef VM_PERSISTENCE_PLIB_WRITE_STATS_H_
+#define VM_PERSISTENCE_PLIB_WRITE_STATS_H_
+
+#include <cstdint>
+#include <atomic>
+
+namespace plib {
+
+// Bytes persisted on behalf of commits, by kind, and the writes that carry
+// them to the device
+struct WriteStats {
+  uint64_t payload_bytes; // data as committed
+  uint64_t header_bytes; // data headers, checksums and frames
+  uint64_t padding_bytes; // filled to sizes, blocks and alignments
+  uint64_t metadata_bytes; // metadata records
+  uint64_t write_calls; // system calls or device commands
+  uint64_t device_bytes; // bytes handed to those writes
+
+  // Device bytes per payload byte
+  double amplification() const {
+    return payload_bytes ? (double)device_bytes / payload_bytes : 0;
+  }
+  double average_write_size() const {
+    return write_calls ? (double)device_bytes / write_calls : 0;
+  }
+};
+
+// Counters of WriteStats updated by concurrent threads. Each thread adds to
+// one of a few stripes on their own cache lines, with relaxed atomics, and
+// a query sums up the stripes. A query racing with updates may see some of
+// them but not others.
+class WriteCounters {
+ public:
+  void AddRecord(uint64_t payload, uint64_t header, uint64_t padding = 0);
+  void AddMeta(uint64_t nbytes);
+  void AddPadding(uint64_t nbytes);
+  void AddWrites(uint64_t calls, uint64_t nbytes);
+
+  WriteStats stats() const;
+
+  static const int kNumStripes = 16;
+
+ private:
+  struct alignas(64) Stripe {
+    std::atomic<uint64_t> payload_bytes{0};
+    std::atomic<uint64_t> header_bytes{0};
+    std::atomic<uint64_t> padding_bytes{0};
+    std::atomic<uint64_t> metadata_bytes{0};
+    std::atomic<uint64_t> write_calls{0};
+    std::atomic<uint64_t> device_bytes{0};
+  };
+
+  static void Add(std::atomic<uint64_t> &counter, uint64_t value) {
+    if (value) counter.fetch_add(value, std::memory_order_relaxed);
+  }
+  Stripe &stripe();
+
+  Stripe stripes_[kNumStripes];
+};
+
+// Implementation of WriteCounters
+
+// Threads take stripes in turn as they first update any counters.
+inline WriteCounters::Stripe &WriteCounters::stripe() {
+  static std::atomic_uint next_stripe(0);
+  static thread_local unsigned int i = next_stripe++ % kNumStripes;
+  return stripes_[i];
+}
+
+inline void WriteCounters::AddRecord(uint64_t payload, uint64_t header,
+    uint64_t padding) {
+  Stripe &s = stripe();
+  Add(s.payload_bytes, payload);
+  Add(s.header_bytes, header);
+  Add(s.padding_bytes, padding);
+}
+
+inline void WriteCounters::AddMeta(uint64_t nbytes) {
+  Add(stripe().metadata_bytes, nbytes);
+}
+
+inline void WriteCounters::AddPadding(uint64_t nbytes) {
+  Add(stripe().padding_bytes, nbytes);
+}
+
+inline void WriteCounters::AddWrites(uint64_t calls, uint64_t nbytes) {
+  Stripe &s = stripe();
+  Add(s.write_calls, calls);
+  Add(s.device_bytes, nbytes);
+}
+
+inline WriteStats WriteCounters::stats() const {
+  WriteStats total = {};
+  for (const Stripe &s : stripes_) {
+    total.payload_bytes += s.payload_bytes.load(std::memory_order_relaxed);
+    total.header_bytes += s.header_bytes.load(std::memory_order_relaxed);
+    total.padding_bytes += s.padding_bytes.load(std::memory_order_relaxed);
+    total.metadata_bytes += s.metadata_bytes.load(std::memory_order_relaxed);
+    total.write_calls += s.write_calls.load(std::memory_order_relaxed);
+    total.device_bytes += s.device_bytes.load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+} // namespace plib
+
+#endif // VM_PERSISTENCE_PLIB_WRITE_STATS_H_